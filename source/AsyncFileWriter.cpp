@@ -0,0 +1,141 @@
+#include "AsyncFileWriter.h"
+#include "Metrics.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+AsyncFileWriter::AsyncFileWriter(MappedFile *file)
+{
+    _file = file;
+    for (size_t i = 0; i < WRITER_BUFFERS; i++)
+    {
+        _buffers[i] = new unsigned char[WRITER_BUFFER_SIZE];
+        _lengths[i] = 0;
+        _offsets[i] = 0;
+    }
+
+    _filling = 0;
+    _queued = 0;
+    _closing = false;
+    _committedEnd = 0;
+
+    _writer = thread(&AsyncFileWriter::writerLoop, this);
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _closing = true;
+    }
+    _bufferFilled.notify_all();
+    _writer.join();
+
+    for (size_t i = 0; i < WRITER_BUFFERS; i++)
+    {
+        delete[] _buffers[i];
+    }
+}
+
+void AsyncFileWriter::writerLoop()
+{
+    int fd = _file->getDescriptor();
+
+    for (;;)
+    {
+        size_t index;
+        {
+            unique_lock<mutex> lock(_mutex);
+            _bufferFilled.wait(lock, [this] { return _closing || _queued > 0; });
+            if (_closing || !_error.empty())
+                return;
+
+            // the oldest buffer handed over
+            index = (_filling + WRITER_BUFFERS - _queued) % WRITER_BUFFERS;
+        }
+
+        // the buffer is not touched by the caller until it is freed below
+        size_t length = _lengths[index];
+        uint64_t offset = _offsets[index];
+        size_t written = 0;
+        string error;
+        while (written < length)
+        {
+            ssize_t ret = pwrite(fd, _buffers[index] + written, length - written, offset + written);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+            {
+                error = ret < 0 ? strerror(errno) : "short write";
+                break;
+            }
+            written += ret;
+        }
+        // write-back and eviction hints follow the bytes on disk, not the network
+        _file->advise(offset + written);
+
+        {
+            lock_guard<mutex> lock(_mutex);
+            _queued -= 1;
+            _error = error;
+        }
+        _bufferFreed.notify_all();
+
+        if (!error.empty())
+            return;
+    }
+}
+
+void AsyncFileWriter::throwIfFailed()
+{
+    // called with _mutex held
+    if (!_error.empty())
+        throw FileWriteException(_error);
+}
+
+unsigned char *AsyncFileWriter::acquire()
+{
+    unique_lock<mutex> lock(_mutex);
+    throwIfFailed();
+
+    if (_queued == WRITER_BUFFERS)
+    {
+        // the disk is behind the network
+        Metrics::increment("writer_backpressure_waits_total");
+        _bufferFreed.wait(lock, [this] { return _queued < WRITER_BUFFERS || !_error.empty(); });
+        throwIfFailed();
+    }
+
+    return _buffers[_filling];
+}
+
+void AsyncFileWriter::commit(uint64_t offset, size_t length)
+{
+    if (length == 0)
+        return;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _lengths[_filling] = length;
+        _offsets[_filling] = offset;
+        _committedEnd = offset + length;
+        _filling = (_filling + 1) % WRITER_BUFFERS;
+        _queued += 1;
+    }
+    _bufferFilled.notify_one();
+}
+
+void AsyncFileWriter::finish()
+{
+    unique_lock<mutex> lock(_mutex);
+    _bufferFreed.wait(lock, [this] { return _queued == 0 || !_error.empty(); });
+    throwIfFailed();
+}
+
+uint64_t AsyncFileWriter::getCommittedEnd()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _committedEnd;
+}
@@ -0,0 +1,74 @@
+#ifndef ASYNC_FILE_WRITER
+#define ASYNC_FILE_WRITER
+
+#include "MappedFile.h"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define WRITER_BUFFER_SIZE 1048576 //bytes per buffer of the ring
+#define WRITER_BUFFERS 4           //buffers filled by the network while the disk catches up
+
+class FileWriteException : public std::exception
+{
+    private:
+    std::string _reason;
+
+    public:
+    FileWriteException(const std::string &reason)
+    {
+        _reason = reason;
+    }
+
+    const char *what() const throw()
+    {
+        return _reason.c_str();
+    }
+};
+
+// Writes a file from a dedicated thread, fed through a bounded ring of
+// buffers: the caller fills one buffer while the previous ones go to disk.
+// When every buffer is waiting for the disk, acquire() blocks (backpressure);
+// a failed write is reported by the next acquire() or by finish().
+class AsyncFileWriter
+{
+private:
+    MappedFile *_file;
+    unsigned char *_buffers[WRITER_BUFFERS];
+    size_t _lengths[WRITER_BUFFERS];
+    uint64_t _offsets[WRITER_BUFFERS];
+
+    std::mutex _mutex;
+    std::condition_variable _bufferFilled;
+    std::condition_variable _bufferFreed;
+    size_t _filling;  // buffer owned by the caller
+    size_t _queued;   // buffers waiting for the writer thread
+    bool _closing;
+    std::string _error;
+    uint64_t _committedEnd;
+
+    std::thread _writer;
+
+    void writerLoop();
+    void throwIfFailed();
+
+public:
+    AsyncFileWriter(MappedFile *file);
+    // stops the writer, whatever was not written yet is dropped
+    ~AsyncFileWriter();
+
+    // buffer of WRITER_BUFFER_SIZE bytes to fill, blocks while the ring is full
+    unsigned char *acquire();
+    // hands the first length bytes of the acquired buffer to the writer,
+    // to be written at offset
+    void commit(uint64_t offset, size_t length);
+    // waits for every committed byte to be on the file
+    void finish();
+    // end of the furthest range committed (ranges are committed in order):
+    // once finish() has returned, the file holds every byte before it
+    uint64_t getCommittedEnd();
+};
+
+#endif
@@ -1,53 +1,228 @@
 #include "CertificationValidator.h"
+#include "Printer.h"
 #include <openssl/x509_vfy.h>
 #include <openssl/pem.h>
+#include <openssl/evp.h>
+#include <sys/stat.h>
+#include <fstream>
 #include <iostream>
 
 using namespace std;
 
-CertificationValidator::CertificationValidator(string* names, int dim)
+CertificationValidator::FileVersion CertificationValidator::fileVersion(const string &filename)
 {
-  _store = X509_STORE_new();
+  FileVersion version;
+  version.mtime.tv_sec = 0;
+  version.mtime.tv_nsec = 0;
+  version.size = -1;
 
-  _numberOfNames = dim;
-  _names = new string[_numberOfNames];
+  struct stat st;
+  if(stat(filename.c_str(), &st) == 0)
+  {
+    version.mtime = st.st_mtim;
+    version.size = st.st_size;
+  }
+  return version;
+}
+
+bool CertificationValidator::FileVersion::operator==(const FileVersion &other) const
+{
+  return mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec && size == other.size;
+}
+
+CertificationValidator::TrustAnchors::TrustAnchors()
+{
+  store = X509_STORE_new();
+}
 
-  for(int i = 0; i < _numberOfNames ; i++)
+CertificationValidator::TrustAnchors::~TrustAnchors()
+{
+  X509_STORE_free(store);
+}
+
+CertificationValidator::CertificationValidator(const char* namesFile, const char* caFile)
+{
+  _namesFile = namesFile;
+  _caFile = caFile;
+  _namesVersion = fileVersion(_namesFile);
+  _caVersion = fileVersion(_caFile);
+  _lastReloadCheck = time(NULL);
+
+  _anchors = loadAnchors();
+  if(!_anchors)
   {
-    _names[i] = string(names[i]);
-  }    
+    throw FileNotFoundException();
+  }
 }
 
-bool CertificationValidator::verifyName(string nameToVerify)
+shared_ptr<CertificationValidator::TrustAnchors> CertificationValidator::loadAnchors()
 {
-  for(int i = 0; i<_numberOfNames ; i++)
+  shared_ptr<TrustAnchors> anchors = make_shared<TrustAnchors>();
+
+  ifstream is(_namesFile.c_str());
+  if(!is.is_open())
+  {
+    return NULL;
+  }
+
+  string name;
+  while(getline(is, name))
   {
-    if(_names[i] == nameToVerify)
-      return true;
+    if(!name.empty())
+      anchors->names.insert(name);
   }
+  is.close();
 
-  return false;
+  FILE* file = fopen(_caFile.c_str(), "r");
+  if(!file)
+  {
+    Printer::printWaring("not possible load CA certificate from file");
+    return NULL;
+  }
+
+  // the CA file may hold a bundle: every certificate in it is trusted
+  X509* caCert;
+  int loaded = 0;
+  while((caCert = PEM_read_X509(file, NULL, NULL, NULL)) != NULL)
+  {
+    if(X509_STORE_add_cert(anchors->store, caCert) == 1)
+      loaded++;
+    X509_free(caCert);
+  }
+  fclose(file);
+
+  // an empty store would refuse every peer: half written, or not a CA file
+  if(loaded == 0)
+  {
+    Printer::printWaring("no CA certificate in the CA file");
+    return NULL;
+  }
 
+  return anchors;
 }
 
-bool CertificationValidator::verifyCertificate(X509* cert)
+void CertificationValidator::reloadIfChanged()
+{
+  // called with _mutex held
+  time_t now = time(NULL);
+  if(now - _lastReloadCheck < TRUST_RELOAD_CHECK_INTERVAL)
+    return;
+  _lastReloadCheck = now;
+
+  FileVersion namesVersion = fileVersion(_namesFile);
+  FileVersion caVersion = fileVersion(_caFile);
+  if(namesVersion == _namesVersion && caVersion == _caVersion)
+    return;
+
+  // not recorded as loaded: the next check tries again
+  shared_ptr<TrustAnchors> anchors = loadAnchors();
+  if(!anchors)
+  {
+    Printer::printWaring("trust files changed but could not be loaded, keeping the previous ones");
+    return;
+  }
+
+  _namesVersion = namesVersion;
+  _caVersion = caVersion;
+  _anchors = anchors;
+  _cache.clear();
+
+  Printer::printInfo("Allow-list and CA certificates reloaded");
+}
+
+shared_ptr<CertificationValidator::TrustAnchors> CertificationValidator::currentAnchors()
+{
+  lock_guard<mutex> lock(_mutex);
+  reloadIfChanged();
+  return _anchors;
+}
+
+string CertificationValidator::fingerprint(X509* cert)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdLen;
+
+  if(!X509_digest(cert, EVP_sha256(), md, &mdLen))
+    return "";
+
+  return string((char*)md, mdLen);
+}
+
+bool CertificationValidator::lookupCache(const string &fp, bool &valid)
 {
-  if(_store == NULL){
+  lock_guard<mutex> lock(_mutex);
+  unordered_map<string, CachedVerification>::iterator it = _cache.find(fp);
+  if(it == _cache.end())
     return false;
+
+  if(it->second.expiry <= time(NULL))
+  {
+    _cache.erase(it);
+    return false;
+  }
+
+  valid = it->second.valid;
+  return true;
+}
+
+void CertificationValidator::storeInCache(const string &fp, bool valid, X509* cert, const shared_ptr<TrustAnchors> &anchors)
+{
+  time_t now = time(NULL);
+  CachedVerification entry;
+  entry.valid = valid;
+  entry.expiry = now + VERIFY_CACHE_TTL;
+
+  // a positive result must not outlive the certificate itself
+  int days, secs;
+  if(valid && ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(cert)))
+  {
+    time_t notAfter = now + (time_t)days * 86400 + secs;
+    if(notAfter < entry.expiry)
+      entry.expiry = notAfter;
   }
 
+  lock_guard<mutex> lock(_mutex);
+  // a reload cleared the cache while this one was verified: its name or CA may be gone
+  if(_anchors != anchors)
+    return;
+
+  if(_cache.size() >= VERIFY_CACHE_MAX_ENTRIES)
+  {
+    for(unordered_map<string, CachedVerification>::iterator it = _cache.begin(); it != _cache.end();)
+    {
+      if(it->second.expiry <= now)
+        it = _cache.erase(it);
+      else
+        ++it;
+    }
+    if(_cache.size() >= VERIFY_CACHE_MAX_ENTRIES)
+      _cache.clear();
+  }
+  _cache[fp] = entry;
+}
+
+bool CertificationValidator::verifyCertificate(X509* cert)
+{
+  shared_ptr<TrustAnchors> anchors = currentAnchors();
+
+  string fp = fingerprint(cert);
+  bool valid;
+  if(!fp.empty() && lookupCache(fp, valid))
+    return valid;
+
   X509_STORE_CTX* ctx= X509_STORE_CTX_new();
 
-  X509_STORE_CTX_init(ctx, _store, cert, NULL);
+  X509_STORE_CTX_init(ctx, anchors->store, cert, NULL);
   int ret = X509_verify_cert(ctx); //return 1 on success
+  X509_STORE_CTX_free(ctx);
 
-  if(ret != 1)
-    return false;
+  valid = ret == 1 && anchors->names.count(getCertName(cert)) > 0;
 
-  string str = getCertName(cert);
-  X509_STORE_CTX_free(ctx);
-  
-  return verifyName(str);
+  // a failure may come from a trust file being replaced: checked again next time
+  if(!fp.empty() && valid)
+    storeInCache(fp, valid, cert, anchors);
+
+  return valid;
 }
 
 X509* CertificationValidator::loadCertificateFromFile(const char* filename)
@@ -59,9 +234,9 @@ X509* CertificationValidator::loadCertificateFromFile(const char* filename)
       cerr<<"ERROR opening file"<<endl;
       return cert;
   }
-  
+
   cert = PEM_read_X509(file, NULL, NULL, NULL);
-  
+
   if(!cert){
       cerr<<"ERROR pem read x509"<<endl;
       return cert;
@@ -72,7 +247,10 @@ X509* CertificationValidator::loadCertificateFromFile(const char* filename)
 }
 
 bool CertificationValidator::addCertificationAut(X509* cert){
-  return X509_STORE_add_cert(_store,cert) == 1;
+  lock_guard<mutex> lock(_mutex);
+  bool added = X509_STORE_add_cert(_anchors->store,cert) == 1;
+  _cache.clear();
+  return added;
 }
 
 EVP_PKEY* CertificationValidator::extractPubKeyFromCertificate(X509* cert)
@@ -90,6 +268,7 @@ string CertificationValidator::getCertName(X509* cert)
   char* substr = X509_NAME_oneline(subjectName, NULL, 0);
 
   res = string(substr);
+  OPENSSL_free(substr);
 
   return res;
-}
\ No newline at end of file
+}
@@ -1,6 +1,16 @@
 #include <openssl/x509.h>
 #include <exception>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <time.h>
+#include <sys/types.h>
+
+#define VERIFY_CACHE_TTL 300            // seconds a verification result is trusted
+#define VERIFY_CACHE_MAX_ENTRIES 16384
+#define TRUST_RELOAD_CHECK_INTERVAL 1   // seconds between checks of names/CA files
 
 class CertificationValidatorException : public std::exception
 {
@@ -28,14 +38,56 @@ class CertificateNotValidException : public CertificationValidatorException
 
 class CertificationValidator{
 private:
-    X509_STORE* _store;
-    std::string* _names;
-    int _numberOfNames;
+    // CA store and allowed names are swapped together, so a verification
+    // never sees the CA set of one version and the names of another
+    struct TrustAnchors
+    {
+        X509_STORE* store;
+        std::unordered_set<std::string> names;
+
+        TrustAnchors();
+        ~TrustAnchors();
+    };
+
+    // what a trust file was when loaded: a rewrite within the same second, or
+    // one keeping the time, still changes one of these
+    struct FileVersion
+    {
+        struct timespec mtime;
+        off_t size;
+
+        bool operator==(const FileVersion &other) const;
+    };
 
-    bool verifyName(std::string nameToVerify);
+    struct CachedVerification
+    {
+        bool valid;
+        time_t expiry;
+    };
+
+    std::shared_ptr<TrustAnchors> _anchors;
+    std::unordered_map<std::string, CachedVerification> _cache;
+    std::mutex _mutex;
+
+    std::string _namesFile;
+    std::string _caFile;
+    FileVersion _namesVersion;
+    FileVersion _caVersion;
+    time_t _lastReloadCheck;
+
+    static FileVersion fileVersion(const std::string &filename);
+    // NULL if either file cannot be read, or the CA file holds no certificate
+    std::shared_ptr<TrustAnchors> loadAnchors();
+    void reloadIfChanged();
+    std::shared_ptr<TrustAnchors> currentAnchors();
+
+    std::string fingerprint(X509* cert);
+    bool lookupCache(const std::string &fp, bool &valid);
+    // dropped if the anchors it was verified against were replaced meanwhile
+    void storeInCache(const std::string &fp, bool valid, X509* cert, const std::shared_ptr<TrustAnchors> &anchors);
 
 public:
-    CertificationValidator(std::string* names, int dim);
+    CertificationValidator(const char* namesFile, const char* caFile);
 
     std::string getCertName(X509* cert);
     bool verifyCertificate(X509* cert);
@@ -43,4 +95,3 @@ public:
     bool addCertificationAut(X509* cert);
     EVP_PKEY* extractPubKeyFromCertificate(X509* cert);
 };
-
@@ -0,0 +1,495 @@
+#include "ChunkStore.h"
+#include "Durability.h"
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// cut when the top bits of the rolling hash are all zero: harder before the
+// average size and easier after it (normalized chunking), so sizes cluster around it
+#define CHUNK_MASK(bits) ((((uint64_t)1 << (bits)) - 1) << (64 - (bits)))
+#define CHUNK_MASK_SMALL CHUNK_MASK(CHUNK_AVG_BITS + 2)
+#define CHUNK_MASK_LARGE CHUNK_MASK(CHUNK_AVG_BITS - 2)
+
+static const uint64_t *gearTable()
+{
+    // fixed pseudo-random values (splitmix64): client and server must cut at the same points
+    static uint64_t table[256];
+    static bool ready = []
+    {
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (int i = 0; i < 256; i++)
+        {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            table[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)ready;
+    return table;
+}
+
+ChunkStore::ChunkStore(const char *directory, bool durable)
+{
+    _chunkDir = string(directory) + "/.chunks";
+    _manifestDir = string(directory) + "/.manifests";
+    _durable = durable;
+
+    if ((mkdir(_chunkDir.c_str(), 0755) < 0 && errno != EEXIST) ||
+        (mkdir(_manifestDir.c_str(), 0755) < 0 && errno != EEXIST))
+    {
+        throw ChunkStoreException();
+    }
+}
+
+string ChunkStore::toHex(const unsigned char *hash)
+{
+    static const char *digits = "0123456789abcdef";
+    string hex(2 * CHUNK_HASH_SIZE, '0');
+    for (int i = 0; i < CHUNK_HASH_SIZE; i++)
+    {
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    return hex;
+}
+
+bool ChunkStore::fromHex(const string &hex, unsigned char *hash)
+{
+    if (hex.size() != 2 * CHUNK_HASH_SIZE)
+        return false;
+
+    for (int i = 0; i < 2 * CHUNK_HASH_SIZE; i++)
+    {
+        char c = hex[i];
+        int value;
+        if (c >= '0' && c <= '9')
+            value = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value = c - 'a' + 10;
+        else
+            return false;
+
+        if (i % 2 == 0)
+            hash[i / 2] = value << 4;
+        else
+            hash[i / 2] |= value;
+    }
+    return true;
+}
+
+string ChunkStore::getManifestPath(const string &name)
+{
+    return _manifestDir + "/" + name;
+}
+
+string ChunkStore::getChunkPath(const unsigned char *hash)
+{
+    // 256 subdirectories, so none of them grows too big
+    string hex = toHex(hash);
+    return _chunkDir + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+size_t ChunkStore::nextCut(const unsigned char *data, size_t length)
+{
+    if (length <= CHUNK_MIN_SIZE)
+        return length;
+    if (length > CHUNK_MAX_SIZE)
+        length = CHUNK_MAX_SIZE;
+
+    size_t normal = (size_t)1 << CHUNK_AVG_BITS;
+    if (normal > length)
+        normal = length;
+
+    const uint64_t *gear = gearTable();
+    uint64_t fingerprint = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & CHUNK_MASK_SMALL))
+            return i;
+    }
+    for (; i < length; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & CHUNK_MASK_LARGE))
+            return i;
+    }
+    return length;
+}
+
+void ChunkStore::split(MappedFile *file, vector<ChunkRef> &chunks)
+{
+    uint64_t fileSize = file->size();
+    chunks.clear();
+
+    for (uint64_t offset = 0; offset < fileSize;)
+    {
+        size_t window = fileSize - offset < CHUNK_MAX_SIZE ? fileSize - offset : CHUNK_MAX_SIZE;
+        unsigned char *data = file->map(offset, window);
+
+        ChunkRef chunk;
+        chunk.length = nextCut(data, window);
+        unsigned int hashLen;
+        EVP_Digest(data, chunk.length, chunk.hash, &hashLen, EVP_sha256(), NULL);
+        chunks.push_back(chunk);
+
+        offset += chunk.length;
+    }
+}
+
+bool ChunkStore::has(const unsigned char *hash)
+{
+    return access(getChunkPath(hash).c_str(), F_OK) == 0;
+}
+
+bool ChunkStore::put(const unsigned char *hash, const unsigned char *data, size_t length)
+{
+    unsigned char check[EVP_MAX_MD_SIZE];
+    unsigned int checkLen;
+    EVP_Digest(data, length, check, &checkLen, EVP_sha256(), NULL);
+    if (CRYPTO_memcmp(check, hash, CHUNK_HASH_SIZE) != 0)
+        return false;
+
+    if (has(hash))
+        return true;
+
+    string path = getChunkPath(hash);
+    string directory = path.substr(0, path.rfind('/'));
+    if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+        throw ChunkStoreException();
+
+    // two uploads storing the same chunk both publish the same bytes
+    try
+    {
+        MappedFile chunk(path.c_str(), length, true);
+        memcpy(chunk.map(0, length), data, length);
+        chunk.publish();
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw ChunkStoreException();
+    }
+    return true;
+}
+
+bool ChunkStore::loadManifest(const string &name, uint64_t &fileSize, vector<ChunkRef> &chunks)
+{
+    // first line "fileSize count", then one line "hash length" per chunk
+    ifstream is(getManifestPath(name).c_str());
+    if (!is.is_open())
+        return false;
+
+    uint64_t count;
+    if (!(is >> fileSize >> count))
+        return false;
+
+    chunks.clear();
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        string hex;
+        ChunkRef chunk;
+        if (!(is >> hex >> chunk.length) || !fromHex(hex, chunk.hash) || chunk.length == 0 || chunk.length > CHUNK_MAX_SIZE)
+            return false;
+        chunks.push_back(chunk);
+        total += chunk.length;
+    }
+    return total == fileSize;
+}
+
+void ChunkStore::syncChunks(const vector<ChunkRef> &chunks)
+{
+    // every chunk the file refers to, also those another upload has just
+    // stored and not synced yet; a chunk already on disk costs little.
+    // The write-back of all of them is started before waiting on any
+    set<string> paths;
+    for (size_t i = 0; i < chunks.size(); i++)
+        paths.insert(getChunkPath(chunks[i].hash));
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (set<string>::iterator it = paths.begin(); it != paths.end(); ++it)
+        {
+            int fd = open(it->c_str(), O_RDONLY);
+            if (fd < 0)
+                throw ChunkStoreException();
+
+            int result = pass == 0 ? sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) : fdatasync(fd);
+            close(fd);
+            if (result < 0)
+                throw ChunkStoreException();
+        }
+    }
+
+    set<string> directories;
+    for (set<string>::iterator it = paths.begin(); it != paths.end(); ++it)
+        directories.insert(it->substr(0, it->rfind('/')));
+    directories.insert(_chunkDir);
+    for (set<string>::iterator it = directories.begin(); it != directories.end(); ++it)
+    {
+        if (!Durability::syncDirectory(*it))
+            throw ChunkStoreException();
+    }
+}
+
+void ChunkStore::saveManifest(const string &name, uint64_t fileSize, const vector<ChunkRef> &chunks)
+{
+    if (_durable)
+        syncChunks(chunks);
+
+    stringstream manifest;
+    manifest << fileSize << " " << chunks.size() << "\n";
+    for (size_t i = 0; i < chunks.size(); i++)
+        manifest << toHex(chunks[i].hash) << " " << chunks[i].length << "\n";
+    string content = manifest.str();
+
+    // unique, so concurrent uploads of the same name never write the same temporary
+    string path = getManifestPath(name);
+    string tmpName = _manifestDir + "/." + name + ".XXXXXX";
+    int fd = mkstemp(&tmpName[0]);
+    if (fd < 0)
+        throw ChunkStoreException();
+
+    bool written = fchmod(fd, 0644) == 0;
+    for (size_t done = 0; written && done < content.size();)
+    {
+        ssize_t result = write(fd, content.data() + done, content.size() - done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        written = result > 0;
+        if (written)
+            done += result;
+    }
+    if (written && _durable)
+        written = fdatasync(fd) == 0;
+    close(fd);
+
+    if (!written || rename(tmpName.c_str(), path.c_str()) < 0)
+    {
+        unlink(tmpName.c_str());
+        throw ChunkStoreException();
+    }
+    if (_durable && !Durability::syncDirectory(_manifestDir))
+        throw ChunkStoreException();
+}
+
+uint64_t ChunkStore::getFingerprint(const string &name)
+{
+    struct stat manifestStat;
+    if (stat(getManifestPath(name).c_str(), &manifestStat) < 0)
+        return 0;
+
+    uint64_t fingerprint = (uint64_t)manifestStat.st_mtim.tv_sec * 1000000000 + manifestStat.st_mtim.tv_nsec;
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+void ChunkStore::listFiles(vector<pair<string, uint64_t>> &files)
+{
+    DIR *dir = opendir(_manifestDir.c_str());
+    if (dir == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        ifstream is(getManifestPath(entry->d_name).c_str());
+        uint64_t fileSize;
+        if (is >> fileSize)
+            files.push_back(make_pair(string(entry->d_name), fileSize));
+    }
+    closedir(dir);
+}
+
+bool ChunkStore::digestFile(const string &name, uint64_t &fileSize, unsigned char *digest)
+{
+    vector<ChunkRef> chunks;
+    return loadManifest(name, fileSize, chunks) && digestChunks(chunks, digest);
+}
+
+bool ChunkStore::digestChunks(const vector<ChunkRef> &chunks, unsigned char *digest)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        try
+        {
+            MappedFile chunk(getChunkPath(chunks[i].hash).c_str());
+            if (chunk.size() != chunks[i].length)
+                throw MappedFileException();
+            EVP_DigestUpdate(ctx, chunk.map(0, chunks[i].length), chunks[i].length);
+        }
+        catch (const MappedFileException &mfe)
+        {
+            EVP_MD_CTX_free(ctx);
+            return false;
+        }
+    }
+
+    unsigned int digestLen;
+    EVP_DigestFinal_ex(ctx, digest, &digestLen);
+    EVP_MD_CTX_free(ctx);
+    return true;
+}
+
+MappedFile *ChunkStore::assemble(const string &name, const string &destination)
+{
+    uint64_t fileSize;
+    vector<ChunkRef> chunks;
+    if (!loadManifest(name, fileSize, chunks))
+        return NULL;
+
+    MappedFile *file = NULL;
+    try
+    {
+        file = new MappedFile(destination.c_str(), fileSize, true);
+        uint64_t offset = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            MappedFile chunk(getChunkPath(chunks[i].hash).c_str());
+            if (chunk.size() != chunks[i].length)
+                throw MappedFileException();
+            memcpy(file->map(offset, chunks[i].length), chunk.map(0, chunks[i].length), chunks[i].length);
+            offset += chunks[i].length;
+        }
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        return NULL;
+    }
+    return file;
+}
+
+uint64_t ChunkStore::ingest(const string &path, const string &name)
+{
+    MappedFile *file;
+    try
+    {
+        file = new MappedFile(path.c_str());
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw ChunkStoreException();
+    }
+
+    uint64_t fileSize = file->size();
+    uint64_t newBytes = 0;
+    vector<ChunkRef> chunks;
+    try
+    {
+        split(file, chunks);
+
+        uint64_t offset = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            if (!has(chunks[i].hash))
+            {
+                put(chunks[i].hash, file->map(offset, chunks[i].length), chunks[i].length);
+                newBytes += chunks[i].length;
+            }
+            offset += chunks[i].length;
+        }
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw ChunkStoreException();
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+    delete file;
+
+    saveManifest(name, fileSize, chunks);
+    unlink(path.c_str());
+    return newBytes;
+}
+
+uint64_t ChunkStore::collectGarbage()
+{
+    // mark: every chunk some manifest refers to
+    set<string> referenced;
+    vector<pair<string, uint64_t>> files;
+    listFiles(files);
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        uint64_t fileSize;
+        vector<ChunkRef> chunks;
+        if (!loadManifest(files[i].first, fileSize, chunks))
+        {
+            // a damaged manifest keeps whatever it may still refer to
+            return 0;
+        }
+        for (size_t j = 0; j < chunks.size(); j++)
+            referenced.insert(toHex(chunks[j].hash));
+    }
+
+    // sweep, leftovers of interrupted writes included
+    uint64_t freed = 0;
+    DIR *dir = opendir(_chunkDir.c_str());
+    if (dir == NULL)
+        return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        string subdirectory = _chunkDir + "/" + entry->d_name;
+        DIR *sub = opendir(subdirectory.c_str());
+        if (sub == NULL)
+            continue;
+
+        struct dirent *chunk;
+        while ((chunk = readdir(sub)) != NULL)
+        {
+            string chunkName = chunk->d_name;
+            if (chunkName == "." || chunkName == ".." || referenced.count(chunkName) > 0)
+                continue;
+
+            string chunkPath = subdirectory + "/" + chunkName;
+            struct stat chunkStat;
+            if (stat(chunkPath.c_str(), &chunkStat) == 0 && S_ISREG(chunkStat.st_mode) && unlink(chunkPath.c_str()) == 0)
+                freed += chunkStat.st_size;
+        }
+        closedir(sub);
+    }
+    closedir(dir);
+
+    // manifest temporaries of uploads interrupted while saving them
+    dir = opendir(_manifestDir.c_str());
+    if (dir != NULL)
+    {
+        while ((entry = readdir(dir)) != NULL)
+        {
+            string manifestName = entry->d_name;
+            if (manifestName[0] == '.' && manifestName != "." && manifestName != "..")
+                unlink((_manifestDir + "/" + manifestName).c_str());
+        }
+        closedir(dir);
+    }
+
+    return freed;
+}
@@ -0,0 +1,86 @@
+#ifndef CHUNK_STORE
+#define CHUNK_STORE
+
+#include "MappedFile.h"
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHUNK_MIN_SIZE 4096  //bytes, no cut point before
+#define CHUNK_AVG_BITS 14    //cut points about every 2^14 bytes (16 KB)
+#define CHUNK_MAX_SIZE 65536 //bytes, a cut point is forced here
+#define CHUNK_HASH_SIZE 32   //SHA-256 of the chunk, also its name in the store
+
+class ChunkStoreException : public std::exception
+{
+    public:
+    const char *what() const throw()
+    {
+        return "not possible access the chunk store";
+    }
+};
+
+// one chunk of a file, in file order
+struct ChunkRef
+{
+    unsigned char hash[CHUNK_HASH_SIZE];
+    uint32_t length;
+};
+
+// Files split into content-defined chunks (FastCDC): cut points depend on the
+// bytes around them only, so an edit changes the chunks near it and
+// near-identical files share all the others. Each unique chunk is kept once
+// under its hash (.chunks/ab/abcd...), each file as a manifest listing its
+// chunks (.manifests/name), both hidden in the upload directory.
+// A durable store syncs the chunks of a file and their directories before
+// its manifest, and the manifest before its name (see Durability).
+class ChunkStore
+{
+private:
+    std::string _chunkDir;
+    std::string _manifestDir;
+    bool _durable;
+
+    static std::string toHex(const unsigned char *hash);
+    static bool fromHex(const std::string &hex, unsigned char *hash);
+    void syncChunks(const std::vector<ChunkRef> &chunks);
+
+public:
+    ChunkStore(const char *directory, bool durable);
+
+    // length of the chunk starting at data, length being what is left of the file
+    static size_t nextCut(const unsigned char *data, size_t length);
+    static void split(MappedFile *file, std::vector<ChunkRef> &chunks);
+
+    std::string getChunkPath(const unsigned char *hash);
+    std::string getManifestPath(const std::string &name);
+    bool has(const unsigned char *hash);
+    // stores the chunk unless already there; false if data does not match hash
+    bool put(const unsigned char *hash, const unsigned char *data, size_t length);
+
+    // false if name is not in the store (or its manifest is damaged)
+    bool loadManifest(const std::string &name, uint64_t &fileSize, std::vector<ChunkRef> &chunks);
+    // replaces the manifest of name atomically (durable store: once chunks are synced)
+    void saveManifest(const std::string &name, uint64_t fileSize, const std::vector<ChunkRef> &chunks);
+    // changes whenever name is stored again (as MappedFile::getFingerprint), 0 if not stored
+    uint64_t getFingerprint(const std::string &name);
+    // names and sizes of the files in the store
+    void listFiles(std::vector<std::pair<std::string, uint64_t>> &files);
+    // SHA-256 of the whole file, its chunks read in order
+    bool digestFile(const std::string &name, uint64_t &fileSize, unsigned char *digest);
+    bool digestChunks(const std::vector<ChunkRef> &chunks, unsigned char *digest);
+    // the whole file rebuilt in an unpublished file beside destination, NULL if name is not stored
+    MappedFile *assemble(const std::string &name, const std::string &destination);
+
+    // moves the complete file at path into the store as name, returns the bytes that were new to it
+    uint64_t ingest(const std::string &path, const std::string &name);
+    // removes the chunks no manifest refers to (and leftover manifest
+    // temporaries), returns the bytes freed;
+    // only safe while no upload is running
+    uint64_t collectGarbage();
+};
+
+#endif
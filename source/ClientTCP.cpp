@@ -23,6 +23,8 @@ void ClientTCP::socketTCPInit()
     serverStructInit();
     /*creazione socket*/
     _socketTCP = socket(AF_INET, SOCK_STREAM, 0);
+    if (_socketTCP >= 0)
+        setNoDelay(_socketTCP);
 }
 
 ClientTCP::ClientTCP(const char *ipServer, unsigned short serverPortNumber)
@@ -37,6 +39,10 @@ ClientTCP::ClientTCP(const char *ipServer, unsigned short serverPortNumber)
 bool ClientTCP::serverTCPconnection()
 {
     //Return true on succcessful connection false otherwise
+    if (_socketTCP < 0)
+    {
+        socketTCPInit();
+    }
     return connect(_socketTCP, (struct sockaddr *)&_serverStructAddr, sizeof(_serverStructAddr)) >= 0;
 }
 
@@ -51,7 +57,13 @@ int ClientTCP::recvMsg(void **buffer)
     return numberOfBytes;
 }
 
+int ClientTCP::getSocket()
+{
+    return _socketTCP;
+}
+
 void ClientTCP::closeConnection()
 {
     close(_socketTCP);
+    _socketTCP = -1;
 }
@@ -18,4 +18,5 @@ public:
     void closeConnection();
     void sendMsg(void *buffer, size_t bufferSize);
     int recvMsg(void** buffer);
+    int getSocket();
 };
\ No newline at end of file
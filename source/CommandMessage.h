@@ -0,0 +1,125 @@
+#ifndef COMMAND_MESSAGE
+#define COMMAND_MESSAGE
+
+#include <stdint.h>
+#include <stddef.h>
+
+// binary command message (CAP_BINARY_COMMANDS), little endian fields:
+// version (8), command code (8), argument length (16), sequence number (64),
+// then the argument (file name, may be empty), not NUL terminated
+#define COMMAND_VERSION 1        //layout of the message, any other one is refused
+#define COMMAND_HEADER_SIZE 12
+#define COMMAND_MAX_ARGUMENT 1024 //bytes of file name a command can carry
+
+struct CommandInfo
+{
+    uint8_t code;
+    const char *name; // as typed at the client prompt
+};
+
+// the code of a command never changes, new commands take new codes
+constexpr CommandInfo COMMANDS[] = {
+    {1, "u"},
+    {2, "ur"},
+    {3, "uc"},
+    {4, "ud"},
+    {5, "ui"},
+    {6, "rl"},
+    {7, "rf"},
+    {8, "rr"},
+    {9, "rg"},
+    {10, "ri"},
+};
+constexpr size_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+template <typename T>
+constexpr void putLittleEndian(unsigned char *out, T value)
+{
+    for (size_t i = 0; i < sizeof(T); i++)
+        out[i] = (unsigned char)(value >> (8 * i));
+}
+
+template <typename T>
+constexpr T getLittleEndian(const unsigned char *in)
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+        value |= (T)in[i] << (8 * i);
+    return value;
+}
+
+constexpr bool sameName(const char *a, const char *b)
+{
+    while (*a != '\0' && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// 0: not a command
+constexpr uint8_t commandCode(const char *name)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+        if (sameName(COMMANDS[i].name, name))
+            return COMMANDS[i].code;
+    return 0;
+}
+
+// NULL: not a command
+constexpr const char *commandName(uint8_t code)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+        if (COMMANDS[i].code == code)
+            return COMMANDS[i].name;
+    return NULL;
+}
+
+static_assert(commandCode("rf") == 7 && commandName(7)[1] == 'f', "command table");
+
+// a decoded message points into the buffer it was decoded from
+struct CommandMessage
+{
+    uint8_t code;
+    uint64_t sequence;
+    const unsigned char *argument;
+    uint16_t argumentLength;
+};
+
+// bytes written to out, of COMMAND_HEADER_SIZE + COMMAND_MAX_ARGUMENT bytes; 0 if the argument is too long
+constexpr size_t encodeCommand(const CommandMessage &message, unsigned char *out)
+{
+    if (message.argumentLength > COMMAND_MAX_ARGUMENT)
+        return 0;
+
+    out[0] = COMMAND_VERSION;
+    out[1] = message.code;
+    putLittleEndian<uint16_t>(out + 2, message.argumentLength);
+    putLittleEndian<uint64_t>(out + 4, message.sequence);
+    for (size_t i = 0; i < message.argumentLength; i++)
+        out[COMMAND_HEADER_SIZE + i] = message.argument[i];
+    return COMMAND_HEADER_SIZE + message.argumentLength;
+}
+
+// false if in is not a whole message of COMMAND_VERSION with a known command; allocates nothing
+constexpr bool decodeCommand(const unsigned char *in, size_t length, CommandMessage &message)
+{
+    if (length < COMMAND_HEADER_SIZE || in[0] != COMMAND_VERSION || commandName(in[1]) == NULL)
+        return false;
+
+    message.code = in[1];
+    message.argumentLength = getLittleEndian<uint16_t>(in + 2);
+    message.sequence = getLittleEndian<uint64_t>(in + 4);
+    message.argument = in + COMMAND_HEADER_SIZE;
+    if (message.argumentLength > COMMAND_MAX_ARGUMENT || length != COMMAND_HEADER_SIZE + (size_t)message.argumentLength)
+        return false;
+
+    // a file name: no NUL inside
+    for (size_t i = 0; i < message.argumentLength; i++)
+        if (message.argument[i] == 0)
+            return false;
+    return true;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#include "ConcurrencyLimiter.h"
+#include "Metrics.h"
+
+using namespace std;
+
+ConcurrencyLimiter::ConcurrencyLimiter(const string &name, long maxActive)
+{
+    _name = name;
+    _maxActive = maxActive > 0 ? maxActive : 1;
+    _active = 0;
+    _waiting = 0;
+    publish();
+}
+
+void ConcurrencyLimiter::publish()
+{
+    Metrics::set(_name + "_active", _active);
+    Metrics::set(_name + "_waiting", _waiting);
+}
+
+bool ConcurrencyLimiter::tryAcquire()
+{
+    lock_guard<mutex> lock(_mutex);
+    if (_active >= _maxActive)
+        return false;
+
+    _active += 1;
+    publish();
+    return true;
+}
+
+void ConcurrencyLimiter::acquire()
+{
+    unique_lock<mutex> lock(_mutex);
+    _waiting += 1;
+    publish();
+
+    _slotFreed.wait(lock, [this] { return _active < _maxActive; });
+
+    _waiting -= 1;
+    _active += 1;
+    publish();
+}
+
+void ConcurrencyLimiter::release()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _active -= 1;
+        publish();
+    }
+    _slotFreed.notify_one();
+}
+
+long ConcurrencyLimiter::active()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _active;
+}
@@ -0,0 +1,31 @@
+#ifndef CONCURRENCY_LIMITER
+#define CONCURRENCY_LIMITER
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+// counting semaphore that keeps its occupancy in Metrics
+// (<name>_active and <name>_waiting)
+class ConcurrencyLimiter
+{
+private:
+    std::mutex _mutex;
+    std::condition_variable _slotFreed;
+    std::string _name;
+    long _maxActive;
+    long _active;
+    long _waiting;
+
+    void publish();
+
+public:
+    ConcurrencyLimiter(const std::string &name, long maxActive);
+
+    bool tryAcquire();
+    void acquire();
+    void release();
+    long active();
+};
+
+#endif
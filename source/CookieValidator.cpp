@@ -0,0 +1,59 @@
+#include "CookieValidator.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+CookieValidator::CookieValidator()
+{
+    RAND_bytes(_secret, COOKIE_SECRET_SIZE);
+}
+
+CookieValidator::~CookieValidator()
+{
+    explicit_bzero(_secret, COOKIE_SECRET_SIZE);
+}
+
+string CookieValidator::computeMac(const string &clientId, uint64_t timestamp)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen;
+
+    // HMAC(secret, timestamp || clientId)
+    string toMac((char*)&timestamp, sizeof(uint64_t));
+    toMac += clientId;
+
+    HMAC(EVP_sha256(), _secret, COOKIE_SECRET_SIZE, (unsigned char*)toMac.data(), toMac.size(), digest, &digestLen);
+
+    return string((char*)digest, digestLen);
+}
+
+string CookieValidator::createCookie(const string &clientId)
+{
+    uint64_t timestamp = time(NULL);
+
+    string cookie((char*)&timestamp, sizeof(uint64_t));
+    cookie += computeMac(clientId, timestamp);
+
+    return cookie;
+}
+
+bool CookieValidator::verifyCookie(const string &clientId, const unsigned char* cookie, int cookieLen)
+{
+    if (cookieLen != COOKIE_SIZE)
+        return false;
+
+    uint64_t timestamp;
+    memcpy(&timestamp, cookie, sizeof(uint64_t));
+
+    uint64_t now = time(NULL);
+    if (timestamp > now || now - timestamp > COOKIE_LIFETIME)
+        return false;
+
+    string expectedMac = computeMac(clientId, timestamp);
+    return CRYPTO_memcmp(cookie + sizeof(uint64_t), expectedMac.data(), expectedMac.size()) == 0;
+}
@@ -0,0 +1,24 @@
+#include <string>
+#include <stdint.h>
+
+#define COOKIE_SECRET_SIZE 32
+#define COOKIE_SIZE 40     //timestamp (8) and HMAC-SHA256 (32)
+#define COOKIE_LIFETIME 30 //seconds a client has to come back with the cookie
+
+// Stateless handshake cookies: the server keeps nothing per client, the
+// cookie itself carries its timestamp and a MAC binding it to the client
+// address. It is sent on a connection that is then closed, the client
+// presents it in the first message of the next one.
+class CookieValidator{
+private:
+    unsigned char _secret[COOKIE_SECRET_SIZE];
+
+    std::string computeMac(const std::string &clientId, uint64_t timestamp);
+
+public:
+    CookieValidator();
+    ~CookieValidator();
+
+    std::string createCookie(const std::string &clientId);
+    bool verifyCookie(const std::string &clientId, const unsigned char* cookie, int cookieLen);
+};
@@ -0,0 +1,148 @@
+#include "Delta.h"
+#include <openssl/evp.h>
+#include <math.h>
+#include <string.h>
+#include <unordered_map>
+
+using namespace std;
+
+uint32_t Delta::chooseBlockSize(uint64_t fileSize)
+{
+    // as rsync: about sqrt(size), so signatures and matching stay small on huge files
+    uint64_t blockSize = (uint64_t)sqrt((double)fileSize);
+    blockSize -= blockSize % 8;
+    if (blockSize < DELTA_MIN_BLOCK)
+        blockSize = DELTA_MIN_BLOCK;
+    if (blockSize > DELTA_MAX_BLOCK)
+        blockSize = DELTA_MAX_BLOCK;
+    return blockSize;
+}
+
+uint32_t Delta::weakChecksum(const unsigned char *data, size_t length)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        a += data[i];
+        b += (length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+void Delta::strongChecksum(const unsigned char *data, size_t length, unsigned char *strong)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen;
+    EVP_Digest(data, length, digest, &digestLen, EVP_sha256(), NULL);
+    memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+void Delta::computeSignatures(MappedFile *file, uint32_t blockSize, vector<BlockSignature> &signatures)
+{
+    uint64_t blocks = file->size() / blockSize;
+    signatures.resize(blocks);
+    for (uint64_t i = 0; i < blocks; i++)
+    {
+        unsigned char *block = file->map(i * blockSize, blockSize);
+        signatures[i].weak = weakChecksum(block, blockSize);
+        strongChecksum(block, blockSize, signatures[i].strong);
+    }
+}
+
+void Delta::addOp(vector<DeltaOp> &ops, bool copy, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return;
+
+    // runs of consecutive blocks, and literals next to each other, become one instruction
+    if (!ops.empty() && ops.back().copy == copy && ops.back().offset + ops.back().length == offset)
+    {
+        ops.back().length += length;
+        return;
+    }
+
+    DeltaOp op;
+    op.copy = copy;
+    op.offset = offset;
+    op.length = length;
+    ops.push_back(op);
+}
+
+void Delta::computeDelta(MappedFile *file, uint32_t blockSize, const vector<BlockSignature> &signatures, vector<DeltaOp> &ops)
+{
+    uint64_t fileSize = file->size();
+    ops.clear();
+
+    if (signatures.empty() || fileSize < blockSize)
+    {
+        addOp(ops, false, 0, fileSize);
+        return;
+    }
+
+    unordered_multimap<uint32_t, uint64_t> blocksByWeak;
+    blocksByWeak.reserve(signatures.size());
+    for (uint64_t i = 0; i < signatures.size(); i++)
+        blocksByWeak.insert(make_pair(signatures[i].weak, i));
+
+    uint64_t position = 0;
+    uint64_t literalStart = 0;
+    uint64_t expectedBlock = signatures.size(); // the block after the last match
+    uint32_t weak = weakChecksum(file->map(0, blockSize), blockSize);
+    uint32_t a = weak & 0xffff;
+    uint32_t b = weak >> 16;
+
+    while (position + blockSize <= fileSize)
+    {
+        uint64_t matched = signatures.size();
+        auto candidates = blocksByWeak.equal_range(weak);
+        if (candidates.first != candidates.second)
+        {
+            unsigned char strong[DELTA_STRONG_SIZE];
+            strongChecksum(file->map(position, blockSize), blockSize, strong);
+
+            // the block following the previous match wins: unchanged regions stay one run
+            if (expectedBlock < signatures.size() && signatures[expectedBlock].weak == weak &&
+                memcmp(signatures[expectedBlock].strong, strong, DELTA_STRONG_SIZE) == 0)
+            {
+                matched = expectedBlock;
+            }
+            for (auto it = candidates.first; matched == signatures.size() && it != candidates.second; ++it)
+            {
+                if (memcmp(signatures[it->second].strong, strong, DELTA_STRONG_SIZE) == 0)
+                    matched = it->second;
+            }
+        }
+
+        if (matched < signatures.size())
+        {
+            addOp(ops, false, literalStart, position - literalStart);
+            addOp(ops, true, matched, 1);
+            expectedBlock = matched + 1;
+
+            position += blockSize;
+            literalStart = position;
+            if (position + blockSize <= fileSize)
+            {
+                weak = weakChecksum(file->map(position, blockSize), blockSize);
+                a = weak & 0xffff;
+                b = weak >> 16;
+            }
+            continue;
+        }
+
+        if (position + blockSize == fileSize)
+            break;
+
+        // roll the window one byte forward
+        unsigned char *window = file->map(position, blockSize + 1);
+        uint32_t out = window[0];
+        uint32_t in = window[blockSize];
+        a = (a - out + in) & 0xffff;
+        b = (b - blockSize * out + a) & 0xffff;
+        weak = a | (b << 16);
+        position++;
+    }
+
+    addOp(ops, false, literalStart, fileSize - literalStart);
+}
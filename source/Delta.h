@@ -0,0 +1,48 @@
+#ifndef DELTA
+#define DELTA
+
+#include "MappedFile.h"
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_MIN_BLOCK 2048    //bytes, smallest block a signature covers
+#define DELTA_MAX_BLOCK 131072  //bytes, largest block (about sqrt(size) in between)
+#define DELTA_STRONG_SIZE 16    //bytes of SHA-256 kept as the strong checksum
+
+// signature of one full block of the receiver's copy
+struct BlockSignature
+{
+    uint32_t weak;
+    unsigned char strong[DELTA_STRONG_SIZE];
+};
+
+// one instruction to rebuild the new file: a run of blocks of the old copy,
+// or literal bytes taken from [offset, offset + length) of the new file
+struct DeltaOp
+{
+    bool copy;
+    uint64_t offset; // copy: first block; literal: offset in the new file
+    uint64_t length; // copy: blocks; literal: bytes
+};
+
+// rsync-style delta: the receiver sends weak (rolling) and strong checksums
+// of the blocks of its copy, the sender looks for them at every byte offset
+// of the new file and sends only what it could not find
+class Delta
+{
+private:
+    static void addOp(std::vector<DeltaOp> &ops, bool copy, uint64_t offset, uint64_t length);
+
+public:
+    static uint32_t chooseBlockSize(uint64_t fileSize);
+    static uint32_t weakChecksum(const unsigned char *data, size_t length);
+    static void strongChecksum(const unsigned char *data, size_t length, unsigned char *strong);
+
+    // one signature for each full block of file
+    static void computeSignatures(MappedFile *file, uint32_t blockSize, std::vector<BlockSignature> &signatures);
+    // instructions rebuilding file from the blocks described by signatures
+    static void computeDelta(MappedFile *file, uint32_t blockSize, const std::vector<BlockSignature> &signatures, std::vector<DeltaOp> &ops);
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "Durability.h"
+#include "Metrics.h"
+#include "Printer.h"
+#include <chrono>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+Durability::Durability(int mode, long windowMs)
+{
+    _mode = mode;
+    _windowMs = windowMs;
+    _stopping = false;
+
+    if (_mode == DURABILITY_GROUP)
+        _committer = thread(&Durability::committerLoop, this);
+}
+
+Durability::~Durability()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _requestQueued.notify_all();
+
+    if (_committer.joinable())
+        _committer.join();
+}
+
+int Durability::parseMode(const string &name)
+{
+    if (name == "file")
+        return DURABILITY_FILE;
+    if (name == "group")
+        return DURABILITY_GROUP;
+    if (name != "none")
+        Printer::printWaring("unknown durability mode, using none");
+    return DURABILITY_NONE;
+}
+
+bool Durability::syncDirectory(const string &directory)
+{
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+void Durability::commit(MappedFile *file)
+{
+    if (_mode == DURABILITY_NONE)
+    {
+        file->publish();
+        return;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    if (_mode == DURABILITY_FILE)
+    {
+        // the data before the name: a crash never leaves a name on a partial file
+        if (fdatasync(file->getDescriptor()) < 0)
+            throw MappedFileException();
+        file->publish();
+        if (!syncDirectory(file->getDirectory()))
+            throw MappedFileException();
+    }
+    else
+    {
+        Request request;
+        request.file = file;
+        request.done = false;
+        request.failed = false;
+
+        unique_lock<mutex> lock(_mutex);
+        _queue.push_back(&request);
+        _requestQueued.notify_one();
+        _batchDone.wait(lock, [&request] { return request.done; });
+
+        if (request.failed)
+            throw MappedFileException();
+    }
+
+    Metrics::increment("durable_commits_total");
+    Metrics::add("durable_commit_wait_ms_total", chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count());
+}
+
+void Durability::committerLoop()
+{
+    for (;;)
+    {
+        deque<Request *> batch;
+        {
+            unique_lock<mutex> lock(_mutex);
+            _requestQueued.wait(lock, [this] { return _stopping || !_queue.empty(); });
+            if (_stopping && _queue.empty())
+                return;
+
+            // a lone upload goes at once; when others are ending too, the ones
+            // ending within the window join the batch. Those arriving while a
+            // batch is synced form the next one anyway
+            if (_queue.size() > 1)
+                _requestQueued.wait_for(lock, chrono::milliseconds(_windowMs), [this] { return _stopping; });
+            batch.swap(_queue);
+        }
+
+        // the write-back of every file is started before waiting on any of
+        // them, so the disk gets the whole batch at once
+        for (size_t i = 0; i < batch.size(); i++)
+            sync_file_range(batch[i]->file->getDescriptor(), 0, 0, SYNC_FILE_RANGE_WRITE);
+
+        set<string> directories;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            try
+            {
+                // mostly waits for the write-back started above, then syncs the metadata
+                if (fdatasync(batch[i]->file->getDescriptor()) < 0)
+                    throw MappedFileException();
+                batch[i]->file->publish();
+                directories.insert(batch[i]->file->getDirectory());
+            }
+            catch (const MappedFileException &mfe)
+            {
+                batch[i]->failed = true;
+            }
+        }
+
+        // one directory sync makes every name of the batch durable
+        set<string> failedDirectories;
+        for (set<string>::iterator it = directories.begin(); it != directories.end(); ++it)
+        {
+            if (!syncDirectory(*it))
+                failedDirectories.insert(*it);
+        }
+
+        Metrics::increment("durable_batches_total");
+
+        {
+            lock_guard<mutex> lock(_mutex);
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                if (failedDirectories.count(batch[i]->file->getDirectory()) > 0)
+                    batch[i]->failed = true;
+                batch[i]->done = true;
+            }
+        }
+        _batchDone.notify_all();
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef DURABILITY
+#define DURABILITY
+
+#include "MappedFile.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// how a received file is committed
+#define DURABILITY_NONE 0  // published, left to the kernel write-back
+#define DURABILITY_FILE 1  // fdatasync, publish, directory fsync, one file at a time
+#define DURABILITY_GROUP 2 // as DURABILITY_FILE, batched across the uploads ending together
+
+// Publishes received files according to a durability mode. In group mode
+// a committer thread takes the files committed while it was busy (waiting a
+// small window only when more than one is there), starts the write-back of
+// all of them, syncs them, publishes them and syncs each directory once for
+// the whole batch; every caller waits for its batch.
+class Durability
+{
+private:
+    struct Request
+    {
+        MappedFile *file;
+        bool done;
+        bool failed;
+    };
+
+    int _mode;
+    long _windowMs;
+
+    std::mutex _mutex;
+    std::condition_variable _requestQueued;
+    std::condition_variable _batchDone;
+    std::deque<Request *> _queue;
+    bool _stopping;
+    std::thread _committer;
+
+    void committerLoop();
+
+public:
+    Durability(int mode, long windowMs);
+    ~Durability();
+
+    // mode from its settings name: "none", "file" or "group"
+    static int parseMode(const std::string &name);
+    // makes the names created in directory durable
+    static bool syncDirectory(const std::string &directory);
+
+    // publishes file; it is on stable storage, name included, when this
+    // returns (modes file and group). Throws MappedFileException.
+    void commit(MappedFile *file);
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include "FileCache.h"
+#include "MappedFile.h"
+#include "Metrics.h"
+
+using namespace std;
+
+FileCache::FileCache(size_t capacity, size_t maxFileSize)
+{
+    _capacity = capacity;
+    _maxFileSize = maxFileSize < capacity ? maxFileSize : capacity;
+    _used = 0;
+    _generation = 0;
+}
+
+shared_ptr<const string> FileCache::get(const string &path, MappedFile *&file, uint64_t &fingerprint)
+{
+    file = NULL;
+    unsigned long generation;
+    {
+        lock_guard<mutex> lock(_mutex);
+        unordered_map<string, Entry>::iterator it = _entries.find(path);
+        if (it != _entries.end())
+        {
+            _lru.splice(_lru.begin(), _lru, it->second.lruPosition);
+            Metrics::increment("file_cache_hits_total");
+            fingerprint = it->second.fingerprint;
+            return it->second.contents;
+        }
+        generation = _generation;
+    }
+    Metrics::increment("file_cache_misses_total");
+
+    try
+    {
+        file = new MappedFile(path.c_str());
+    }
+    catch (const MappedFileException &mfe)
+    {
+        return NULL;
+    }
+
+    // read outside the lock, other sessions keep being served meanwhile
+    shared_ptr<const string> contents = load(file);
+    if (contents)
+    {
+        fingerprint = file->getFingerprint();
+        insert(path, contents, fingerprint, generation);
+        delete file;
+        file = NULL;
+    }
+
+    return contents;
+}
+
+shared_ptr<const string> FileCache::load(MappedFile *file)
+{
+    if (_capacity == 0 || file->size() > _maxFileSize)
+        return NULL;
+
+    try
+    {
+        shared_ptr<string> contents = make_shared<string>();
+        if (file->size() > 0)
+            contents->assign((const char *)file->map(0, file->size()), file->size());
+        return contents;
+    }
+    catch (const MappedFileException &mfe)
+    {
+        return NULL;
+    }
+}
+
+void FileCache::insert(const string &path, shared_ptr<const string> contents, uint64_t fingerprint, unsigned long generation)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    // an upload published while the file was being read: the copy may be stale
+    if (generation != _generation || _entries.count(path) > 0)
+        return;
+
+    while (_used + contents->size() > _capacity && !_lru.empty())
+    {
+        erase(_entries.find(_lru.back()));
+        Metrics::increment("file_cache_evictions_total");
+    }
+
+    _lru.push_front(path);
+    Entry entry;
+    entry.contents = contents;
+    entry.fingerprint = fingerprint;
+    entry.lruPosition = _lru.begin();
+    _entries[path] = entry;
+    _used += contents->size();
+
+    publish();
+}
+
+void FileCache::invalidate(const string &path)
+{
+    lock_guard<mutex> lock(_mutex);
+    _generation += 1;
+
+    unordered_map<string, Entry>::iterator it = _entries.find(path);
+    if (it != _entries.end())
+    {
+        erase(it);
+        publish();
+    }
+}
+
+void FileCache::erase(unordered_map<string, Entry>::iterator it)
+{
+    // called with _mutex held; sessions still sending the contents keep their copy
+    _used -= it->second.contents->size();
+    _lru.erase(it->second.lruPosition);
+    _entries.erase(it);
+}
+
+void FileCache::publish()
+{
+    Metrics::set("file_cache_bytes", _used);
+    Metrics::set("file_cache_entries", _entries.size());
+}
@@ -0,0 +1,52 @@
+#ifndef FILE_CACHE
+#define FILE_CACHE
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+class MappedFile;
+
+// Contents of the most recently downloaded files, kept in memory up to a
+// total size (LRU eviction). The server is the only writer of the files:
+// every publish must be followed by invalidate().
+class FileCache
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<const std::string> contents;
+        uint64_t fingerprint; // of the file when it was read (MappedFile::getFingerprint)
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, Entry> _entries;
+    std::list<std::string> _lru; // most recent first
+    size_t _capacity;
+    size_t _maxFileSize;
+    size_t _used;
+    unsigned long _generation;
+
+    std::shared_ptr<const std::string> load(MappedFile *file);
+    void insert(const std::string &path, std::shared_ptr<const std::string> contents, uint64_t fingerprint, unsigned long generation);
+    void erase(std::unordered_map<std::string, Entry>::iterator it);
+    void publish();
+
+public:
+    // capacity 0 disables the cache
+    FileCache(size_t capacity, size_t maxFileSize);
+
+    // contents of path, read and cached on a miss; NULL when the file is
+    // not cacheable (too big, or it can not be read). A file opened on a miss
+    // and not cached is handed over in file, to be sent and deleted by the
+    // caller without opening it again; NULL otherwise. fingerprint: that of the
+    // file when the contents were read, for resuming
+    std::shared_ptr<const std::string> get(const std::string &path, MappedFile *&file, uint64_t &fingerprint);
+    void invalidate(const std::string &path);
+};
+
+#endif
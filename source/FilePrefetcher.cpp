@@ -0,0 +1,74 @@
+#include "FilePrefetcher.h"
+#include "Metrics.h"
+#include <fcntl.h>
+
+using namespace std;
+
+FilePrefetcher::FilePrefetcher(int fd, uint64_t fileSize, size_t chunks)
+{
+    _fd = fd;
+    _fileSize = fileSize;
+    _depth = (uint64_t)chunks * PREFETCH_CHUNK;
+
+    _cursor = 0;
+    _prefetched = 0;
+    _nextWake = PREFETCH_CHUNK;
+    _stopping = false;
+
+    _thread = thread(&FilePrefetcher::prefetchLoop, this);
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _cursorMoved.notify_all();
+    _thread.join();
+}
+
+void FilePrefetcher::prefetchLoop()
+{
+    for (;;)
+    {
+        uint64_t offset;
+        {
+            unique_lock<mutex> lock(_mutex);
+            _cursorMoved.wait(lock, [this] {
+                return _stopping || (_prefetched < _fileSize && _prefetched < _cursor + _depth);
+            });
+            if (_stopping)
+                return;
+
+            if (_prefetched < _cursor)
+            {
+                // the sender caught up: nothing to gain behind it
+                Metrics::increment("prefetch_underruns_total");
+                _prefetched = _cursor - _cursor % PREFETCH_CHUNK;
+            }
+            offset = _prefetched;
+        }
+
+        size_t length = _fileSize - offset < PREFETCH_CHUNK ? _fileSize - offset : PREFETCH_CHUNK;
+        readahead(_fd, offset, length);
+        Metrics::add("prefetch_bytes_total", length);
+
+        lock_guard<mutex> lock(_mutex);
+        _prefetched = offset + length;
+    }
+}
+
+void FilePrefetcher::advance(uint64_t cursor)
+{
+    // called for every record: the prefetcher is woken once per chunk
+    if (cursor < _nextWake)
+        return;
+    _nextWake = cursor - cursor % PREFETCH_CHUNK + PREFETCH_CHUNK;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _cursor = cursor;
+    }
+    _cursorMoved.notify_one();
+}
@@ -0,0 +1,41 @@
+#ifndef FILE_PREFETCHER
+#define FILE_PREFETCHER
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PREFETCH_CHUNK 1048576 //bytes brought into the page cache at a time
+
+// Thread that keeps up to `chunks` chunks of a file read ahead of the send
+// cursor, so the sender finds them in the page cache instead of waiting for
+// the disk. readahead() returns once the chunk has been read.
+class FilePrefetcher
+{
+private:
+    int _fd;
+    uint64_t _fileSize;
+    uint64_t _depth;
+
+    std::mutex _mutex;
+    std::condition_variable _cursorMoved;
+    uint64_t _cursor;
+    uint64_t _prefetched;
+    uint64_t _nextWake; // touched only by the sender
+    bool _stopping;
+
+    std::thread _thread;
+
+    void prefetchLoop();
+
+public:
+    FilePrefetcher(int fd, uint64_t fileSize, size_t chunks);
+    ~FilePrefetcher();
+
+    // the sender has consumed everything before cursor
+    void advance(uint64_t cursor);
+};
+
+#endif
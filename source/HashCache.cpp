@@ -0,0 +1,160 @@
+#include "HashCache.h"
+#include "MappedFile.h"
+#include "AsyncFileWriter.h"
+#include <openssl/evp.h>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+HashCache::HashCache(size_t maxEntries)
+{
+    _maxEntries = maxEntries;
+}
+
+bool HashCache::identify(const string &path, HashCacheEntry &entry)
+{
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+        return false;
+
+    entry.size = fileStat.st_size;
+    entry.mtime = (uint64_t)fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+    entry.inode = fileStat.st_ino;
+    return true;
+}
+
+bool HashCache::hashFile(const string &path, uint64_t &size, unsigned char *digest)
+{
+    MappedFile *file;
+    try
+    {
+        file = new MappedFile(path.c_str());
+    }
+    catch (const MappedFileException &mfe)
+    {
+        return false;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    size = file->size();
+    try
+    {
+        for (uint64_t offset = 0; offset < size; offset += WRITER_BUFFER_SIZE)
+        {
+            size_t length = size - offset < WRITER_BUFFER_SIZE ? size - offset : WRITER_BUFFER_SIZE;
+            EVP_DigestUpdate(ctx, file->map(offset, length), length);
+        }
+    }
+    catch (const MappedFileException &mfe)
+    {
+        EVP_MD_CTX_free(ctx);
+        delete file;
+        return false;
+    }
+    delete file;
+
+    unsigned int digestLen;
+    EVP_DigestFinal_ex(ctx, digest, &digestLen);
+    EVP_MD_CTX_free(ctx);
+    return true;
+}
+
+bool HashCache::digest(const string &path, uint64_t &size, unsigned char *digest)
+{
+    return this->digest(path, size, digest, [&path](uint64_t &fileSize, unsigned char *fileDigest)
+    {
+        return hashFile(path, fileSize, fileDigest);
+    });
+}
+
+bool HashCache::digest(const string &identityPath, uint64_t &size, unsigned char *digest, const function<bool(uint64_t &, unsigned char *)> &compute)
+{
+    HashCacheEntry current;
+    if (!identify(identityPath, current))
+        return false;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        auto it = _entries.find(identityPath);
+        if (it != _entries.end() && it->second.size == current.size && it->second.mtime == current.mtime && it->second.inode == current.inode &&
+            it->second.mtime + HASH_CACHE_RACY_WINDOW < it->second.hashedAt)
+        {
+            HashCacheEntry &entry = it->second;
+            size = entry.contentSize;
+            memcpy(digest, entry.digest, HASH_CACHE_DIGEST_SIZE);
+            return true;
+        }
+    }
+
+    // a write after this instant gives the file a later mtime, unless it
+    // falls in the tick of the one seen: such an entry is not trusted later
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    current.hashedAt = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    // hashed without the lock, other files are looked up meanwhile
+    if (!compute(size, digest))
+        return false;
+
+    current.contentSize = size;
+    memcpy(current.digest, digest, HASH_CACHE_DIGEST_SIZE);
+
+    lock_guard<mutex> lock(_mutex);
+    if (_entries.size() >= _maxEntries && _entries.count(identityPath) == 0)
+        _entries.erase(_entries.begin());
+    _entries[identityPath] = current;
+    return true;
+}
+
+void HashCache::load(const char *filename)
+{
+    // HASH_CACHE_FORMAT, then one line per file: size mtime inode hashedAt contentSize digest path
+    ifstream is(filename);
+    string format;
+    if (!is.is_open() || !getline(is, format) || format != HASH_CACHE_FORMAT)
+        return;
+
+    lock_guard<mutex> lock(_mutex);
+    HashCacheEntry entry;
+    string hex, path;
+    while (_entries.size() < _maxEntries && is >> entry.size >> entry.mtime >> entry.inode >> entry.hashedAt >> entry.contentSize >> hex && getline(is, path))
+    {
+        if (hex.size() != 2 * HASH_CACHE_DIGEST_SIZE || path.size() < 2)
+            continue;
+        for (int i = 0; i < HASH_CACHE_DIGEST_SIZE; i++)
+            entry.digest[i] = stoul(hex.substr(2 * i, 2), NULL, 16);
+        _entries[path.substr(1)] = entry;
+    }
+}
+
+void HashCache::save(const char *filename)
+{
+    string tmpName = string(filename) + ".tmp";
+    ofstream os(tmpName.c_str(), ios::trunc);
+    if (!os.is_open())
+        return;
+
+    os << HASH_CACHE_FORMAT << "\n";
+    {
+        lock_guard<mutex> lock(_mutex);
+        char hex[2 * HASH_CACHE_DIGEST_SIZE + 1];
+        for (auto it = _entries.begin(); it != _entries.end(); ++it)
+        {
+            for (int i = 0; i < HASH_CACHE_DIGEST_SIZE; i++)
+                snprintf(hex + 2 * i, 3, "%02x", it->second.digest[i]);
+            os << it->second.size << " " << it->second.mtime << " " << it->second.inode << " " << it->second.hashedAt << " " << it->second.contentSize << " " << hex << " " << it->first << "\n";
+        }
+    }
+    os.close();
+
+    if (!os.fail())
+        rename(tmpName.c_str(), filename);
+    else
+        unlink(tmpName.c_str());
+}
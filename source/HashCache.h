@@ -0,0 +1,58 @@
+#ifndef HASH_CACHE
+#define HASH_CACHE
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_CACHE_DIGEST_SIZE 32 //SHA-256
+#define HASH_CACHE_ENTRIES 262144 //files whose digest is remembered, beyond that some are forgotten
+#define HASH_CACHE_RACY_WINDOW 2000000000 //ns, coarsest timestamp granularity expected of a file system (FAT: 2 s)
+#define HASH_CACHE_FORMAT "hash_cache 2" //first line of a saved cache, files of another format are ignored
+
+// what tells a version of a file from the next one: uploads are published
+// by rename, so a new version always comes with a new inode. A file
+// rewritten in place within the same timestamp tick keeps size, mtime and
+// inode, so an entry is trusted only for a file last modified well before
+// it was hashed (as git does with racily clean entries)
+struct HashCacheEntry
+{
+    uint64_t size;
+    uint64_t mtime; // ns
+    uint64_t inode;
+    uint64_t hashedAt; // ns, wall clock just before the file was read
+    uint64_t contentSize; // of the bytes hashed, size unless identified by another file
+    unsigned char digest[HASH_CACHE_DIGEST_SIZE];
+};
+
+// SHA-256 of files, recomputed only when a file changed since it was last
+// hashed. Shared by the threads of a server; a client keeps it on disk
+// between runs (load, save).
+class HashCache
+{
+private:
+    std::mutex _mutex;
+    std::unordered_map<std::string, HashCacheEntry> _entries;
+    size_t _maxEntries;
+
+    static bool identify(const std::string &path, HashCacheEntry &entry);
+
+public:
+    HashCache(size_t maxEntries);
+
+    static bool hashFile(const std::string &path, uint64_t &size, unsigned char *digest);
+
+    // false if path cannot be read
+    bool digest(const std::string &path, uint64_t &size, unsigned char *digest);
+    // as above, the file being identified by identityPath but hashed by compute
+    // (e.g. a file of the chunk store, identified by its manifest)
+    bool digest(const std::string &identityPath, uint64_t &size, unsigned char *digest, const std::function<bool(uint64_t &, unsigned char *)> &compute);
+
+    void load(const char *filename);
+    void save(const char *filename);
+};
+
+#endif
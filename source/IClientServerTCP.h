@@ -6,8 +6,10 @@
 class IClientServerTCP
 {
 public:
+	virtual ~IClientServerTCP() {}
 	virtual void sendMsg(void *buffer, size_t bufferSize) = 0;
 	virtual int recvMsg(void **buffer) = 0;
+	virtual int getSocket() = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "KernelTLS.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#define HAVE_KERNEL_TLS
+#endif
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifdef HAVE_KERNEL_TLS
+
+bool kernelTlsAttach(int socket)
+{
+    return setsockopt(socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+}
+
+bool kernelTlsInstall(int socket, bool transmit, const unsigned char* material)
+{
+    struct tls12_crypto_info_aes_gcm_128 cryptoInfo;
+    memset(&cryptoInfo, 0, sizeof(cryptoInfo));
+
+    cryptoInfo.info.version = TLS_1_2_VERSION;
+    cryptoInfo.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(cryptoInfo.key, material, KTLS_KEY_SIZE);
+    memcpy(cryptoInfo.salt, material + KTLS_KEY_SIZE, KTLS_SALT_SIZE);
+    memcpy(cryptoInfo.iv, material + KTLS_KEY_SIZE + KTLS_SALT_SIZE, KTLS_IV_SIZE);
+    // record sequence starts from zero, both parts derive the same keys
+
+    int ret = setsockopt(socket, SOL_TLS, transmit ? TLS_TX : TLS_RX, &cryptoInfo, sizeof(cryptoInfo));
+
+    explicit_bzero(&cryptoInfo, sizeof(cryptoInfo));
+    return ret == 0;
+}
+
+#else
+
+bool kernelTlsAttach(int socket)
+{
+    return false;
+}
+
+bool kernelTlsInstall(int socket, bool transmit, const unsigned char* material)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef KERNEL_TLS
+#define KERNEL_TLS
+
+// Linux kernel TLS (kTLS): once keys are installed the kernel seals every
+// byte written on the socket into TLS 1.2 AES-128-GCM records (TX) and
+// opens the records it receives (RX), so files can go out with sendfile().
+
+#define KTLS_KEY_SIZE 16
+#define KTLS_SALT_SIZE 4
+#define KTLS_IV_SIZE 8
+#define KTLS_MATERIAL_SIZE (KTLS_KEY_SIZE + KTLS_SALT_SIZE + KTLS_IV_SIZE)
+
+// attaches the "tls" upper layer protocol; false when the kernel lacks the tls module.
+// The socket keeps working in clear until keys are installed.
+bool kernelTlsAttach(int socket);
+// material: key || salt || iv, as produced by SecureMessageCreator
+bool kernelTlsInstall(int socket, bool transmit, const unsigned char* material);
+
+#endif
@@ -0,0 +1,478 @@
+#include "MappedFile.h"
+#include "Metrics.h"
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void MappedFile::init()
+{
+    _window = NULL;
+    _windowOffset = 0;
+    _windowLength = 0;
+
+    _policy.readAheadWindow = 0;
+    _policy.dropBehindThreshold = 0;
+    _policy.prefetchChunks = 0;
+    _dropBehind = false;
+    _hintStep = 0;
+    _nextHint = 0;
+    _flushed = 0;
+    _dropped = 0;
+    _prefetcher = NULL;
+
+    _published = false;
+}
+
+MappedFile::MappedFile(const char *filename)
+{
+    init();
+    _writable = false;
+
+    _fd = open(filename, O_RDONLY);
+    if (_fd < 0)
+    {
+        throw MappedFileException();
+    }
+
+    struct stat fileStat;
+    if (fstat(_fd, &fileStat) < 0)
+    {
+        close(_fd);
+        throw MappedFileException();
+    }
+    _fileSize = fileStat.st_size;
+}
+
+MappedFile::MappedFile(const char *filename, uint64_t fileSize, bool reserveAll)
+{
+    init();
+    _writable = true;
+    _fileSize = fileSize;
+    _destination = filename;
+
+    createUnnamed(filename);
+
+    // ftruncate leaves the whole file a hole
+    if (ftruncate(_fd, fileSize) < 0)
+    {
+        close(_fd);
+        if (!_tmpName.empty())
+            unlink(_tmpName.c_str());
+        throw MappedFileException();
+    }
+
+    try
+    {
+        if (reserveAll)
+            reserve(0, fileSize);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        close(_fd);
+        if (!_tmpName.empty())
+            unlink(_tmpName.c_str());
+        throw;
+    }
+}
+
+MappedFile::MappedFile(const char *filename, uint64_t fileSize, const char *partialName)
+{
+    init();
+    _writable = true;
+    _fileSize = fileSize;
+    _destination = filename;
+
+    // published by renaming the partial file, which goes away if the transfer fails again
+    _fd = open(partialName, O_RDWR);
+    if (_fd < 0)
+    {
+        throw MappedFileException();
+    }
+    _tmpName = partialName;
+
+    struct stat fileStat;
+    if (fstat(_fd, &fileStat) < 0 || (uint64_t)fileStat.st_size != fileSize)
+    {
+        close(_fd);
+        throw MappedFileException();
+    }
+}
+
+void MappedFile::reserve(uint64_t offset, uint64_t length)
+{
+    // blocks are reserved up front: a full disk fails here, not in the middle
+    // of the transfer. Any failure counts, a store into an unreserved page of
+    // the mapping would raise SIGBUS when the disk fills up
+    int ret = length > 0 ? posix_fallocate(_fd, offset, length) : 0;
+    if (ret != 0)
+    {
+        throw MappedFileException();
+    }
+}
+
+bool MappedFile::isSparse()
+{
+    struct stat fileStat;
+    if (fstat(_fd, &fileStat) < 0)
+        return false;
+
+    // fewer blocks than bytes: there are holes
+    return (uint64_t)fileStat.st_blocks * 512 < _fileSize;
+}
+
+bool MappedFile::nextDataExtent(uint64_t from, uint64_t &start, uint64_t &length)
+{
+    if (from >= _fileSize)
+        return false;
+
+#ifdef SEEK_DATA
+    off_t dataStart = lseek(_fd, from, SEEK_DATA);
+    if (dataStart < 0)
+    {
+        // ENXIO: only a hole is left
+        if (errno == ENXIO)
+            return false;
+        dataStart = from;
+    }
+
+    off_t holeStart = lseek(_fd, dataStart, SEEK_HOLE);
+    if (holeStart < 0 || (uint64_t)holeStart > _fileSize)
+        holeStart = _fileSize;
+
+    start = dataStart;
+    length = holeStart - dataStart;
+#else
+    start = from;
+    length = _fileSize - from;
+#endif
+
+    return length > 0;
+}
+
+MappedFile::~MappedFile()
+{
+    delete _prefetcher;
+    unmapWindow();
+    // the tail of a bulk file that was read: nothing is left to write back
+    if (_dropBehind && !_writable && _dropped < _fileSize)
+        dropRange(_dropped, _fileSize - _dropped);
+    close(_fd);
+
+    // never published: an anonymous file disappears with its descriptor
+    if (_writable && !_published && !_tmpName.empty())
+        unlink(_tmpName.c_str());
+}
+
+std::string MappedFile::getDirectory()
+{
+    size_t slash = _destination.rfind('/');
+    if (slash == std::string::npos)
+        return ".";
+    return _destination.substr(0, slash);
+}
+
+std::string MappedFile::uniqueName()
+{
+    static std::atomic<unsigned long> counter(0);
+
+    std::string name = _destination;
+    size_t slash = _destination.rfind('/');
+    if (slash != std::string::npos)
+        name = _destination.substr(slash + 1);
+
+    // hidden, so it does not show up in the file list
+    return getDirectory() + "/." + name + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".part";
+}
+
+void MappedFile::createUnnamed(const char *filename)
+{
+    std::string directory = ".";
+    const char *slash = strrchr(filename, '/');
+    if (slash != NULL)
+        directory = std::string(filename, slash - filename);
+
+#ifdef O_TMPFILE
+    _fd = open(directory.c_str(), O_TMPFILE | O_RDWR, 0644);
+    if (_fd >= 0)
+        return;
+#endif
+
+    // file systems without O_TMPFILE
+    _tmpName = uniqueName();
+    _fd = open(_tmpName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (_fd < 0)
+    {
+        throw MappedFileException();
+    }
+}
+
+bool MappedFile::linkUnnamed(const std::string &name)
+{
+    // an O_TMPFILE gets its first name through /proc/self/fd
+    std::string procPath = "/proc/self/fd/" + std::to_string(_fd);
+    return linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, name.c_str(), AT_SYMLINK_FOLLOW) == 0;
+}
+
+void MappedFile::copyUnnamed(const std::string &name)
+{
+    // no /proc, or a file system refusing the link: the bytes go to a new
+    // named file, which replaces the anonymous one from now on
+    int fd = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+    {
+        throw MappedFileException();
+    }
+
+    loff_t inOffset = 0;
+    loff_t outOffset = 0;
+    uint64_t left = _fileSize;
+    while (left > 0)
+    {
+        ssize_t copied = copy_file_range(_fd, &inOffset, fd, &outOffset, left, 0);
+        if (copied <= 0)
+        {
+            close(fd);
+            unlink(name.c_str());
+            throw MappedFileException();
+        }
+        left -= copied;
+    }
+
+    // the caller may have synced the anonymous file already (Durability):
+    // the copy is synced too, a rare path does not weaken the commit
+    if (fdatasync(fd) < 0)
+    {
+        close(fd);
+        unlink(name.c_str());
+        throw MappedFileException();
+    }
+
+    unmapWindow();
+    close(_fd);
+    _fd = fd;
+}
+
+void MappedFile::publish()
+{
+    if (!_writable || _published)
+        return;
+
+    if (_tmpName.empty())
+    {
+        if (linkUnnamed(_destination))
+        {
+            _published = true;
+            return;
+        }
+
+        // linkat never replaces, and may not work at all: a unique name, then
+        // renamed over the old file
+        _tmpName = uniqueName();
+        if (!linkUnnamed(_tmpName))
+            copyUnnamed(_tmpName);
+    }
+
+    if (renameat(AT_FDCWD, _tmpName.c_str(), AT_FDCWD, _destination.c_str()) < 0)
+    {
+        throw MappedFileException();
+    }
+    _published = true;
+}
+
+void MappedFile::keepAs(const char *partialName)
+{
+    if (!_writable || _published)
+        return;
+
+    if (_tmpName.empty())
+    {
+        unlink(partialName);
+        if (!linkUnnamed(partialName))
+            copyUnnamed(partialName);
+    }
+    else if (_tmpName != partialName && rename(_tmpName.c_str(), partialName) < 0)
+    {
+        throw MappedFileException();
+    }
+
+    // the partial name is not removed by the destructor
+    _tmpName.clear();
+    _published = true;
+}
+
+uint64_t MappedFile::size()
+{
+    return _fileSize;
+}
+
+uint64_t MappedFile::getFingerprint()
+{
+    struct stat fileStat;
+    if (fstat(_fd, &fileStat) < 0)
+        return 0;
+
+    uint64_t fingerprint = (uint64_t)fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+int MappedFile::getDescriptor()
+{
+    return _fd;
+}
+
+void MappedFile::unmapWindow()
+{
+    if (_window != NULL)
+    {
+        munmap(_window, _windowLength);
+        _window = NULL;
+    }
+}
+
+unsigned char *MappedFile::map(uint64_t offset, size_t length)
+{
+    if (offset + length > _fileSize)
+    {
+        throw MappedFileException();
+    }
+
+    if (_window != NULL && offset >= _windowOffset && offset + length <= _windowOffset + _windowLength)
+    {
+        return _window + (offset - _windowOffset);
+    }
+
+    unmapWindow();
+
+    // mappings start on a page boundary
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    _windowOffset = offset - offset % pageSize;
+    _windowLength = MMAP_WINDOW;
+    if (_windowLength < offset + length - _windowOffset)
+        _windowLength = offset + length - _windowOffset;
+    if (_windowOffset + _windowLength > _fileSize)
+        _windowLength = _fileSize - _windowOffset;
+
+    int protection = _writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *window = mmap(NULL, _windowLength, protection, MAP_SHARED, _fd, _windowOffset);
+    if (window == MAP_FAILED)
+    {
+        throw MappedFileException();
+    }
+    _window = (unsigned char *)window;
+
+    madvise(_window, _windowLength, MADV_SEQUENTIAL);
+
+    return _window + (offset - _windowOffset);
+}
+
+void MappedFile::setCachePolicy(const CachePolicy &policy)
+{
+    _policy = policy;
+    _dropBehind = policy.dropBehindThreshold > 0 && _fileSize >= policy.dropBehindThreshold;
+
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    _hintStep = policy.readAheadWindow / 4;
+    if (_hintStep < pageSize)
+        _hintStep = (_dropBehind ? MMAP_WINDOW / 16 : 0);
+    if (_hintStep > MMAP_WINDOW / 4)
+        _hintStep = MMAP_WINDOW / 4;
+    _hintStep -= _hintStep % pageSize;
+
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    delete _prefetcher;
+    _prefetcher = NULL;
+    if (!_writable && policy.prefetchChunks > 0 && _fileSize > PREFETCH_CHUNK)
+        _prefetcher = new FilePrefetcher(_fd, _fileSize, policy.prefetchChunks);
+}
+
+void MappedFile::countResidentPages(uint64_t offset, uint64_t length)
+{
+    // how much of what is about to be read was already in the page cache,
+    // kept apart for bulk files and for the small (hot) ones
+    if (_window == NULL || offset < _windowOffset || offset >= _windowOffset + _windowLength)
+        return;
+    if (offset + length > _windowOffset + _windowLength)
+        length = _windowOffset + _windowLength - offset;
+
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t begin = offset - offset % pageSize;
+    uint64_t pages = (offset + length - begin + pageSize - 1) / pageSize;
+
+    std::vector<unsigned char> residency(pages);
+    if (mincore(_window + (begin - _windowOffset), offset + length - begin, residency.data()) != 0)
+        return;
+
+    long resident = 0;
+    for (size_t i = 0; i < pages; i++)
+        resident += residency[i] & 1;
+
+    std::string kind = _dropBehind ? "bulk" : "small";
+    Metrics::add("pagecache_" + kind + "_pages_read_total", pages);
+    Metrics::add("pagecache_" + kind + "_pages_resident_total", resident);
+}
+
+void MappedFile::dropRange(uint64_t offset, uint64_t length)
+{
+    if (_window != NULL && offset >= _windowOffset && offset + length <= _windowOffset + _windowLength)
+    {
+        // pages still mapped here cannot be evicted
+        madvise(_window + (offset - _windowOffset), length, MADV_DONTNEED);
+    }
+    posix_fadvise(_fd, offset, length, POSIX_FADV_DONTNEED);
+    Metrics::add("pagecache_bytes_dropped_total", length);
+}
+
+void MappedFile::advise(uint64_t cursor)
+{
+    if (_prefetcher != NULL)
+        _prefetcher->advance(cursor);
+
+    if (_hintStep == 0 || cursor < _nextHint || cursor >= _fileSize)
+        return;
+
+    uint64_t stepBegin = cursor - cursor % _hintStep;
+    _nextHint = stepBegin + _hintStep;
+
+    if (!_writable)
+    {
+        uint64_t stepLength = _fileSize - stepBegin < _hintStep ? _fileSize - stepBegin : _hintStep;
+        map(stepBegin, stepLength);
+        countResidentPages(stepBegin, stepLength);
+
+        if (_policy.readAheadWindow > 0)
+            posix_fadvise(_fd, stepBegin, _policy.readAheadWindow, POSIX_FADV_WILLNEED);
+    }
+
+    if (!_dropBehind || stepBegin < _hintStep)
+        return;
+
+    // everything before the previous step is done with
+    uint64_t doneUpTo = stepBegin - _hintStep;
+    if (_writable)
+    {
+        // dirty pages are evicted only once written: start the write-back of the
+        // previous step now and drop the one before it, whose write-back has had a step to finish
+        if (stepBegin > _flushed)
+        {
+            sync_file_range(_fd, _flushed, stepBegin - _flushed, SYNC_FILE_RANGE_WRITE);
+            _flushed = stepBegin;
+        }
+        if (doneUpTo > _dropped)
+        {
+            sync_file_range(_fd, _dropped, doneUpTo - _dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+    }
+
+    if (doneUpTo > _dropped)
+    {
+        dropRange(_dropped, doneUpTo - _dropped);
+        _dropped = doneUpTo;
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef MAPPED_FILE
+#define MAPPED_FILE
+
+#include "FilePrefetcher.h"
+#include <exception>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MMAP_WINDOW 67108864 //bytes mapped at a time, huge files are walked window by window
+#define READ_AHEAD_WINDOW 8388608 //bytes hinted (WILLNEED) ahead of the cursor
+#define DROP_BEHIND_THRESHOLD 67108864 //files from this size on leave no pages behind the cursor
+#define PREFETCH_CHUNKS 0 //chunks (PREFETCH_CHUNK) a prefetch thread keeps read ahead of the cursor, 0: no thread
+
+// page cache hints given while a transfer walks the file
+struct CachePolicy
+{
+    uint64_t readAheadWindow;      // 0: no WILLNEED hints
+    uint64_t dropBehindThreshold;  // 0: never drop pages behind the cursor
+    uint64_t prefetchChunks;       // 0: no prefetch thread
+};
+
+class MappedFileException : public std::exception
+{
+    public:
+    const char *what() const throw()
+    {
+        return "not possible map the file in memory";
+    }
+};
+
+// File accessed through a sliding memory mapping.
+// Read mode maps an existing file read-only; write mode creates an unnamed
+// file (O_TMPFILE, or a hidden unique name where not supported) in the
+// destination directory, sizes it to the announced length and gives it the
+// destination name only on publish(). Until then the destination is untouched
+// and a failed transfer leaves nothing behind, unless it is kept under a
+// partial name (keepAs) to be reopened and completed later.
+class MappedFile
+{
+private:
+    int _fd;
+    bool _writable;
+    uint64_t _fileSize;
+
+    std::string _destination;
+    std::string _tmpName;   // empty when the file is anonymous (O_TMPFILE)
+    bool _published;
+
+    unsigned char *_window;
+    uint64_t _windowOffset;
+    size_t _windowLength;
+
+    CachePolicy _policy;
+    bool _dropBehind;
+    uint64_t _hintStep;
+    uint64_t _nextHint;
+    uint64_t _flushed;
+    uint64_t _dropped;
+    FilePrefetcher *_prefetcher;
+
+    void unmapWindow();
+    void init();
+    void countResidentPages(uint64_t offset, uint64_t length);
+    void dropRange(uint64_t offset, uint64_t length);
+    void createUnnamed(const char *filename);
+    std::string uniqueName();
+    // names the O_TMPFILE; false if it cannot be linked (name taken, no /proc...)
+    bool linkUnnamed(const std::string &name);
+    // copies the O_TMPFILE to a new file name, synced, and goes on with the copy
+    void copyUnnamed(const std::string &name);
+
+public:
+    MappedFile(const char *filename);
+    // reserveAll false: the file starts as one hole, blocks are allocated by reserve()
+    MappedFile(const char *filename, uint64_t fileSize, bool reserveAll);
+    // write mode on a partial file kept by keepAs(), of fileSize bytes
+    MappedFile(const char *filename, uint64_t fileSize, const char *partialName);
+    ~MappedFile();
+
+    uint64_t size();
+    int getDescriptor();
+    // read mode: changes whenever the file is rewritten (modification time in ns, 0 if unknown)
+    uint64_t getFingerprint();
+
+    // read mode: extents holding data, holes are skipped
+    bool isSparse();
+    // first extent with data at or after from; false when only holes are left
+    bool nextDataExtent(uint64_t from, uint64_t &start, uint64_t &length);
+    // write mode: allocates the blocks of [offset, offset + length)
+    void reserve(uint64_t offset, uint64_t length);
+
+    // write mode: atomically gives the complete file its destination name.
+    // Readers see the old file or the new one, never a part; nothing is made
+    // durable here, a crash may lose both the data and the name (see Durability)
+    void publish();
+    // write mode: keeps the unpublished file under partialName, replacing it
+    void keepAs(const char *partialName);
+    // directory the file is published in
+    std::string getDirectory();
+
+    // pointer to the bytes [offset, offset + length), remapping the window if needed
+    unsigned char *map(uint64_t offset, size_t length);
+
+    void setCachePolicy(const CachePolicy &policy);
+    // to be called as the transfer advances: read-ahead in front of cursor
+    // (prefetch thread for files longer than a chunk), write-back and
+    // eviction behind it (one step every readAheadWindow/4 bytes)
+    void advise(uint64_t cursor);
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "Metrics.h"
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+
+using namespace std;
+
+struct Metric
+{
+    long value;
+    const char *type;
+};
+
+static mutex metricsMutex;
+static map<string, Metric> metricsValues;
+
+void Metrics::add(const string &name, long delta)
+{
+    lock_guard<mutex> lock(metricsMutex);
+    Metric &metric = metricsValues[name];
+    metric.value += delta;
+    metric.type = "counter";
+}
+
+void Metrics::increment(const string &name)
+{
+    add(name, 1);
+}
+
+void Metrics::set(const string &name, long value)
+{
+    lock_guard<mutex> lock(metricsMutex);
+    Metric &metric = metricsValues[name];
+    metric.value = value;
+    metric.type = "gauge";
+}
+
+long Metrics::get(const string &name)
+{
+    lock_guard<mutex> lock(metricsMutex);
+    map<string, Metric>::iterator it = metricsValues.find(name);
+    if (it == metricsValues.end())
+        return 0;
+
+    return it->second.value;
+}
+
+bool Metrics::dump(const char* filename)
+{
+    // written aside and renamed, so a reader never sees half a file
+    string tmpName = string(filename) + ".tmp";
+    ofstream os(tmpName.c_str());
+    if (!os.is_open())
+        return false;
+
+    {
+        lock_guard<mutex> lock(metricsMutex);
+        for (map<string, Metric>::iterator it = metricsValues.begin(); it != metricsValues.end(); ++it)
+        {
+            os << "# TYPE " << it->first << " " << it->second.type << "\n";
+            os << it->first << " " << it->second.value << "\n";
+        }
+    }
+    os.close();
+
+    return rename(tmpName.c_str(), filename) == 0;
+}
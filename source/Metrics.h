@@ -0,0 +1,19 @@
+#ifndef METRICS
+#define METRICS
+
+#include <string>
+
+// process wide counters and gauges, exported as a text file
+// (Prometheus text format: "# TYPE name counter|gauge", then "name value");
+// add() and increment() make a counter, set() a gauge
+class Metrics
+{
+    public:
+        static void add(const std::string &name, long delta);
+        static void increment(const std::string &name);
+        static void set(const std::string &name, long value);
+        static long get(const std::string &name);
+        static bool dump(const char* filename);
+};
+
+#endif
@@ -0,0 +1,568 @@
+#include "Multiplexer.h"
+#include "SecureMessageCreator.h"
+#include "socket_lib.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <vector>
+
+using namespace std;
+
+MuxStream::MuxStream(Multiplexer *mux, uint16_t id)
+{
+    _mux = mux;
+    _id = id;
+    _announced = false;
+    _localClosed = false;
+    _closeSent = false;
+    _remoteClosed = false;
+    _queued = 0;
+    _consumed = 0;
+    _credit = MUX_WINDOW;
+}
+
+MuxStream::~MuxStream()
+{
+}
+
+void MuxStream::sendMsg(void *buffer, size_t bufferSize)
+{
+    _mux->send(this, buffer, bufferSize);
+}
+
+int MuxStream::recvMsg(void **buffer)
+{
+    return _mux->recv(this, buffer);
+}
+
+int MuxStream::getSocket()
+{
+    return -1;
+}
+
+Multiplexer::Multiplexer(IClientServerTCP *csTCP, bool isServer, SecureMessageCreator *controlKeys)
+{
+    _csTCP = csTCP;
+    _isServer = isServer;
+    _controlKeys = controlKeys;
+    _controlSent = MUX_CONTROL_NONCE + (isServer ? 1 : 0);
+    _controlReceived = MUX_CONTROL_NONCE + (isServer ? 0 : 1);
+    _nextId = 0;
+    _lastServed = 0;
+    _writing = false;
+    _running = true;
+    _readBuffer = new unsigned char[MUX_READ_BUFFER];
+    _readStart = 0;
+    _readEnd = 0;
+
+    // a frame queued here can still be overtaken, not one already in the socket buffer
+    int lowat = MUX_NOTSENT_LOWAT;
+    setsockopt(_csTCP->getSocket(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+    _reader = thread(&Multiplexer::readerLoop, this);
+}
+
+Multiplexer::~Multiplexer()
+{
+    stop();
+    _reader.join();
+
+    // threads still using a stream close it on their DisconnectionException
+    unique_lock<mutex> lock(_mutex);
+    _changed.wait(lock, [this] { return _streams.empty(); });
+    for (size_t i = 0; i < _credits.size(); i++)
+        delete[] _credits[i].first;
+    delete[] _readBuffer;
+    _controlKeys->destroyKeysIfSetted();
+    delete _controlKeys;
+}
+
+void Multiplexer::freeStream(MuxStream *stream)
+{
+    for (size_t i = 0; i < stream->_incoming.size(); i++)
+        delete[] stream->_incoming[i].first;
+    for (size_t i = 0; i < stream->_outgoing.size(); i++)
+        delete[] stream->_outgoing[i].first;
+
+    _streams.erase(stream->_id);
+    delete stream;
+    _changed.notify_all();
+}
+
+void Multiplexer::stop()
+{
+    lock_guard<mutex> lock(_mutex);
+    stopLocked();
+}
+
+void Multiplexer::stopLocked()
+{
+    if (!_running)
+        return;
+    _running = false;
+
+    // wakes the reader up
+    shutdown(_csTCP->getSocket(), SHUT_RDWR);
+
+    // streams nobody is going to close any more
+    for (size_t i = 0; i < _accepted.size(); i++)
+        _accepted[i]->_localClosed = true;
+    _accepted.clear();
+
+    vector<MuxStream *> closed;
+    for (map<uint16_t, MuxStream *>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+    {
+        if (it->second->_localClosed)
+            closed.push_back(it->second);
+    }
+    for (size_t i = 0; i < closed.size(); i++)
+        freeStream(closed[i]);
+    _changed.notify_all();
+    _written.notify_all();
+}
+
+void Multiplexer::releaseIfDone(MuxStream *stream)
+{
+    if (stream->_closeSent && stream->_remoteClosed)
+        freeStream(stream);
+}
+
+MuxStream *Multiplexer::openStream()
+{
+    unique_lock<mutex> lock(_mutex);
+    _changed.wait(lock, [this] { return !_running || _streams.size() < MUX_MAX_STREAMS; });
+    if (!_running)
+        throw DisconnectionException();
+
+    // 0 is never used, nor an id the server may still know
+    do
+    {
+        _nextId++;
+    } while (_nextId == 0 || _streams.count(_nextId) > 0);
+
+    MuxStream *stream = new MuxStream(this, _nextId);
+    _streams[_nextId] = stream;
+    return stream;
+}
+
+MuxStream *Multiplexer::acceptStream()
+{
+    unique_lock<mutex> lock(_mutex);
+    _changed.wait(lock, [this] { return !_running || !_accepted.empty(); });
+    if (!_running)
+        return NULL;
+
+    MuxStream *stream = _accepted.front();
+    _accepted.pop_front();
+    return stream;
+}
+
+void Multiplexer::closeStream(MuxStream *stream)
+{
+    unique_lock<mutex> lock(_mutex);
+    stream->_localClosed = true;
+
+    // the other side never heard of it
+    if (!_running || !stream->_announced)
+    {
+        freeStream(stream);
+        return;
+    }
+
+    // what was received and not read is of no use any more
+    for (size_t i = 0; i < stream->_incoming.size(); i++)
+        delete[] stream->_incoming[i].first;
+    stream->_incoming.clear();
+
+    stream->_queued = 0;
+    queueFrame(stream->_outgoing, stream->_id, MUX_FRAME_CLOSE, NULL, 0);
+
+    // a small frame: the stream writing, if any, does not leave it behind
+    if (_writing)
+        return;
+    try
+    {
+        flush(lock, stream);
+    }
+    catch (const DisconnectionException &de)
+    {
+        // the connection is gone, and the stream with it
+    }
+}
+
+void Multiplexer::queueFrame(deque<pair<unsigned char *, size_t>> &queue, uint16_t id, char type, const void *payload, size_t length)
+{
+    unsigned char *frame = new unsigned char[MUX_HEADER_SIZE + length];
+    uint16_t standardId = htons(id);
+    memcpy(frame, &standardId, sizeof(standardId));
+    frame[2] = type;
+    if (length > 0)
+        memcpy(frame + MUX_HEADER_SIZE, payload, length);
+    queue.push_back(make_pair(frame, MUX_HEADER_SIZE + length));
+}
+
+void Multiplexer::send(MuxStream *stream, void *buffer, size_t bufferSize)
+{
+    if (MUX_HEADER_SIZE + bufferSize > UINT16_MAX)
+        throw MultiplexerException();
+
+    unique_lock<mutex> lock(_mutex);
+    // once the other side closed the stream it throws what comes away, no credit needed
+    _changed.wait(lock, [this, stream, bufferSize] { return !_running || stream->_remoteClosed || stream->_credit >= bufferSize; });
+    if (!_running)
+        throw DisconnectionException();
+    if (!stream->_remoteClosed)
+        stream->_credit -= bufferSize;
+
+    stream->_announced = true;
+    if (!_writing && _credits.empty() && nextToSend() == NULL)
+        writeData(lock, stream, buffer, bufferSize);
+    else
+        queueFrame(stream->_outgoing, stream->_id, MUX_FRAME_DATA, buffer, bufferSize);
+    flush(lock, stream);
+}
+
+int Multiplexer::recv(MuxStream *stream, void **buffer)
+{
+    unique_lock<mutex> lock(_mutex);
+    _changed.wait(lock, [this, stream] { return !_running || !stream->_incoming.empty() || stream->_remoteClosed; });
+
+    if (!stream->_incoming.empty())
+    {
+        pair<unsigned char *, int> record = stream->_incoming.front();
+        stream->_incoming.pop_front();
+        stream->_queued -= record.second;
+
+        // the room freed goes back to the sender a bit at a time, as long as it sends
+        stream->_consumed += record.second;
+        if (stream->_consumed >= MUX_CREDIT_UPDATE && !stream->_remoteClosed)
+        {
+            uint32_t credit = htonl(stream->_consumed);
+            queueFrame(_credits, stream->_id, MUX_FRAME_CREDIT, &credit, sizeof(credit));
+            stream->_consumed = 0;
+
+            // a small frame: the stream writing, if any, does not leave it behind
+            if (!_writing)
+            {
+                try
+                {
+                    flush(lock, stream);
+                }
+                catch (const DisconnectionException &de)
+                {
+                    // the next receive finds out
+                }
+            }
+        }
+
+        *buffer = record.first;
+        return record.second;
+    }
+    if (!_running)
+        throw DisconnectionException();
+
+    // the other side gave up on this command, the session goes on
+    throw NetworkException();
+}
+
+MuxStream *Multiplexer::nextToSend()
+{
+    // both passes start after the stream served last, so each gets its turn
+    MuxStream *bulk = NULL;
+    map<uint16_t, MuxStream *>::iterator it = _streams.upper_bound(_lastServed);
+    for (size_t i = 0; i < _streams.size(); i++, ++it)
+    {
+        if (it == _streams.end())
+            it = _streams.begin();
+
+        MuxStream *stream = it->second;
+        if (stream->_outgoing.empty())
+            continue;
+        if (stream->_outgoing.front().second <= MUX_HEADER_SIZE + MUX_CONTROL_SIZE)
+            return stream;
+        if (bulk == NULL)
+            bulk = stream;
+    }
+    return bulk;
+}
+
+unsigned char *Multiplexer::sealControl(unsigned char *frame, size_t &size)
+{
+    // the header stays in the clear to route the frame, and goes in the record too
+    unsigned char *sealed = new unsigned char[MUX_HEADER_SIZE + size + _controlKeys->getRecordOverhead()];
+    memcpy(sealed, frame, MUX_HEADER_SIZE);
+    int recordSize = _controlKeys->EncryptAndSignMessageInto(frame, size, sealed + MUX_HEADER_SIZE, true, _controlSent);
+    _controlSent += 2;
+
+    delete[] frame;
+    size = MUX_HEADER_SIZE + recordSize;
+    return sealed;
+}
+
+int Multiplexer::openControl(const unsigned char *frame, int frameSize, unsigned char *payload)
+{
+    unsigned char plainText[MUX_HEADER_SIZE + MUX_CREDIT_SIZE];
+    int plainTextLen;
+    if (_controlReceived >= MUX_CONTROL_NONCE_END ||
+        !_controlKeys->DecryptAndCheckSignInto(frame + MUX_HEADER_SIZE, frameSize - MUX_HEADER_SIZE, plainText, sizeof(plainText), plainTextLen, true, _controlReceived) ||
+        plainTextLen < MUX_HEADER_SIZE || memcmp(plainText, frame, MUX_HEADER_SIZE) != 0)
+        throw MultiplexerException();
+    _controlReceived += 2;
+
+    memcpy(payload, plainText + MUX_HEADER_SIZE, plainTextLen - MUX_HEADER_SIZE);
+    return plainTextLen - MUX_HEADER_SIZE;
+}
+
+void Multiplexer::writeData(unique_lock<mutex> &lock, MuxStream *stream, void *buffer, size_t bufferSize)
+{
+    unsigned char header[MUX_HEADER_SIZE];
+    uint16_t standardId = htons(stream->_id);
+    memcpy(header, &standardId, sizeof(standardId));
+    header[2] = MUX_FRAME_DATA;
+    _lastServed = stream->_id;
+
+    _writing = true;
+    lock.unlock();
+
+    bool sent = true;
+    try
+    {
+        sendTCPWithHeader(_csTCP->getSocket(), header, MUX_HEADER_SIZE, buffer, bufferSize);
+    }
+    catch (const exception &e)
+    {
+        sent = false;
+    }
+
+    lock.lock();
+    _writing = false;
+    _written.notify_all();
+    if (!sent)
+        stopLocked();
+}
+
+bool Multiplexer::writeBatch(unique_lock<mutex> &lock, MuxStream *own)
+{
+    void *frames[MUX_BATCH_FRAMES];
+    size_t sizes[MUX_BATCH_FRAMES];
+    MuxStream *closing[MUX_BATCH_FRAMES];
+    int count = 0;
+    int closeCount = 0;
+
+    // control records left for the batch: none would take a command nonce
+    if (_controlSent + 2 * MUX_BATCH_FRAMES >= MUX_CONTROL_NONCE_END)
+    {
+        stopLocked();
+        throw DisconnectionException();
+    }
+
+    // picked one frame at a time, sealed in the order they are written, written in one system call
+    while (!_credits.empty() && count < MUX_BATCH_FRAMES)
+    {
+        sizes[count] = _credits.front().second;
+        frames[count] = sealControl(_credits.front().first, sizes[count]);
+        _credits.pop_front();
+        count++;
+    }
+    MuxStream *stream = nextToSend();
+    while (stream != NULL && count < MUX_BATCH_FRAMES)
+    {
+        frames[count] = stream->_outgoing.front().first;
+        sizes[count] = stream->_outgoing.front().second;
+        stream->_outgoing.pop_front();
+        if (((unsigned char *)frames[count])[2] == MUX_FRAME_CLOSE)
+        {
+            frames[count] = sealControl((unsigned char *)frames[count], sizes[count]);
+            closing[closeCount++] = stream;
+        }
+        count++;
+
+        _lastServed = stream->_id;
+        stream = nextToSend();
+    }
+    bool ownTaken = own == NULL || own->_outgoing.empty();
+
+    _writing = true;
+    lock.unlock();
+
+    bool sent = true;
+    try
+    {
+        sendTCPBatch(_csTCP->getSocket(), frames, sizes, count);
+    }
+    catch (const exception &e)
+    {
+        sent = false;
+    }
+    for (int i = 0; i < count; i++)
+        delete[] (unsigned char *)frames[i];
+
+    lock.lock();
+    _writing = false;
+    _written.notify_all();
+
+    if (!sent)
+    {
+        stopLocked();
+    }
+    else if (_running)
+    {
+        // freed only now that their close frame is out
+        for (int i = 0; i < closeCount; i++)
+        {
+            closing[i]->_closeSent = true;
+            releaseIfDone(closing[i]);
+        }
+    }
+    return ownTaken;
+}
+
+void Multiplexer::flush(unique_lock<mutex> &lock, MuxStream *own)
+{
+    // once the frames of own are taken it may be freed (closed): not touched any more
+    bool taken = own->_outgoing.empty();
+    for (;;)
+    {
+        if (!_running)
+            throw DisconnectionException();
+
+        if (_writing)
+        {
+            // only an open stream waits here, nobody frees it meanwhile
+            _written.wait(lock);
+            if (own->_outgoing.empty())
+                return;
+            continue;
+        }
+
+        // the small frames queued while writing are not left behind
+        MuxStream *next = nextToSend();
+        bool small = !_credits.empty() || (next != NULL && next->_outgoing.front().second <= MUX_HEADER_SIZE + MUX_CONTROL_SIZE);
+        if ((next == NULL && _credits.empty()) || (taken && !small))
+            return;
+        taken = writeBatch(lock, taken ? NULL : own) || taken;
+    }
+}
+
+int Multiplexer::readFrame(unsigned char **frame)
+{
+    int socket = _csTCP->getSocket();
+
+    // several frames come with each recv(), a frame is at most 2 + UINT16_MAX bytes
+    size_t length = 0;
+    for (;;)
+    {
+        size_t available = _readEnd - _readStart;
+        if (available >= sizeof(uint16_t))
+        {
+            uint16_t standardSize;
+            memcpy(&standardSize, _readBuffer + _readStart, sizeof(uint16_t));
+            length = ntohs(standardSize);
+            if (available >= sizeof(uint16_t) + length)
+                break;
+        }
+
+        // what arrived with the last recv() was handed out: one wake up for all of it
+        _changed.notify_all();
+
+        if (_readStart > 0)
+        {
+            memmove(_readBuffer, _readBuffer + _readStart, available);
+            _readStart = 0;
+            _readEnd = available;
+        }
+        ssize_t numberOfBytes = ::recv(socket, _readBuffer + _readEnd, MUX_READ_BUFFER - _readEnd, 0);
+        if (numberOfBytes == 0)
+            throw DisconnectionException();
+        if (numberOfBytes < 0)
+            throw NetworkException();
+        _readEnd += numberOfBytes;
+    }
+
+    *frame = _readBuffer + _readStart + sizeof(uint16_t);
+    _readStart += sizeof(uint16_t) + length;
+    return length;
+}
+
+void Multiplexer::readerLoop()
+{
+    try
+    {
+        for (;;)
+        {
+            unsigned char *header;
+            int frameSize = readFrame(&header);
+            if (frameSize < MUX_HEADER_SIZE)
+                throw MultiplexerException();
+
+            uint16_t id;
+            memcpy(&id, header, sizeof(id));
+            id = ntohs(id);
+            char type = header[2];
+
+            unique_lock<mutex> lock(_mutex);
+            int length = frameSize - MUX_HEADER_SIZE;
+            unsigned char control[MUX_CREDIT_SIZE];
+            if (type == MUX_FRAME_CLOSE || type == MUX_FRAME_CREDIT)
+                length = openControl(header, frameSize, control);
+
+            MuxStream *stream = NULL;
+            map<uint16_t, MuxStream *>::iterator it = _streams.find(id);
+            if (it != _streams.end())
+            {
+                stream = it->second;
+            }
+            else if (_isServer && type == MUX_FRAME_DATA && _streams.size() < MUX_MAX_STREAMS)
+            {
+                // a new command
+                stream = new MuxStream(this, id);
+                stream->_announced = true;
+                _streams[id] = stream;
+                _accepted.push_back(stream);
+            }
+
+            if (stream == NULL || stream->_remoteClosed)
+                throw MultiplexerException();
+
+            if (type == MUX_FRAME_CLOSE)
+            {
+                if (length != 0)
+                    throw MultiplexerException();
+                stream->_remoteClosed = true;
+                releaseIfDone(stream);
+                continue;
+            }
+
+            if (type == MUX_FRAME_CREDIT)
+            {
+                if (length != MUX_CREDIT_SIZE)
+                    throw MultiplexerException();
+                uint32_t credit;
+                memcpy(&credit, control, sizeof(credit));
+
+                // more than was sent: not a peer to trust
+                stream->_credit += ntohl(credit);
+                if (stream->_credit > MUX_WINDOW)
+                    throw MultiplexerException();
+                continue;
+            }
+
+            if (type != MUX_FRAME_DATA || stream->_queued + length > MUX_WINDOW)
+                throw MultiplexerException();
+            if (stream->_localClosed)
+                continue;
+
+            // the record in memory of its own, freed by the stream user
+            unsigned char *frame = new unsigned char[length];
+            memcpy(frame, header + MUX_HEADER_SIZE, length);
+            stream->_incoming.push_back(make_pair(frame, length));
+            stream->_queued += length;
+        }
+    }
+    catch (const exception &e)
+    {
+    }
+    stop();
+}
@@ -0,0 +1,152 @@
+#ifndef MULTIPLEXER
+#define MULTIPLEXER
+
+#include "IClientServerTCP.h"
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MUX_MAX_STREAMS 8       //streams a session can have open at once
+#define MUX_WINDOW 262144       //bytes of records a stream can have received and not read yet
+#define MUX_CREDIT_UPDATE 65536 //bytes read before they are granted back to the sender, at most MUX_WINDOW - UINT16_MAX
+#define MUX_CONTROL_SIZE 512    //frames up to this size go before bigger ones (commands, answers, headers)
+#define MUX_NOTSENT_LOWAT 65536 //unsent bytes left to the kernel, the rest waits here where it can be overtaken
+#define MUX_BATCH_FRAMES 16     //frames written with one system call, at most TCP_BATCH_MAX
+#define MUX_READ_BUFFER 131072  //bytes read with one system call, at least one whole frame
+
+// every message of a multiplexed session: stream id (16-bit big endian),
+// frame type, then the secure record of that stream
+#define MUX_FRAME_DATA 'D'
+#define MUX_FRAME_CLOSE 'C' //nothing more from this side on the stream
+#define MUX_FRAME_CREDIT 'W' //the other side may send 32-bit big endian more bytes of records
+#define MUX_CREDIT_SIZE 4
+#define MUX_HEADER_SIZE 3
+
+// a control frame (close, credit) carries instead a record sealed with the
+// session keys of its id, type and payload, numbered in the order they are
+// written: a forged, replayed or dropped one ends the session. A data record
+// needs none of this, its nonces belong to the command of its stream
+#define MUX_CONTROL_NONCE 4               //first control record nonce, past the capability ones: client even, server odd
+#define MUX_CONTROL_NONCE_END (1UL << 32) //first nonce of the commands (COMMAND_NONCE_SHIFT)
+
+class MultiplexerException : public std::exception
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Not valid multiplexed frame";
+    }
+};
+
+class Multiplexer;
+class SecureMessageCreator;
+
+// one command of a multiplexed session, used as a connection of its own by
+// the SecureConnection of the command. Sending waits while the other side
+// has no room for the record. Once the other side closed it,
+// receiving throws NetworkException; if the whole connection is gone,
+// DisconnectionException.
+class MuxStream : public IClientServerTCP
+{
+    friend class Multiplexer;
+
+private:
+    Multiplexer *_mux;
+    uint16_t _id;
+    std::deque<std::pair<unsigned char *, int>> _incoming;  // records received
+    std::deque<std::pair<unsigned char *, size_t>> _outgoing; // frames not taken for writing yet
+    size_t _queued;   // bytes in _incoming
+    size_t _consumed; // bytes read and not granted back yet
+    size_t _credit;   // bytes this side can still send
+    bool _announced; // a frame went out, or came in: the other side knows the stream
+    bool _localClosed;
+    bool _closeSent;
+    bool _remoteClosed;
+
+    MuxStream(Multiplexer *mux, uint16_t id);
+    // freed by the Multiplexer only, once both sides closed it (see closeStream)
+    ~MuxStream();
+
+public:
+    void sendMsg(void *buffer, size_t bufferSize);
+    int recvMsg(void **buffer);
+    // the frames go through the session connection: nothing to use directly
+    int getSocket();
+};
+
+// Commands of a session run side by side over its single connection, each on
+// a stream of its own (opened by the client, one per command). A reader
+// thread hands the frames received to their streams and never waits for
+// them: a stream sends only the bytes the other side granted (MUX_WINDOW at
+// first, then what it read), so one that is not read holds only itself and
+// a connection never keeps more than MUX_MAX_STREAMS windows of records
+// received. There is no writer thread: a stream sending a frame writes it
+// itself, straight from its buffer when nothing else waits, unless another
+// stream is writing and takes it. Whoever writes takes the queued frames of
+// every stream, several per system call, small ones first and then one per
+// stream in turn, so a listing does not wait behind a download.
+class Multiplexer
+{
+    friend class MuxStream;
+
+private:
+    IClientServerTCP *_csTCP;
+    bool _isServer;
+    SecureMessageCreator *_controlKeys; // used with _mutex held
+    unsigned long _controlSent;         // nonce of the next control record written
+    unsigned long _controlReceived;     // nonce of the next control record expected
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::condition_variable _written; // a write ended: waited on by whoever has frames queued
+    std::map<uint16_t, MuxStream *> _streams; // open, or closing on one side
+    std::deque<MuxStream *> _accepted;        // opened by the client, not yet taken
+    std::deque<std::pair<unsigned char *, size_t>> _credits; // credit frames, written before any other
+    uint16_t _nextId;
+    uint16_t _lastServed;
+    bool _writing;
+    bool _running;
+
+    unsigned char *_readBuffer; // reader thread only
+    size_t _readStart;
+    size_t _readEnd;
+
+    std::thread _reader;
+
+    int readFrame(unsigned char **frame);
+    void readerLoop();
+    MuxStream *nextToSend();
+    void queueFrame(std::deque<std::pair<unsigned char *, size_t>> &queue, uint16_t id, char type, const void *payload, size_t length);
+    unsigned char *sealControl(unsigned char *frame, size_t &size);
+    int openControl(const unsigned char *frame, int frameSize, unsigned char *payload);
+    bool writeBatch(std::unique_lock<std::mutex> &lock, MuxStream *own);
+    void writeData(std::unique_lock<std::mutex> &lock, MuxStream *stream, void *buffer, size_t bufferSize);
+    void flush(std::unique_lock<std::mutex> &lock, MuxStream *own);
+    void releaseIfDone(MuxStream *stream);
+    void freeStream(MuxStream *stream);
+    void stopLocked();
+    void stop();
+
+    void send(MuxStream *stream, void *buffer, size_t bufferSize);
+    int recv(MuxStream *stream, void **buffer);
+
+public:
+    // the connection must already be secured; from here on only this object uses it.
+    // controlKeys: the session keys (see SecureConnection::copyRecordKeys), deleted here
+    Multiplexer(IClientServerTCP *csTCP, bool isServer, SecureMessageCreator *controlKeys);
+    // shuts the connection down, waits for every stream to be closed
+    ~Multiplexer();
+
+    // client: a new stream, waits while MUX_MAX_STREAMS are open
+    MuxStream *openStream();
+    // server: the next stream opened by the client, NULL once the connection is gone
+    MuxStream *acceptStream();
+    // what was queued is still sent; the stream must not be used afterwards
+    void closeStream(MuxStream *stream);
+};
+
+#endif
@@ -2,42 +2,61 @@
 #include <iostream>
 #include <sys/ioctl.h>
 #include <stdio.h>
+#include <mutex>
 
 using namespace std;
 
+// sessions print from several threads
+static mutex printMutex;
+
 void Printer::printInfo(const char* info)
 {
+    lock_guard<mutex> lock(printMutex);
     cout<<"["<<CYAN<<"INFO"<<RESET<<"] "<<info<<endl;
 }
 
 void Printer::printWaring(const char* warning)
 {
+    lock_guard<mutex> lock(printMutex);
     cout<<"["<<YELLOW<<"WARNING"<<RESET<<"] "<<warning<<endl<<endl;
 }
 
 void Printer::printError(const char* error)
 {
+    lock_guard<mutex> lock(printMutex);
     cerr<<"["<<RED<<"ERROR"<<RESET<<"] "<<error<<endl<<endl;
 }
 
 void Printer::printErrorWithReason(const char* error, const char* reason)
 {
+    lock_guard<mutex> lock(printMutex);
     cerr<<"["<<RED<<"ERROR"<<RESET<<"] "<<error<<endl;
     cerr<<"\t"<<RED<<"Reason: "<<RESET<<reason<<endl<<endl;
 }
 
 void Printer::printMsg(const char* msg)
 {
+    lock_guard<mutex> lock(printMutex);
     cout<<GREEN<<msg<<RESET<<endl;
 }
 
 void Printer::printPrompt(const char* prompt)
 {
+    lock_guard<mutex> lock(printMutex);
     cout<<MAGENTA<<prompt<<RESET<<" ";
 }
 
 void Printer::printLoadBar(double current, double end, bool error)
 {
+    // redrawn only when the percentage changes: drawing it for every chunk
+    // costs more than moving the chunk
+    static thread_local long lastPercentage = -1;
+    long percentage = (long)(current/end*100);
+    if(percentage == lastPercentage && current < end && !error)
+        return;
+    lastPercentage = (current >= end || error) ? -1 : percentage;
+
+    lock_guard<mutex> lock(printMutex);
     cout<<"\r";
     if(current >= end)
         cout<<GREEN;
@@ -50,15 +69,14 @@ void Printer::printLoadBar(double current, double end, bool error)
     cout<<"[";
 
     struct winsize w;
-    ioctl(0, TIOCGWINSZ, &w);
+    if(ioctl(0, TIOCGWINSZ, &w) != 0 || w.ws_col < 8)
+        w.ws_col = 80; //not a terminal
 
     double actualPercentage = current/end;
     int charToPrint = w.ws_col - 7;
 
     double stopPrintingHash = actualPercentage * charToPrint;
 
-    size_t partReaded = 0;
-    
     for (int i = 0; i < charToPrint; i++)
     {
         if(i < stopPrintingHash)
@@ -67,7 +85,7 @@ void Printer::printLoadBar(double current, double end, bool error)
             cout<<" ";
     }
 
-    cout<<"] "<<(long)(actualPercentage*100)<<"%"<<RESET;
+    cout<<"] "<<percentage<<"%"<<RESET;
 
     if(current >= end)
         cout<<endl<<endl;
@@ -80,11 +98,13 @@ void Printer::printLoadBar(double current, double end, bool error)
 
 void Printer::printNormal(const char* msg)
 {
+    lock_guard<mutex> lock(printMutex);
     cout<<msg;
 }
 
 void Printer::printTag(const char* TAG, const char* msg, const char* color)
 {
+    lock_guard<mutex> lock(printMutex);
     cout<<"["<<color<<TAG<<RESET<<"] "<<msg<<endl;
 }
 
@@ -0,0 +1,238 @@
+#include "RecordCompressor.h"
+#include <string.h>
+#include <time.h>
+
+RecordCompressor::RecordCompressor(int level)
+{
+    memset(&_deflater, 0, sizeof(_deflater));
+    memset(&_inflater, 0, sizeof(_inflater));
+
+    _level = level < 1 ? 1 : (level > COMPRESSION_MAX_LEVEL ? COMPRESSION_MAX_LEVEL : level);
+    if (deflateInit(&_deflater, _level) != Z_OK)
+        throw CompressionException();
+    if (inflateInit(&_inflater) != Z_OK)
+    {
+        deflateEnd(&_deflater);
+        throw CompressionException();
+    }
+    _deflaterUsed = false;
+
+    _skip = 0;
+    _backoff = COMPRESSION_BACKOFF;
+    _idle = 0;
+    _idleBackoff = COMPRESSION_IDLE_RECORDS;
+    _lastDeflated = false;
+    _lastLength = 0;
+    _compressNs = 0;
+    _sendNs = 0;
+    _tuneInput = 0;
+    _tuneRecords = 0;
+    _compressCost = 0;
+    _sendCost = 0;
+    _rawNs = 0;
+    _rawInput = 0;
+    _rawCost = 0;
+    _rawAge = 0;
+    _inputBytes = 0;
+    _outputBytes = 0;
+}
+
+RecordCompressor::~RecordCompressor()
+{
+    deflateEnd(&_deflater);
+    inflateEnd(&_inflater);
+}
+
+size_t RecordCompressor::compress(const unsigned char *data, size_t length, size_t maxLength, unsigned char *out)
+{
+    _inputBytes += length;
+
+    _lastDeflated = false;
+    _lastLength = length;
+    if (_idle > 0)
+    {
+        _idle--;
+    }
+    else if (_skip == 0 && length > 0)
+    {
+        _deflater.next_in = (Bytef *)data;
+        _deflater.avail_in = length;
+        _deflater.next_out = out + 1;
+        _deflater.avail_out = maxLength;
+        _deflaterUsed = true;
+
+        // what is left of the output after the flush: at least 1/8 of the record saved
+        uint64_t start = cpuTime();
+        int ret = deflate(&_deflater, Z_SYNC_FLUSH);
+        _compressNs += cpuTime() - start;
+        size_t compressed = maxLength - _deflater.avail_out;
+        if (ret == Z_OK && _deflater.avail_in == 0 && _deflater.avail_out > 0 && compressed < length - length / 8)
+        {
+            _backoff = COMPRESSION_BACKOFF;
+            _lastDeflated = true;
+            _tuneInput += length;
+            out[0] = RECORD_DEFLATE;
+            _outputBytes += 1 + compressed;
+            return 1 + compressed;
+        }
+
+        // probably compressed already: leave it alone for a while
+        _skip = _backoff;
+        if (_backoff < COMPRESSION_MAX_BACKOFF)
+            _backoff *= 2;
+    }
+    else if (_skip > 0)
+    {
+        _skip--;
+    }
+
+    // the receiver starts over at every raw record, so must the sender
+    if (_deflaterUsed)
+    {
+        deflateReset(&_deflater);
+        _deflaterUsed = false;
+    }
+    out[0] = RECORD_RAW;
+    memcpy(out + 1, data, length);
+    _outputBytes += 1 + length;
+    return 1 + length;
+}
+
+int RecordCompressor::decompress(const unsigned char *in, size_t length, unsigned char *dest, size_t capacity)
+{
+    if (length < 1)
+        return -1;
+
+    if (in[0] == RECORD_RAW)
+    {
+        inflateReset(&_inflater);
+        if (length - 1 > capacity)
+            return -1;
+        memcpy(dest, in + 1, length - 1);
+        return length - 1;
+    }
+    if (in[0] != RECORD_DEFLATE)
+        return -1;
+
+    _inflater.next_in = (Bytef *)in + 1;
+    _inflater.avail_in = length - 1;
+    _inflater.next_out = dest;
+    _inflater.avail_out = capacity;
+
+    int ret = inflate(&_inflater, Z_SYNC_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || _inflater.avail_in != 0)
+        return -1;
+    return capacity - _inflater.avail_out;
+}
+
+uint64_t RecordCompressor::cpuTime()
+{
+    // CPU of this thread: a peer sharing the machine does not make deflate look slower
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void RecordCompressor::sent(uint64_t ns)
+{
+    if (!_lastDeflated)
+    {
+        _rawNs += ns;
+        _rawInput += _lastLength;
+        return;
+    }
+
+    _sendNs += ns;
+    if (++_tuneRecords >= COMPRESSION_TUNE_RECORDS)
+        tune();
+}
+
+static uint64_t average(uint64_t average, uint64_t sample)
+{
+    return average == 0 ? sample : average - average / 8 + sample / 8;
+}
+
+void RecordCompressor::tune()
+{
+    int level = _level;
+
+    _compressCost = average(_compressCost, _compressNs * 65536 / _tuneInput);
+    _sendCost = average(_sendCost, _sendNs * 65536 / _tuneInput);
+    if (_rawInput >= COMPRESSION_RAW_MIN)
+    {
+        _rawCost = _rawNs * 65536 / _rawInput;
+        _rawAge = 0;
+    }
+    else if (++_rawAge >= COMPRESSION_RAW_EXPIRY)
+    {
+        // the link may have changed
+        _rawCost = 0;
+    }
+
+    if (_rawCost == 0)
+    {
+        // a pause times the link
+        _idle = _idleBackoff;
+    }
+    else if (_compressCost + _sendCost >= _rawCost)
+    {
+        // does not pay: a lower level, or a longer pause each time
+        if (_level > 1)
+        {
+            level = _level - 1;
+        }
+        else
+        {
+            _idle = _idleBackoff;
+            if (_idleBackoff < COMPRESSION_MAX_IDLE)
+                _idleBackoff *= 2;
+        }
+    }
+    else
+    {
+        _idleBackoff = COMPRESSION_IDLE_RECORDS;
+
+        // a slow link leaves time for a better ratio, a faster one waits on deflate
+        if (_sendCost > 2 * _compressCost && _level < COMPRESSION_MAX_LEVEL)
+            level = _level + 1;
+        else if (_compressCost > _sendCost && _level > 1)
+            level = _level - 1;
+    }
+
+    // every record is flushed, so nothing is pending: the change produces no output
+    if (level != _level && deflateParams(&_deflater, level, Z_DEFAULT_STRATEGY) == Z_OK)
+        _level = level;
+
+    _compressNs = 0;
+    _sendNs = 0;
+    _tuneInput = 0;
+    _tuneRecords = 0;
+    _rawNs = 0;
+    _rawInput = 0;
+}
+
+int RecordCompressor::getLevel()
+{
+    return _level;
+}
+
+void RecordCompressor::beginTransfer()
+{
+    // the level and the link timings are kept, they describe the session
+    deflateReset(&_deflater);
+    inflateReset(&_inflater);
+    _deflaterUsed = false;
+
+    _skip = 0;
+    _backoff = COMPRESSION_BACKOFF;
+}
+
+void RecordCompressor::endTransfer(uint64_t &input, uint64_t &output)
+{
+    input = _inputBytes;
+    output = _outputBytes;
+    _inputBytes = 0;
+    _outputBytes = 0;
+
+    beginTransfer();
+}
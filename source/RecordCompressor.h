@@ -0,0 +1,97 @@
+#ifndef RECORD_COMPRESSOR
+#define RECORD_COMPRESSOR
+
+#include <zlib.h>
+#include <exception>
+#include <stdint.h>
+#include <stddef.h>
+
+#define COMPRESSION_LEVEL 1           //deflate level a session starts from
+#define COMPRESSION_MAX_LEVEL 6       //the level tuning stops here, higher ones cost much more for little gain
+#define COMPRESSION_BACKOFF 8         //records sent as they are after one that did not compress
+#define COMPRESSION_MAX_BACKOFF 64    //doubled at each new failure up to this
+#define COMPRESSION_TUNE_RECORDS 128  //compressed records between two adjustments of the level
+#define COMPRESSION_IDLE_RECORDS 512  //records sent as they are when level 1 is not known to pay
+#define COMPRESSION_MAX_IDLE 16384    //doubled each time it still is up to this
+#define COMPRESSION_RAW_MIN 1048576   //bytes sent as they are needed to time the link, fewer may just fill the socket buffer
+#define COMPRESSION_RAW_EXPIRY 64     //level adjustments after which that time is measured again
+
+// first byte of a body record when compression is active
+#define RECORD_RAW 0     //the bytes as they are, both streams start over
+#define RECORD_DEFLATE 1 //deflate output (sync flushed) of the same stream as the previous records
+
+class CompressionException : public std::exception
+{
+    public:
+    const char *what() const throw()
+    {
+        return "not possible initialize the compression streams";
+    }
+};
+
+// Compression of the file body records of a session, before they are
+// encrypted. One deflate stream per direction lasts a transfer, each record
+// being flushed on its own, so later records reuse what earlier ones taught
+// the stream. Both streams start over with every transfer: the size of a
+// record never depends on another file (CRIME-like guesses across files). A record that does not shrink by at least 1/8 goes as
+// it is and the next ones skip compression (already compressed data). The
+// level goes up while the sender waits on the socket more than on deflate,
+// and down in the opposite case, as long as compressed records cost less per
+// byte of file than records sent as they are. When that is not known, or not
+// true, compression pauses for a while, which times the link again.
+class RecordCompressor
+{
+private:
+    z_stream _deflater;
+    z_stream _inflater;
+    bool _deflaterUsed;
+    int _level;
+
+    unsigned int _skip;    // data that did not compress, per transfer
+    unsigned int _backoff;
+    unsigned int _idle;    // compression paused to time the link, for the session
+    unsigned int _idleBackoff;
+    bool _lastDeflated;
+    size_t _lastLength;
+
+    // compressed records since the last adjustment
+    uint64_t _compressNs;
+    uint64_t _sendNs;
+    uint64_t _tuneInput;
+    unsigned int _tuneRecords;
+    // moving averages over the last adjustments, ns per 64 KB of file:
+    // the socket buffer makes single ones bursty
+    uint64_t _compressCost;
+    uint64_t _sendCost;
+    // records sent as they are, whatever the reason
+    uint64_t _rawNs;
+    uint64_t _rawInput;
+    uint64_t _rawCost; // 0: not known
+    unsigned int _rawAge;
+
+    uint64_t _inputBytes;
+    uint64_t _outputBytes;
+
+    static uint64_t cpuTime();
+    void tune();
+
+public:
+    RecordCompressor(int level);
+    ~RecordCompressor();
+
+    // record (flag byte included) for length <= maxLength bytes of data into out, of maxLength + 1 bytes
+    size_t compress(const unsigned char *data, size_t length, size_t maxLength, unsigned char *out);
+    // bytes carried by the record in into dest, -1 if not valid or more than capacity
+    int decompress(const unsigned char *in, size_t length, unsigned char *dest, size_t capacity);
+    // time the last record took to be handed to the socket
+    void sent(uint64_t ns);
+
+    int getLevel();
+    // both streams start over, at the start and at the end of each transfer
+    void beginTransfer();
+    // bytes given to compress() and bytes of the records it made since the
+    // previous transfer; the next one is sampled again from its first record
+    void endTransfer(uint64_t &input, uint64_t &output);
+};
+
+#endif
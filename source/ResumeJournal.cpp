@@ -0,0 +1,138 @@
+#include "ResumeJournal.h"
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static mutex lockedMutex;
+static set<string> lockedJournals;
+
+ResumeJournal::ResumeJournal(const char *destination)
+{
+    string path = destination;
+    string directory;
+    string name = path;
+    size_t slash = path.rfind('/');
+    if (slash != string::npos)
+    {
+        directory = path.substr(0, slash + 1);
+        name = path.substr(slash + 1);
+    }
+
+    _partialName = directory + "." + name + ".partial";
+    _journalName = directory + "." + name + ".resume";
+}
+
+string ResumeJournal::getPartialName()
+{
+    return _partialName;
+}
+
+bool ResumeJournal::lock()
+{
+    lock_guard<mutex> lock(lockedMutex);
+    return lockedJournals.insert(_journalName).second;
+}
+
+void ResumeJournal::unlock()
+{
+    lock_guard<mutex> lock(lockedMutex);
+    lockedJournals.erase(_journalName);
+}
+
+bool ResumeJournal::load(ResumePoint &point)
+{
+    ifstream is(_journalName.c_str());
+    if (!is.is_open())
+        return false;
+
+    if (!(is >> point.fileSize >> point.fingerprint >> point.verified))
+        return false;
+    is.close();
+
+    // the partial file must still be there, as long as announced
+    struct stat partialStat;
+    if (stat(_partialName.c_str(), &partialStat) != 0 || (uint64_t)partialStat.st_size != point.fileSize)
+        return false;
+
+    return point.fingerprint != 0 && point.verified > 0 && point.verified <= point.fileSize;
+}
+
+void ResumeJournal::save(const ResumePoint &point)
+{
+    // the bytes are not synced first: a journal ahead of the disk is caught
+    // by the whole-file digest that ends every resumed transfer
+    string tmpName = _journalName + ".tmp";
+    ofstream os(tmpName.c_str(), ios::trunc);
+    if (!os.is_open())
+        return;
+
+    os << point.fileSize << " " << point.fingerprint << " " << point.verified << "\n";
+    os.close();
+    if (!os.fail())
+        rename(tmpName.c_str(), _journalName.c_str());
+    else
+        unlink(tmpName.c_str());
+}
+
+void ResumeJournal::discard()
+{
+    unlink(_journalName.c_str());
+    unlink(_partialName.c_str());
+}
+
+int ResumeJournal::expire(const char *directory, long maxAge)
+{
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+        return 0;
+
+    // destinations with a partial file or a journal (".name.partial", ".name.resume")
+    set<string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        string entryName = entry->d_name;
+        const char *suffixes[] = {".partial", ".resume"};
+        for (size_t i = 0; i < 2; i++)
+        {
+            size_t suffixLen = strlen(suffixes[i]);
+            if (entryName.size() > suffixLen + 1 && entryName[0] == '.' &&
+                entryName.compare(entryName.size() - suffixLen, suffixLen, suffixes[i]) == 0)
+                names.insert(entryName.substr(1, entryName.size() - suffixLen - 1));
+        }
+    }
+    closedir(dir);
+
+    int expired = 0;
+    time_t now = time(NULL);
+    for (set<string>::iterator it = names.begin(); it != names.end(); ++it)
+    {
+        ResumeJournal journal((string(directory) + "/" + *it).c_str());
+        if (!journal.lock())
+            continue;
+
+        // the newer of the two decides, a missing one does not keep the other
+        struct stat fileStat;
+        time_t written = 0;
+        if (stat(journal._journalName.c_str(), &fileStat) == 0 && fileStat.st_mtime > written)
+            written = fileStat.st_mtime;
+        if (stat(journal._partialName.c_str(), &fileStat) == 0 && fileStat.st_mtime > written)
+            written = fileStat.st_mtime;
+
+        if (now - written > maxAge)
+        {
+            journal.discard();
+            expired += 1;
+        }
+        journal.unlock();
+    }
+    return expired;
+}
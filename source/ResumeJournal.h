@@ -0,0 +1,49 @@
+#ifndef RESUME_JOURNAL
+#define RESUME_JOURNAL
+
+#include <string>
+#include <stdint.h>
+
+#define RESUME_MIN_BYTES 1048576 //interrupted transfers with fewer verified bytes just start over
+
+// where a transfer stopped: the receiver holds the bytes [0, verified) of a
+// source file of fileSize bytes, identified by its fingerprint
+struct ResumePoint
+{
+    uint64_t fileSize;
+    uint64_t fingerprint;
+    uint64_t verified;
+};
+
+// Partial file of an interrupted transfer and its journal, both hidden next
+// to the destination (.name.partial and .name.resume). The journal is one
+// text line "fileSize fingerprint verified", replaced atomically. Within a
+// process one transfer at a time owns the journal of a destination (lock());
+// the others neither resume nor keep anything.
+class ResumeJournal
+{
+private:
+    std::string _partialName;
+    std::string _journalName;
+
+public:
+    ResumeJournal(const char *destination);
+
+    std::string getPartialName();
+
+    // false if another transfer owns the journal
+    bool lock();
+    void unlock();
+
+    // false if there is nothing to resume
+    bool load(ResumePoint &point);
+    void save(const ResumePoint &point);
+    // removes the partial file and the journal
+    void discard();
+
+    // discards the unlocked journals of directory, with their partial files,
+    // not written for maxAge seconds; returns how many
+    static int expire(const char *directory, long maxAge);
+};
+
+#endif
@@ -1,10 +1,21 @@
 #include "SecureConnection.h"
 #include "Printer.h"
 #include "socket_lib.h"
+#include "KernelTLS.h"
+#include "MappedFile.h"
+#include "AsyncFileWriter.h"
+#include "Metrics.h"
+#include "CookieValidator.h"
 #include <string>
 #include <sstream>
+#include <iostream>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <time.h>
 
 
 using namespace std;
@@ -15,71 +26,230 @@ SecureConnection::SecureConnection(IClientServerTCP *csTCP)
 
     _sMsgCreator = new SecureMessageCreator();
 
-    string* names;
-    int numberOfNames = readNamesFromFile("certificateSettings/names.txt", names);
+    _certVal = new CertificationValidator("certificateSettings/names.txt", "certificateSettings/CA_CybersecurityUniPi.pem");
+    _ownCertVal = true;
+
+    // the flag byte of a compressed session's records included
+    _recordBuffer = new unsigned char[BUFF_SIZE + 1 + _sMsgCreator->getRecordOverhead()];
+    _allowedCapabilities = CAP_KERNEL_TLS;
+    _capabilities = 0;
+    _kernelTls = false;
+    _integrityOnlyPeers = NULL;
+
+    _cachePolicy.readAheadWindow = READ_AHEAD_WINDOW;
+    _cachePolicy.dropBehindThreshold = DROP_BEHIND_THRESHOLD;
+    _cachePolicy.prefetchChunks = PREFETCH_CHUNKS;
+    _durability = NULL;
+
+    _compressionLevel = COMPRESSION_LEVEL;
+    _compressor = NULL;
+    _compressBuffer = new unsigned char[BUFF_SIZE + 1];
+
+    _commands = new CommandSequence();
+    _commands->next = 1;
+    _commands->highest = 0;
+    _commands->window = 0;
+    _ownCommands = true;
+}
 
-    _certVal = new CertificationValidator(names,numberOfNames);
+SecureConnection::SecureConnection(IClientServerTCP *csTCP, CertificationValidator *certVal)
+{
+    _csTCP = csTCP;
 
-    X509* caCert = _certVal->loadCertificateFromFile("certificateSettings/CA_CybersecurityUniPi.pem");
-    if(caCert == NULL){
-        Printer::printWaring("not possible load CA certificate from file, all certificate cloud not be verify properly");
-    }else{
-        _certVal->addCertificationAut(caCert);
-    }
+    _sMsgCreator = new SecureMessageCreator();
+
+    // shared between the sessions of a server, so its verification cache is too
+    _certVal = certVal;
+    _ownCertVal = false;
+
+    // the flag byte of a compressed session's records included
+    _recordBuffer = new unsigned char[BUFF_SIZE + 1 + _sMsgCreator->getRecordOverhead()];
+    _allowedCapabilities = CAP_KERNEL_TLS;
+    _capabilities = 0;
+    _kernelTls = false;
+    _integrityOnlyPeers = NULL;
+
+    _cachePolicy.readAheadWindow = READ_AHEAD_WINDOW;
+    _cachePolicy.dropBehindThreshold = DROP_BEHIND_THRESHOLD;
+    _cachePolicy.prefetchChunks = PREFETCH_CHUNKS;
+    _durability = NULL;
+
+    _compressionLevel = COMPRESSION_LEVEL;
+    _compressor = NULL;
+    _compressBuffer = new unsigned char[BUFF_SIZE + 1];
+
+    _commands = new CommandSequence();
+    _commands->next = 1;
+    _commands->highest = 0;
+    _commands->window = 0;
+    _ownCommands = true;
+}
+
+SecureConnection::~SecureConnection()
+{
+    destroyKeys();
+    delete _sMsgCreator;
+    delete[] _recordBuffer;
+    delete[] _compressBuffer;
+    if (_ownCommands)
+        delete _commands;
+
+    if (_ownCertVal)
+        delete _certVal;
 }
+
 unsigned long SecureConnection::generateNonce()
 {
     return _sMsgCreator->getNonce();
 }
 
 void SecureConnection::destroyKeys(){
+    // only what the handshake negotiated: the cache policy given by
+    // setCachePolicy() outlives the keys
     _sMsgCreator->destroyKeysIfSetted();
+    _capabilities = 0;
+    _kernelTls = false;
+    delete _compressor;
+    _compressor = NULL;
 }
 
-int SecureConnection::readNamesFromFile(const char* filename, string* &names){
-	ifstream is;
-	is.open(filename);
-    
-    if(!is.is_open()){
-        throw FileNotOpenException();
-    }
-    
-    int numberOfNames = 0;
+void SecureConnection::setAllowedCapabilities(uint32_t capabilities)
+{
+    _allowedCapabilities = capabilities;
+}
 
-    is.seekg(0, ios::end);
-    int fileSize = is.tellg();
-    if (fileSize == 0)
-    {
-        names = new string[1];
-        names[0] = "";
-        numberOfNames = 1;
+uint32_t SecureConnection::getCapabilities()
+{
+    return _capabilities;
+}
 
-        return -1;
-    }
+void SecureConnection::setIntegrityOnlyPeers(const std::set<std::string> *peers)
+{
+    _integrityOnlyPeers = peers;
+}
+
+void SecureConnection::setCachePolicy(const CachePolicy &policy)
+{
+    _cachePolicy = policy;
+}
+
+void SecureConnection::setDurability(Durability *durability)
+{
+    _durability = durability;
+}
+
+void SecureConnection::setCompressionLevel(int level)
+{
+    _compressionLevel = level;
+}
+
+void SecureConnection::setCryptoRunner(function<void(function<void()>)> runner)
+{
+    _cryptoRunner = runner;
+}
+
+void SecureConnection::runCrypto(function<void()> task)
+{
+    if (_cryptoRunner)
+        _cryptoRunner(task);
+    else
+        task();
+}
+
+uint32_t SecureConnection::offerCapabilities()
+{
+    uint32_t offer = _allowedCapabilities;
+
+    // asking for plain records is asking not to encrypt at all
+    if (offer & CAP_INTEGRITY_ONLY)
+        offer &= ~CAP_KERNEL_TLS;
 
-    is.seekg(0, ios::beg);
+    // offered only if this kernel can take over the record layer
+    if ((offer & CAP_KERNEL_TLS) && !kernelTlsAttach(_csTCP->getSocket()))
+        offer &= ~CAP_KERNEL_TLS;
+
+    return offer;
+}
 
-    string grb;
+uint32_t SecureConnection::acceptCapabilities(uint32_t offered)
+{
+    uint32_t accepted = offered & _allowedCapabilities;
+
+    if ((accepted & CAP_INTEGRITY_ONLY) && _integrityOnlyPeers != NULL && _integrityOnlyPeers->count(_peerName) == 0)
+        accepted &= ~CAP_INTEGRITY_ONLY;
+    if (accepted & CAP_INTEGRITY_ONLY)
+        accepted &= ~CAP_KERNEL_TLS;
+    // kernel TLS sends the pages as they are, and the records outside the streams
+    if (accepted & (CAP_COMPRESSION | CAP_MULTIPLEX))
+        accepted &= ~CAP_KERNEL_TLS;
+
+    // RX is installed before answering: the client sends nothing until it reads the answer
+    if ((accepted & CAP_KERNEL_TLS) &&
+        !(kernelTlsAttach(_csTCP->getSocket()) &&
+          kernelTlsInstall(_csTCP->getSocket(), false, _sMsgCreator->getKernelTlsMaterial(true))))
+        accepted &= ~CAP_KERNEL_TLS;
+
+    return accepted;
+}
 
-    while(!is.eof())
+void SecureConnection::activateCapabilities(bool isServer)
+{
+    if (_capabilities & CAP_KERNEL_TLS)
     {
-	    getline(is, grb);
-        numberOfNames += 1;
-    }
+        int socket = _csTCP->getSocket();
+        bool installed = kernelTlsInstall(socket, true, _sMsgCreator->getKernelTlsMaterial(!isServer));
+        if (installed && !isServer)
+            installed = kernelTlsInstall(socket, false, _sMsgCreator->getKernelTlsMaterial(false));
 
-    names = new string[numberOfNames];
+        if (!installed)
+            throw KernelTlsException();
 
-    is.seekg(0, ios::beg);
+        _kernelTls = true;
+        Printer::printInfo("Record protection offloaded to kernel TLS");
+    }
+
+    if (_capabilities & CAP_INTEGRITY_ONLY)
+    {
+        _sMsgCreator->setIntegrityOnly(true);
+        Printer::printWaring("Records are authenticated but NOT encrypted");
+    }
 
-    int i = 0;
-    while(!is.eof())
+    if (_capabilities & CAP_COMPRESSION)
     {
-	    getline(is,names[i++]);
+        _compressor = new RecordCompressor(_compressionLevel);
+        Printer::printInfo("File bodies are compressed");
     }
 
-	is.close();
+    if (_capabilities & CAP_MULTIPLEX)
+        Printer::printInfo("Commands can run side by side");
+}
+
+SecureConnection *SecureConnection::openStream(IClientServerTCP *stream)
+{
+    SecureConnection *connection = new SecureConnection(stream, _certVal);
+    connection->_sMsgCreator->copyKeys(_sMsgCreator);
+    connection->_allowedCapabilities = _allowedCapabilities;
+    connection->_capabilities = _capabilities;
+    connection->_peerName = _peerName;
+    connection->_cachePolicy = _cachePolicy;
+    connection->_durability = _durability;
+    connection->_compressionLevel = _compressionLevel;
+    delete connection->_commands;
+    connection->_commands = _commands;
+    connection->_ownCommands = false;
+
+    // each stream is an ordered flow of its own: so are its deflate streams
+    if (_capabilities & CAP_COMPRESSION)
+        connection->_compressor = new RecordCompressor(_compressionLevel);
+
+    return connection;
+}
 
-    return numberOfNames;
+SecureMessageCreator *SecureConnection::copyRecordKeys()
+{
+    SecureMessageCreator *creator = new SecureMessageCreator();
+    creator->copyKeys(_sMsgCreator);
+    return creator;
 }
 
 int SecureConnection::sendCertificate(X509* cert)
@@ -119,6 +289,13 @@ int SecureConnection::rcvCertificate(X509* &cert)
 
 void SecureConnection::sendSecureMsg(void *buffer, size_t bufferSize, bool useNonce, unsigned long nonce)
 {
+    if (_kernelTls)
+    {
+        // the kernel seals the record, its sequence number gives the freshness
+        _csTCP->sendMsg(buffer, bufferSize);
+        return;
+    }
+
     unsigned char *secureMessage;
     _sMsgCreator->initEncryptContext(NULL);
     size_t msgSize = _sMsgCreator->EncryptAndSignMessageFinal((unsigned char *)buffer, bufferSize, &secureMessage, useNonce, nonce);
@@ -129,6 +306,12 @@ void SecureConnection::sendSecureMsg(void *buffer, size_t bufferSize, bool useNo
 int SecureConnection::recvSecureMsg(void **plainText, bool useNonce, unsigned long nonce)
 {
     int numberOfBytes;
+
+    if (_kernelTls)
+    {
+        return _csTCP->recvMsg(plainText);
+    }
+
     unsigned char *encryptedText;
     numberOfBytes = _csTCP->recvMsg((void **)&encryptedText);
 
@@ -147,6 +330,103 @@ int SecureConnection::recvSecureMsg(void **plainText, bool useNonce, unsigned lo
     return plainTextSize;
 }
 
+uint64_t SecureConnection::nextCommandSequence()
+{
+    lock_guard<mutex> lock(_commands->mutex);
+    return _commands->next++;
+}
+
+void SecureConnection::acceptCommandSequence(uint64_t sequence)
+{
+    if (sequence == 0 || sequence >= (1ULL << (64 - COMMAND_NONCE_SHIFT)))
+        throw CommandNotValidException();
+
+    // each number once: the streams of a session may deliver them out of order
+    lock_guard<mutex> lock(_commands->mutex);
+    if (sequence > _commands->highest)
+    {
+        uint64_t shift = sequence - _commands->highest;
+        _commands->window = shift < 64 ? (_commands->window << shift) | 1 : 1;
+        _commands->highest = sequence;
+    }
+    else
+    {
+        uint64_t age = _commands->highest - sequence;
+        if (age >= COMMAND_WINDOW || (_commands->window & (1ULL << age)))
+            throw CommandNotValidException();
+        _commands->window |= 1ULL << age;
+    }
+}
+
+unsigned long SecureConnection::sendCommand(const string &command, const string &argument)
+{
+    uint64_t sequence = nextCommandSequence();
+
+    if (_capabilities & CAP_BINARY_COMMANDS)
+    {
+        CommandMessage message;
+        message.code = commandCode(command.c_str());
+        message.sequence = sequence;
+        message.argument = (const unsigned char *)argument.data();
+        message.argumentLength = argument.size() > COMMAND_MAX_ARGUMENT ? COMMAND_MAX_ARGUMENT + 1 : argument.size();
+
+        unsigned char msg[COMMAND_HEADER_SIZE + COMMAND_MAX_ARGUMENT];
+        size_t msgSize = encodeCommand(message, msg);
+        if (message.code == 0 || msgSize == 0)
+            throw CommandNotValidException();
+        sendSecureMsg(msg, msgSize, false, 0);
+        return sequence << COMMAND_NONCE_SHIFT;
+    }
+
+    stringstream ss;
+    ss << command << " " << sequence;
+    string msg = ss.str();
+    msg.append(1, '\0');
+    msg.append(argument);
+    sendSecureMsg((void *)msg.c_str(), msg.length() + 1, false, 0);
+
+    return sequence << COMMAND_NONCE_SHIFT;
+}
+
+unsigned long SecureConnection::recvCommand(string &command, string &argument)
+{
+    char *msg;
+    int lenght = recvSecureMsg((void **)&msg, false, 0);
+    uint64_t sequence = 0;
+
+    if (_capabilities & CAP_BINARY_COMMANDS)
+    {
+        CommandMessage message;
+        bool valid = decodeCommand((const unsigned char *)msg, lenght, message);
+        if (valid)
+        {
+            command = commandName(message.code);
+            argument.assign((const char *)message.argument, message.argumentLength);
+            sequence = message.sequence;
+        }
+        delete msg;
+        if (!valid)
+            throw CommandNotValidException();
+    }
+    else
+    {
+        // both parts NUL terminated
+        const char *end = (const char *)memchr(msg, '\0', lenght);
+        if (end == NULL || msg[lenght - 1] != '\0')
+        {
+            delete msg;
+            throw CommandNotValidException();
+        }
+        stringstream ss(msg);
+        argument = string(end + 1);
+        delete msg;
+        ss >> command >> sequence;
+    }
+
+    acceptCommandSequence(sequence);
+    return sequence << COMMAND_NONCE_SHIFT;
+}
+
 int SecureConnection::concatenate(unsigned char* src1, uint32_t len1, unsigned char* src2, uint32_t len2, unsigned char* &dest)
 {
     int destSize = len1 + len2 + 2*sizeof(uint32_t);
@@ -170,6 +450,31 @@ int SecureConnection::concatenate(unsigned char* src1, uint32_t len1, unsigned c
     return currentPos;
 }
 
+bool SecureConnection::split(unsigned char* src, int srcLen, unsigned char* &dest1, uint32_t &len1, unsigned char* &dest2, uint32_t &len2)
+{
+    // inverse of concatenate(), pointing inside src
+    int currentPos = 0;
+
+    if (srcLen < (int)(2 * sizeof(uint32_t)))
+        return false;
+    memcpy(&len1, src, sizeof(uint32_t));
+    currentPos += sizeof(uint32_t);
+
+    if (len1 > srcLen - currentPos - sizeof(uint32_t))
+        return false;
+    dest1 = src + currentPos;
+    currentPos += len1;
+
+    memcpy(&len2, src + currentPos, sizeof(uint32_t));
+    currentPos += sizeof(uint32_t);
+
+    if (len2 != (uint32_t)(srcLen - currentPos))
+        return false;
+    dest2 = src + currentPos;
+
+    return true;
+}
+
 void SecureConnection::computeSharedKeys(DH *dh_session, BIGNUM *bn)
 {   
     unsigned char*  sharedkey = new unsigned char[sizeof(unsigned char) *DH_size(dh_session)];
@@ -177,6 +482,11 @@ void SecureConnection::computeSharedKeys(DH *dh_session, BIGNUM *bn)
     int sharedkey_size = DH_compute_key(sharedkey, bn, dh_session);
 
     _sMsgCreator->derivateKeys(sharedkey,sharedkey_size);
+
+    // new keys: the numbers used with the old ones can be used again
+    _commands->next = 1;
+    _commands->highest = 0;
+    _commands->window = 0;
     
     //cleaning sharedkey
     explicit_bzero(sharedkey, sharedkey_size);
@@ -187,7 +497,7 @@ void SecureConnection::sendAutenticationAndFreshness(unsigned char* expectedMsg,
     unsigned char *signature;
     int signatureLen;
 
-    signatureLen = _sMsgCreator->sign(expectedMsg, msgLen, privKey, signature);
+    runCrypto([&] { signatureLen = _sMsgCreator->sign(expectedMsg, msgLen, privKey, signature); });
     sendSecureMsg(signature, signatureLen, false, 0);
 
     int ret = sendCertificate(cert);
@@ -207,16 +517,23 @@ bool SecureConnection::recvAutenticationAndVerify(unsigned char* expectedMsg, in
 
     certSize = rcvCertificate(cert);
 
-    string mess = "Recived certificate: "+_certVal->getCertName(cert);
+    _peerName = _certVal->getCertName(cert);
+    string mess = "Recived certificate: "+_peerName;
     Printer::printInfo(mess.c_str());
-    bool validCertificate = _certVal->verifyCertificate(cert);
+    bool validCertificate;
+    bool signResult = false;
+    runCrypto([&] {
+        validCertificate = _certVal->verifyCertificate(cert);
+        if (validCertificate)
+        {
+            EVP_PKEY* pubKey = _certVal->extractPubKeyFromCertificate(cert);
+            signResult = _sMsgCreator->verify(expectedMsg, expectedMsgLen, signature, signatureLen, pubKey);
+        }
+    });
     if(!validCertificate){
         throw CertificateNotValidException();
     }
 
-    EVP_PKEY* pubKey = _certVal->extractPubKeyFromCertificate(cert);
-
-    bool  signResult = _sMsgCreator->verify(expectedMsg, expectedMsgLen, signature, signatureLen, pubKey);
     //bool signResult = false;
     
     delete signature;
@@ -224,24 +541,49 @@ bool SecureConnection::recvAutenticationAndVerify(unsigned char* expectedMsg, in
     return signResult;
 }
 
+bool SecureConnection::helloCookie(const unsigned char* hello, int helloLen, const unsigned char* &cookie)
+{
+    if (helloLen <= 1 + COOKIE_SIZE || hello[0] != HANDSHAKE_COOKIE)
+        return false;
+    cookie = hello + 1;
+    return true;
+}
+
 void SecureConnection::establishConnectionServer()
 {
-    DH *dh_session; //alloco la struttura 
-    dh_session = _sMsgCreator->get_dh2048();
-    
-    DH_generate_key(dh_session);
+    unsigned char* hello;
+    int helloLen;
 
-    unsigned char* Yc;
-    int YcLen;
+    helloLen = _csTCP->recvMsg((void**)&hello);
+
+    int YcOffset = 1;
+    const unsigned char* cookie;
+    if (helloCookie(hello, helloLen, cookie))
+        YcOffset += COOKIE_SIZE;
+    else if (helloLen <= 1 || hello[0] != HANDSHAKE_HELLO)
+    {
+        delete hello;
+        throw HandshakeMessageException();
+    }
 
-    YcLen = _csTCP->recvMsg((void**)&Yc);
+    int YcLen = helloLen - YcOffset;
+    unsigned char* Yc = new unsigned char[YcLen];
+    memcpy(Yc, hello + YcOffset, YcLen);
+    delete hello;
 
-    BIGNUM *bnYc;
-    bnYc = BN_bin2bn(Yc, YcLen, NULL);
+    DH *dh_session; //alloco la struttura 
+    runCrypto([&] {
+        dh_session = _sMsgCreator->get_dh2048();
+
+        DH_generate_key(dh_session);
 
-    computeSharedKeys(dh_session, bnYc);
+        BIGNUM *bnYc;
+        bnYc = BN_bin2bn(Yc, YcLen, NULL);
 
-    BN_free(bnYc);
+        computeSharedKeys(dh_session, bnYc);
+
+        BN_free(bnYc);
+    });
 
     BIGNUM *bnYs = (BIGNUM *) DH_get0_pub_key(dh_session);
     
@@ -250,7 +592,11 @@ void SecureConnection::establishConnectionServer()
     
     YsLen = BN_bn2bin(bnYs, Ys); 
 
-    _csTCP->sendMsg(Ys, YsLen);
+    unsigned char* keyMsg = new unsigned char[YsLen + 1];
+    keyMsg[0] = HANDSHAKE_KEY;
+    memcpy(keyMsg + 1, Ys, YsLen);
+    _csTCP->sendMsg(keyMsg, YsLen + 1);
+    delete keyMsg;
     
     unsigned char* msg;
     int msgLen;
@@ -260,8 +606,12 @@ void SecureConnection::establishConnectionServer()
     delete Yc;
     delete Ys;
     
-    X509* cert = _certVal->loadCertificateFromFile("certificateSettings/my_certificate.pem");
-    EVP_PKEY* privKey = _sMsgCreator->ExtractPrivateKey("certificateSettings/rsa_privkey.pem");
+    X509* cert;
+    EVP_PKEY* privKey;
+    runCrypto([&] {
+        cert = _certVal->loadCertificateFromFile("certificateSettings/my_certificate.pem");
+        privKey = _sMsgCreator->ExtractPrivateKey("certificateSettings/rsa_privkey.pem");
+    });
     sendAutenticationAndFreshness(msg,msgLen,privKey,cert);
     EVP_PKEY_free(privKey);
 
@@ -277,7 +627,22 @@ void SecureConnection::establishConnectionServer()
         throw InvalidDigitalSignException();
     }
 
-    sendSecureMsg((void*)"ok",3, false, 0); // for Atu verification
+    // for Atu verification, carrying the session features accepted
+    unsigned char* offer;
+    int offerLen = recvSecureMsg((void**) &offer, true, CAPABILITY_OFFER_NONCE);
+    uint32_t offered = 0;
+    if (offerLen == sizeof(uint32_t))
+    {
+        memcpy(&offered, offer, sizeof(uint32_t));
+        offered = ntohl(offered);
+    }
+    delete offer;
+
+    _capabilities = acceptCapabilities(offered);
+    uint32_t standardCapabilities = htonl(_capabilities);
+    sendSecureMsg(&standardCapabilities, sizeof(uint32_t), true, CAPABILITY_ANSWER_NONCE);
+
+    activateCapabilities(true);
 } 
 
 void SecureConnection::establishConnectionClient()
@@ -296,12 +661,48 @@ void SecureConnection::establishConnectionClient()
 
     //BN_free(bnYc); se lasciata DH_free() da errore di segmentazione
 
-    _csTCP->sendMsg((void*) Yc,YcLen);
+    // a cookie is good for one try: an expired one just gets a new one
+    string hello = string(1, _cookie.empty() ? HANDSHAKE_HELLO : HANDSHAKE_COOKIE) + _cookie + string((char*)Yc, YcLen);
+    _cookie.clear();
+    _csTCP->sendMsg((void*)hello.data(), hello.size());
 
-    unsigned char* Ys;
-    int YsLen;
+    unsigned char* reply;
+    int replyLen;
+
+    replyLen = _csTCP->recvMsg((void**)&reply);
+
+    if (replyLen == 1 + COOKIE_SIZE && reply[0] == HANDSHAKE_COOKIE)
+    {
+        // server under load: it kept nothing of this connection, the next one proves we are reachable
+        _cookie = string((char*)reply + 1, COOKIE_SIZE);
+        delete reply;
+        delete Yc;
+        DH_free(dh_session);
+        throw CookieRequiredException();
+    }
+
+    if (replyLen == 1 + (int)sizeof(uint32_t) && reply[0] == HANDSHAKE_BUSY)
+    {
+        uint32_t standardRetry;
+        memcpy(&standardRetry, reply + 1, sizeof(uint32_t));
+        delete reply;
+        delete Yc;
+        DH_free(dh_session);
+        throw ServerBusyException(ntohl(standardRetry));
+    }
+
+    if (replyLen <= 1 || reply[0] != HANDSHAKE_KEY)
+    {
+        delete reply;
+        delete Yc;
+        DH_free(dh_session);
+        throw HandshakeMessageException();
+    }
 
-    YsLen = _csTCP->recvMsg((void**)&Ys); 
+    int YsLen = replyLen - 1;
+    unsigned char* Ys = new unsigned char[YsLen];
+    memcpy(Ys, reply + 1, YsLen);
+    delete reply;
 
     BIGNUM *bnYs;
     bnYs = BN_bin2bn(Ys, YsLen, NULL);
@@ -338,161 +739,1767 @@ void SecureConnection::establishConnectionClient()
     
     DH_free(dh_session);
 
-    // for Atu verification //////////////////////////////////////////
+    // sent right after the certificate, no extra round trip
+    uint32_t offered = offerCapabilities();
+    uint32_t standardCapabilities = htonl(offered);
+    sendSecureMsg(&standardCapabilities, sizeof(uint32_t), true, CAPABILITY_OFFER_NONCE);
+
+    // for Atu verification, carrying the session features accepted //
     unsigned char* checkConnectionEnstablished;
-    int checkSize = recvSecureMsg((void**) &checkConnectionEnstablished, false, 0);
+    int checkSize = recvSecureMsg((void**) &checkConnectionEnstablished, true, CAPABILITY_ANSWER_NONCE);
+    if (checkSize != sizeof(uint32_t))
+    {
+        delete checkConnectionEnstablished;
+        throw HandshakeMessageException();
+    }
+    memcpy(&standardCapabilities, checkConnectionEnstablished, sizeof(uint32_t));
     delete checkConnectionEnstablished;
     //////////////////////////////////////////////////////////////////
+
+    // the server picks among what was offered, nothing else
+    _capabilities = ntohl(standardCapabilities);
+    if (_capabilities & ~offered)
+        throw HandshakeMessageException();
+    activateCapabilities(false);
 } 
 
-int SecureConnection::sendFile(ifstream &file, bool stars, unsigned long nonce)
+void SecureConnection::sendFileHeader(char type, uint64_t size, uint64_t fingerprint, uint64_t start, unsigned long nonce)
+{
+    // a header starts a transfer on both sides
+    beginTransfer();
+
+    unsigned char header[FILE_HEADER_SIZE];
+    uint64_t fields[3];
+    fields[0] = htobe64(size);
+    fields[1] = htobe64(fingerprint);
+    fields[2] = htobe64(start);
+
+    header[0] = type;
+    memcpy(header + 1, fields, sizeof(fields));
+    sendSecureMsg(header, FILE_HEADER_SIZE, true, nonce);
+}
+
+uint64_t SecureConnection::recvFileHeader(unsigned long nonce, char &type, uint64_t &fingerprint, uint64_t &start)
 {
-    if (!file.is_open())
+    beginTransfer();
+
+    unsigned char *header;
+    int lenght = recvSecureMsg((void **)&header, true, nonce);
+
+    if (lenght != FILE_HEADER_SIZE || (header[0] != FILE_HEADER_FOUND && header[0] != FILE_HEADER_SPARSE && header[0] != FILE_HEADER_RANGES &&
+                                       header[0] != FILE_HEADER_NOT_FOUND && header[0] != FILE_HEADER_NOT_MODIFIED))
     {
-        throw FileNotOpenException();
+        delete header;
+        throw FileHeaderException();
     }
 
-    // obtain and send file size
-    file.seekg(0, ios::end);
-    long fileSize = file.tellg();
-    if (fileSize == 0)
+    type = header[0];
+    uint64_t fields[3];
+    memcpy(fields, header + 1, sizeof(fields));
+    delete header;
+
+    if (type == FILE_HEADER_NOT_FOUND)
     {
-        Printer::printInfo("Attempt to send and empy file");
+        throw FileDoesNotExistsException();
     }
-    string strFileSize = to_string(fileSize);
-
-    if(fileSize > MAX_FILE_SIZE)
+    if (type == FILE_HEADER_NOT_MODIFIED)
     {
-    	sendSecureMsg((void *)"-2", 3, true, nonce);
-        throw FileSizeException();
+        throw FileNotModifiedException();
     }
+    fingerprint = be64toh(fields[1]);
+    start = be64toh(fields[2]);
 
-    sendSecureMsg((void *)strFileSize.c_str(), strFileSize.length(), true, nonce);
+    uint64_t size = be64toh(fields[0]);
+    if (start > size)
+    {
+        throw FileHeaderException();
+    }
+    return size;
+}
 
-    size_t fileSended = 0;
+void SecureConnection::sendResumePoint(const ResumePoint &point, unsigned long nonce)
+{
+    uint64_t fields[3];
+    fields[0] = htobe64(point.fileSize);
+    fields[1] = htobe64(point.fingerprint);
+    fields[2] = htobe64(point.verified);
+    sendSecureMsg(fields, sizeof(fields), true, nonce);
+}
 
-    if (fileSize == 0)
+void SecureConnection::recvResumePoint(ResumePoint &point, unsigned long nonce)
+{
+    unsigned char *buffer;
+    int lenght = recvSecureMsg((void **)&buffer, true, nonce);
+    if (lenght != 3 * sizeof(uint64_t))
     {
-        return fileSended;
+        delete buffer;
+        throw FileHeaderException();
     }
 
-    file.seekg(0, ios::beg);
-    char buffer[BUFF_SIZE];
+    uint64_t fields[3];
+    memcpy(fields, buffer, sizeof(fields));
+    delete buffer;
 
-    string mess = "fileSize = " + strFileSize;
-    Printer::printInfo(mess.c_str());
+    point.fileSize = be64toh(fields[0]);
+    point.fingerprint = be64toh(fields[1]);
+    point.verified = be64toh(fields[2]);
+}
+
+void SecureConnection::digestFile(MappedFile *file, unsigned char *digest)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
 
-    nonce += 1; 
-    while (!file.eof() && fileSended < fileSize)
+    uint64_t fileSize = file->size();
+    for (uint64_t offset = 0; offset < fileSize; offset += WRITER_BUFFER_SIZE)
     {
-        memset(buffer, 0, BUFF_SIZE);
-        file.read(buffer, BUFF_SIZE);
-        size_t readedBytes = file.gcount();
+        size_t length = fileSize - offset < WRITER_BUFFER_SIZE ? fileSize - offset : WRITER_BUFFER_SIZE;
+        EVP_DigestUpdate(ctx, file->map(offset, length), length);
+    }
 
-        sendSecureMsg(buffer, readedBytes, true, nonce);
-        nonce += 1;
+    unsigned int digestLen;
+    EVP_DigestFinal_ex(ctx, digest, &digestLen);
+    EVP_MD_CTX_free(ctx);
+}
 
-        fileSended += readedBytes;
-        if (stars)
-            Printer::printLoadBar(fileSended, fileSize,false);
+void SecureConnection::sendFileNotFound(unsigned long nonce)
+{
+    sendFileHeader(FILE_HEADER_NOT_FOUND, 0, 0, 0, nonce);
+}
+
+void SecureConnection::sendFileNotModified(unsigned long nonce)
+{
+    sendFileHeader(FILE_HEADER_NOT_MODIFIED, 0, 0, 0, nonce);
+}
+
+void SecureConnection::sendContentHash(uint64_t size, const unsigned char *digest, unsigned long nonce)
+{
+    unsigned char msg[sizeof(uint64_t) + CONTENT_HASH_SIZE];
+    uint64_t standardSize = htobe64(size);
+    memcpy(msg, &standardSize, sizeof(uint64_t));
+    memcpy(msg + sizeof(uint64_t), digest, CONTENT_HASH_SIZE);
+    sendSecureMsg(msg, sizeof(msg), true, nonce);
+}
+
+void SecureConnection::recvContentHash(uint64_t &size, unsigned char *digest, unsigned long nonce)
+{
+    unsigned char *msg;
+    int lenght = recvSecureMsg((void **)&msg, true, nonce);
+    if (lenght != sizeof(uint64_t) + CONTENT_HASH_SIZE)
+    {
+        delete msg;
+        throw FileHeaderException();
     }
 
-    return fileSended;
+    memcpy(&size, msg, sizeof(uint64_t));
+    size = be64toh(size);
+    memcpy(digest, msg + sizeof(uint64_t), CONTENT_HASH_SIZE);
+    delete msg;
 }
 
-int SecureConnection::receiveFile(const char *filename, bool stars, unsigned long nonce)
+void SecureConnection::sendContentAnswer(bool same, unsigned long nonce)
 {
-    ofstream writeFile;
+    char answer = same ? CONTENT_SAME : CONTENT_DIFFERENT;
+    sendSecureMsg(&answer, 1, true, nonce);
+}
 
-    char *writer;
-    int lenght;
+bool SecureConnection::recvContentAnswer(unsigned long nonce)
+{
+    char *answer;
+    int lenght = recvSecureMsg((void **)&answer, true, nonce);
+    if (lenght != 1 || (answer[0] != CONTENT_SAME && answer[0] != CONTENT_DIFFERENT))
+    {
+        delete answer;
+        throw FileHeaderException();
+    }
 
-    lenght = recvSecureMsg((void **)&writer, true, nonce);
+    bool same = answer[0] == CONTENT_SAME;
+    delete answer;
+    return same;
+}
 
-    long fileSize;
-    stringstream ss;
-    ss << writer;
-    ss >> fileSize;
+uint64_t SecureConnection::sendFile(const char *filename, bool stars, unsigned long nonce, const ResumePoint *resume)
+{
+    MappedFile *file;
+    try
+    {
+        file = new MappedFile(filename);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw FileNotOpenException();
+    }
 
-    delete writer;
+    uint64_t fileSize;
+    try
+    {
+        fileSize = sendFile(file, stars, nonce, resume);
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+
+    delete file;
+    return fileSize;
+}
+
+uint64_t SecureConnection::sendFile(MappedFile *file, bool stars, unsigned long nonce, const ResumePoint *resume)
+{
+    file->setCachePolicy(_cachePolicy);
 
-    if(fileSize == -1)
+    // obtain and send file size
+    uint64_t fileSize = file->size();
+    if (fileSize == 0)
     {
-        throw FileDoesNotExistsException();
+        Printer::printInfo("Attempt to send and empy file");
     }
 
-    if(fileSize == -2)
+    // the receiver goes on from where it stopped only if this is still the file it was receiving
+    uint64_t fingerprint = file->getFingerprint();
+    uint64_t start = 0;
+    if (resume != NULL && resume->fileSize == fileSize && resume->fingerprint == fingerprint && fingerprint != 0 && resume->verified <= fileSize)
     {
-        throw FileSizeException();
+        start = resume->verified;
     }
 
-    stringstream mess;
-    mess << "fileSize = " << fileSize;
-    Printer::printInfo(mess.str().c_str());
+    try
+    {
+        // a file with holes goes as its data extents only
+        bool sparse = file->isSparse();
+        sendFileHeader(sparse ? FILE_HEADER_SPARSE : FILE_HEADER_FOUND, fileSize, fingerprint, start, nonce);
+        nonce += 1;
 
-    writeFile.open(filename, ios::binary);
-    if (!writeFile.is_open())
+        if (fileSize > 0)
+        {
+            string mess = "fileSize = " + to_string(fileSize);
+            Printer::printInfo(mess.c_str());
+        }
+        if (start > 0)
+        {
+            string mess = "Resuming from byte " + to_string(start);
+            Printer::printInfo(mess.c_str());
+            Metrics::add("resumed_bytes_skipped_total", start);
+        }
+
+        if (!sparse)
+        {
+            sendFileRange(file, start, fileSize - start, stars, nonce);
+        }
+        else
+        {
+            uint64_t position = start;
+            uint64_t extentStart, extentLength;
+            uint64_t dataBytes = 0;
+            while (file->nextDataExtent(position, extentStart, extentLength))
+            {
+                sendExtent(extentStart, extentLength, nonce);
+                nonce += 1;
+                sendFileRange(file, extentStart, extentLength, stars, nonce);
+
+                dataBytes += extentLength;
+                position = extentStart + extentLength;
+            }
+            // end of the extents
+            sendExtent(fileSize, 0, nonce);
+            nonce += 1;
+
+            Metrics::add("sparse_hole_bytes_skipped_total", fileSize - start - dataBytes);
+            if (stars)
+                Printer::printLoadBar(fileSize, fileSize,false);
+        }
+
+        // the receiver checks what it already had together with what it got now
+        if (start > 0)
+        {
+            unsigned char digest[RESUME_DIGEST_SIZE];
+            digestFile(file, digest);
+            sendSecureMsg(digest, RESUME_DIGEST_SIZE, true, nonce);
+            nonce += 1;
+        }
+    }
+    catch (const MappedFileException &mfe)
     {
         throw FileNotOpenException();
     }
 
-    size_t whenPrintCharacter = fileSize / 80;
-    size_t partReaded = 0;
+    endTransfer();
+    return fileSize;
+}
 
-    size_t writedBytes;
-    nonce += 1;
-    
-    for (writedBytes = 0; writedBytes < fileSize; writedBytes += lenght)
+uint64_t SecureConnection::sendFile(const char *contents, uint64_t fileSize, uint64_t fingerprint, bool stars, unsigned long nonce, const ResumePoint *resume)
+{
+    // as sendFile from disk, so a transfer resumes whether or not the file got cached meanwhile
+    uint64_t start = 0;
+    if (resume != NULL && resume->fileSize == fileSize && resume->fingerprint == fingerprint && fingerprint != 0 && resume->verified <= fileSize)
     {
-        lenght = recvSecureMsg((void **)&writer, true, nonce); 
-        nonce += 1;       
+        start = resume->verified;
+    }
 
-        //the following code prints * characters
-        if (stars)
-            Printer::printLoadBar(writedBytes + lenght, fileSize,false);
+    sendFileHeader(FILE_HEADER_FOUND, fileSize, fingerprint, start, nonce);
+    nonce += 1;
 
-        writeFile.write(writer, lenght);
-        delete writer;
+    if (fileSize > 0)
+    {
+        string mess = "fileSize = " + to_string(fileSize);
+        Printer::printInfo(mess.c_str());
+    }
+    if (start > 0)
+    {
+        string mess = "Resuming from byte " + to_string(start);
+        Printer::printInfo(mess.c_str());
+        Metrics::add("resumed_bytes_skipped_total", start);
     }
 
-    writeFile.close();
+    sendMemoryRange(contents, start, fileSize - start, fileSize, stars, nonce);
 
-    return writedBytes;
+    if (start > 0)
+    {
+        unsigned char digest[RESUME_DIGEST_SIZE];
+        EVP_Digest(contents, fileSize, digest, NULL, EVP_sha256(), NULL);
+        sendSecureMsg(digest, RESUME_DIGEST_SIZE, true, nonce);
+        nonce += 1;
+    }
+
+    endTransfer();
+    return fileSize;
 }
 
-int SecureConnection::reciveAndPrintBigMessage(unsigned long nonce)
+void SecureConnection::sendFileRange(MappedFile *file, uint64_t offset, uint64_t length, bool stars, unsigned long &nonce)
 {
-    char *writer;
-    char *ack;
-    int lenght;
-    
-    lenght = recvSecureMsg((void **)&writer, true, nonce);
+    uint64_t end = offset + length;
 
-    size_t fileSize;
-    stringstream ss;
-    ss << writer;
-    ss >> fileSize;
-    delete writer;
-    if(fileSize == -2)
+    if (_kernelTls)
     {
-        throw FileSizeException();
+        // the body goes as a raw stream: pages move from the page cache
+        // to the socket without being copied in user space
+        off_t position = offset;
+        while (offset < end)
+        {
+            size_t toSend = end - offset;
+            if (toSend > KTLS_SENDFILE_CHUNK)
+                toSend = KTLS_SENDFILE_CHUNK;
+
+            file->advise(offset);
+            offset += sendFileTCP(_csTCP->getSocket(), file->getDescriptor(), &position, toSend);
+            if (stars)
+                Printer::printLoadBar(offset, file->size(),false);
+        }
+        return;
     }
-    
-    size_t writedBytes;
-    nonce += 1;
-    for (writedBytes = 0; writedBytes < fileSize; writedBytes += lenght)
+
+    // each record is encrypted (or only signed) straight from the mapping
+    while (offset < end)
     {
-        lenght = recvSecureMsg((void **)&writer, true, nonce);
+        size_t chunkSize = end - offset;
+        if (chunkSize > BUFF_SIZE)
+            chunkSize = BUFF_SIZE;
+
+        file->advise(offset);
+        sendBodyRecord(file->map(offset, chunkSize), chunkSize, nonce);
         nonce += 1;
-        unsigned char* writer2 = new unsigned char[lenght+1];
 
-        memcpy(writer2,writer,lenght);
-        writer2[lenght] = '\0';
-        Printer::printNormal((char*)writer2);
-        delete writer;
+        offset += chunkSize;
+        if (stars)
+            Printer::printLoadBar(offset, file->size(),false);
     }
-    
-    Printer::printNormal("\n");
-    
-    return writedBytes;
-}
\ No newline at end of file
+}
+
+void SecureConnection::sendBodyRecord(const unsigned char *data, size_t length, unsigned long nonce)
+{
+    if (_compressor == NULL)
+    {
+        int recordSize = _sMsgCreator->EncryptAndSignMessageInto(data, length, _recordBuffer, true, nonce);
+        _csTCP->sendMsg(_recordBuffer, recordSize);
+        return;
+    }
+
+    size_t plainSize = _compressor->compress(data, length, BUFF_SIZE, _compressBuffer);
+
+    // how long the socket takes against deflate decides the level
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int recordSize = _sMsgCreator->EncryptAndSignMessageInto(_compressBuffer, plainSize, _recordBuffer, true, nonce);
+    _csTCP->sendMsg(_recordBuffer, recordSize);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    _compressor->sent((t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec);
+}
+
+int SecureConnection::recvBodyRecord(unsigned char *dest, size_t capacity, unsigned long nonce)
+{
+    unsigned char *record;
+    int recordSize = _csTCP->recvMsg((void **)&record);
+
+    int lenght;
+    bool check;
+    if (_compressor == NULL)
+    {
+        check = _sMsgCreator->DecryptAndCheckSignInto(record, recordSize, dest, capacity, lenght, true, nonce);
+    }
+    else
+    {
+        int plainSize;
+        check = _sMsgCreator->DecryptAndCheckSignInto(record, recordSize, _compressBuffer, BUFF_SIZE + 1, plainSize, true, nonce);
+        lenght = check ? _compressor->decompress(_compressBuffer, plainSize, dest, capacity) : -1;
+    }
+    delete record;
+
+    if (!check || lenght <= 0)
+    {
+        throw HashNotValidException();
+    }
+    return lenght;
+}
+
+void SecureConnection::beginTransfer()
+{
+    if (_compressor != NULL)
+        _compressor->beginTransfer();
+}
+
+void SecureConnection::endTransfer()
+{
+    if (_compressor == NULL)
+        return;
+
+    uint64_t input, output;
+    _compressor->endTransfer(input, output);
+    if (input == 0)
+        return;
+
+    Metrics::add("compression_input_bytes_total", input);
+    Metrics::add("compression_output_bytes_total", output);
+
+    stringstream mess;
+    mess << "Compressed " << input << " bytes to " << output << " (" << (output * 100 / input) << "%, level " << _compressor->getLevel() << ")";
+    Printer::printInfo(mess.str().c_str());
+}
+
+void SecureConnection::sendExtent(uint64_t offset, uint64_t length, unsigned long nonce)
+{
+    uint64_t extent[2];
+    extent[0] = htobe64(offset);
+    extent[1] = htobe64(length);
+    sendSecureMsg(extent, sizeof(extent), true, nonce);
+}
+
+void SecureConnection::recvExtent(uint64_t &offset, uint64_t &length, unsigned long nonce)
+{
+    unsigned char *extent;
+    int lenght = recvSecureMsg((void **)&extent, true, nonce);
+    if (lenght != 2 * sizeof(uint64_t))
+    {
+        delete extent;
+        throw FileHeaderException();
+    }
+
+    memcpy(&offset, extent, sizeof(uint64_t));
+    memcpy(&length, extent + sizeof(uint64_t), sizeof(uint64_t));
+    delete extent;
+
+    offset = be64toh(offset);
+    length = be64toh(length);
+}
+
+int SecureConnection::recvFileChunk(char **chunk, size_t remaining, unsigned long nonce)
+{
+    if (!_kernelTls)
+    {
+        *chunk = new char[BUFF_SIZE];
+        try
+        {
+            return recvBodyRecord((unsigned char *)*chunk, BUFF_SIZE, nonce);
+        }
+        catch (...)
+        {
+            delete *chunk;
+            throw;
+        }
+    }
+
+    // with kernel TLS the body is a raw stream (see sendFile)
+    size_t chunkSize = remaining < BUFF_SIZE ? remaining : BUFF_SIZE;
+    *chunk = new char[chunkSize];
+    try
+    {
+        recvRawTCP(_csTCP->getSocket(), *chunk, chunkSize);
+    }
+    catch (...)
+    {
+        delete *chunk;
+        throw;
+    }
+
+    return chunkSize;
+}
+
+void SecureConnection::keepPartial(MappedFile *file, AsyncFileWriter *diskWriter, const char *filename, uint64_t fingerprint, uint64_t start)
+{
+    // only bytes that passed the hash check and reached the file count
+    try
+    {
+        diskWriter->finish();
+    }
+    catch (const FileWriteException &fwe)
+    {
+        return;
+    }
+
+    ResumePoint point;
+    point.fileSize = file->size();
+    point.fingerprint = fingerprint;
+    point.verified = diskWriter->getCommittedEnd();
+    if (point.verified < start)
+        point.verified = start;
+
+    if (fingerprint == 0 || point.verified < RESUME_MIN_BYTES)
+        return;
+
+    ResumeJournal journal(filename);
+    try
+    {
+        file->keepAs(journal.getPartialName().c_str());
+    }
+    catch (const MappedFileException &mfe)
+    {
+        return;
+    }
+    journal.save(point);
+
+    stringstream mess;
+    mess << "Transfer interrupted at byte " << point.verified << ", it will resume from there";
+    Printer::printInfo(mess.str().c_str());
+}
+
+uint64_t SecureConnection::receiveFile(const char *filename, bool stars, unsigned long nonce)
+{
+    // a concurrent transfer to the same name owns the journal: this one
+    // cannot resume, and keeps nothing if it fails
+    ResumeJournal journal(filename);
+    bool ownJournal = journal.lock();
+
+    uint64_t fileSize;
+    try
+    {
+        fileSize = receiveFile(filename, stars, nonce, journal, ownJournal);
+    }
+    catch (...)
+    {
+        if (ownJournal)
+            journal.unlock();
+        throw;
+    }
+
+    if (ownJournal)
+        journal.unlock();
+    return fileSize;
+}
+
+uint64_t SecureConnection::receiveFile(const char *filename, bool stars, unsigned long nonce, ResumeJournal &journal, bool ownJournal)
+{
+    char type;
+    uint64_t fingerprint, start;
+    uint64_t fileSize = recvFileHeader(nonce, type, fingerprint, start);
+    if (type == FILE_HEADER_RANGES)
+    {
+        throw FileHeaderException();
+    }
+    bool sparse = type == FILE_HEADER_SPARSE;
+
+    stringstream mess;
+    mess << "fileSize = " << fileSize;
+    Printer::printInfo(mess.str().c_str());
+
+    MappedFile *file;
+    try
+    {
+        if (start > 0)
+        {
+            // the sender agreed to go on from the point in our journal
+            ResumePoint point;
+            if (!ownJournal || !journal.load(point) || point.fileSize != fileSize || point.fingerprint != fingerprint || point.verified != start)
+            {
+                throw FileHeaderException();
+            }
+            file = new MappedFile(filename, fileSize, journal.getPartialName().c_str());
+            if (!sparse)
+                file->reserve(start, fileSize - start);
+
+            mess.str("");
+            mess << "Resuming from byte " << start;
+            Printer::printInfo(mess.str().c_str());
+        }
+        else
+        {
+            // sized to the announced length up front; the blocks of a sparse file
+            // are reserved extent by extent, so its holes stay holes
+            file = new MappedFile(filename, fileSize, !sparse);
+        }
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw FileNotOpenException();
+    }
+    file->setCachePolicy(_cachePolicy);
+
+    // records are decrypted into the buffers of the writer ring while the
+    // writer thread puts the previous buffers on disk
+    AsyncFileWriter *diskWriter = new AsyncFileWriter(file);
+    nonce += 1;
+    bool digestMatches = true;
+    
+    try
+    {
+        if (!sparse)
+        {
+            receiveFileRange(diskWriter, start, fileSize - start, fileSize, stars, nonce);
+        }
+        else
+        {
+            uint64_t position = start;
+            for (;;)
+            {
+                uint64_t extentStart, length;
+                recvExtent(extentStart, length, nonce);
+                nonce += 1;
+
+                if (length == 0)
+                {
+                    if (extentStart != fileSize)
+                        throw FileHeaderException();
+                    break;
+                }
+                // extents come in order and inside the file
+                if (extentStart < position || extentStart > fileSize || length > fileSize - extentStart)
+                {
+                    throw FileHeaderException();
+                }
+
+                file->reserve(extentStart, length);
+                receiveFileRange(diskWriter, extentStart, length, fileSize, stars, nonce);
+                position = extentStart + length;
+            }
+
+            if (stars)
+                Printer::printLoadBar(fileSize, fileSize,false);
+        }
+
+        diskWriter->finish();
+
+        // a resumed file is published only if it is, as a whole, the source file
+        if (start > 0)
+        {
+            unsigned char *expected;
+            int lenght = recvSecureMsg((void **)&expected, true, nonce);
+            nonce += 1;
+
+            unsigned char digest[RESUME_DIGEST_SIZE];
+            digestFile(file, digest);
+            digestMatches = lenght == RESUME_DIGEST_SIZE && CRYPTO_memcmp(expected, digest, RESUME_DIGEST_SIZE) == 0;
+            delete expected;
+        }
+    }
+    catch (const FileWriteException &fwe)
+    {
+        Printer::printErrorWithReason("Not possible write the file", fwe.what());
+        delete diskWriter;
+        delete file;
+        throw FileNotOpenException();
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete diskWriter;
+        delete file;
+        throw FileNotOpenException();
+    }
+    catch (...)
+    {
+        // network or hash failure: what was verified so far is kept for a resume
+        if (ownJournal)
+            keepPartial(file, diskWriter, filename, fingerprint, start);
+        delete diskWriter;
+        delete file;
+        throw;
+    }
+    delete diskWriter;
+
+    if (!digestMatches)
+    {
+        delete file;
+        if (ownJournal)
+            journal.discard();
+        throw ResumedFileMismatchException();
+    }
+
+    try
+    {
+        // only a complete file takes the destination name
+        if (_durability != NULL)
+            _durability->commit(file);
+        else
+            file->publish();
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw FileNotOpenException();
+    }
+
+    delete file;
+    // a journal left by an older attempt is of no use anymore
+    if (ownJournal)
+        journal.discard();
+
+    endTransfer();
+    return fileSize;
+}
+
+void SecureConnection::receiveFileRange(AsyncFileWriter *diskWriter, uint64_t offset, uint64_t length, uint64_t fileSize, bool stars, unsigned long &nonce)
+{
+    uint64_t end = offset + length;
+    int lenght;
+
+    while (offset < end)
+    {
+        unsigned char *buffer = diskWriter->acquire();
+        size_t filled = 0;
+
+        // a record never holds more than BUFF_SIZE plain bytes
+        while (offset + filled < end && WRITER_BUFFER_SIZE - filled >= BUFF_SIZE)
+        {
+            size_t remaining = end - offset - filled;
+            size_t capacity = WRITER_BUFFER_SIZE - filled;
+            if (capacity > remaining)
+                capacity = remaining;
+
+            if (_kernelTls)
+            {
+                lenght = capacity;
+                recvRawTCP(_csTCP->getSocket(), buffer + filled, lenght);
+            }
+            else
+            {
+                lenght = recvBodyRecord(buffer + filled, capacity, nonce);
+                nonce += 1;
+            }
+            filled += lenght;
+
+            //the following code prints * characters
+            if (stars)
+                Printer::printLoadBar(offset + filled, fileSize,false);
+        }
+
+        diskWriter->commit(offset, filled);
+        offset += filled;
+    }
+}
+
+uint64_t SecureConnection::sendBigMessage(const char *msg, uint64_t msgSize, unsigned long nonce)
+{
+    // same framing as sendFile, the body comes from memory
+    sendFileHeader(FILE_HEADER_FOUND, msgSize, 0, 0, nonce);
+    nonce += 1;
+    sendMemoryRange(msg, 0, msgSize, msgSize, false, nonce);
+    endTransfer();
+
+    return msgSize;
+}
+
+void SecureConnection::sendMemoryRange(const char *contents, uint64_t offset, uint64_t length, uint64_t fileSize, bool stars, unsigned long &nonce)
+{
+    uint64_t end = offset + length;
+
+    if (_kernelTls)
+    {
+        sendRawTCP(_csTCP->getSocket(), contents + offset, length);
+        if (stars)
+            Printer::printLoadBar(end, fileSize, false);
+        return;
+    }
+
+    while (offset < end)
+    {
+        size_t chunkSize = end - offset;
+        if (chunkSize > BUFF_SIZE)
+            chunkSize = BUFF_SIZE;
+
+        sendBodyRecord((const unsigned char *)contents + offset, chunkSize, nonce);
+        nonce += 1;
+
+        offset += chunkSize;
+        if (stars)
+            Printer::printLoadBar(offset, fileSize, false);
+    }
+}
+
+uint64_t SecureConnection::reciveAndPrintBigMessage(unsigned long nonce)
+{
+    char *writer;
+    int lenght;
+
+    char type;
+    uint64_t fingerprint, start;
+    uint64_t fileSize = recvFileHeader(nonce, type, fingerprint, start);
+    if (type != FILE_HEADER_FOUND || start != 0)
+    {
+        throw FileHeaderException();
+    }
+
+    uint64_t writedBytes;
+    nonce += 1;
+    for (writedBytes = 0; writedBytes < fileSize; writedBytes += lenght)
+    {
+        lenght = recvFileChunk(&writer, fileSize - writedBytes, nonce);
+        nonce += 1;
+        unsigned char* writer2 = new unsigned char[lenght+1];
+
+        memcpy(writer2,writer,lenght);
+        writer2[lenght] = '\0';
+        Printer::printNormal((char*)writer2);
+        delete writer;
+    }
+    
+    Printer::printNormal("\n");
+    
+    endTransfer();
+    return writedBytes;
+}
+void SecureConnection::sendRanges(const vector<FileRange> &ranges, unsigned long nonce)
+{
+    // count, then (offset, length) for each range, big endian
+    size_t count = ranges.size() < MAX_RANGES ? ranges.size() : MAX_RANGES;
+    size_t msgSize = sizeof(uint32_t) + count * 2 * sizeof(uint64_t);
+    unsigned char *msg = new unsigned char[msgSize];
+
+    uint32_t standardCount = htonl(count);
+    memcpy(msg, &standardCount, sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t fields[2];
+        fields[0] = htobe64((uint64_t)ranges[i].offset);
+        fields[1] = htobe64(ranges[i].length);
+        memcpy(msg + sizeof(uint32_t) + i * sizeof(fields), fields, sizeof(fields));
+    }
+
+    try
+    {
+        sendSecureMsg(msg, msgSize, true, nonce);
+    }
+    catch (...)
+    {
+        delete[] msg;
+        throw;
+    }
+    delete[] msg;
+}
+
+void SecureConnection::recvRanges(vector<FileRange> &ranges, unsigned long nonce)
+{
+    unsigned char *msg;
+    int lenght = recvSecureMsg((void **)&msg, true, nonce);
+
+    uint32_t count = 0;
+    if (lenght >= (int)sizeof(uint32_t))
+    {
+        memcpy(&count, msg, sizeof(uint32_t));
+        count = ntohl(count);
+    }
+    if (lenght < (int)sizeof(uint32_t) || count > MAX_RANGES || (size_t)lenght != sizeof(uint32_t) + count * 2 * sizeof(uint64_t))
+    {
+        delete msg;
+        throw FileHeaderException();
+    }
+
+    ranges.clear();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t fields[2];
+        memcpy(fields, msg + sizeof(uint32_t) + i * sizeof(fields), sizeof(fields));
+
+        FileRange range;
+        range.offset = (int64_t)be64toh(fields[0]);
+        range.length = be64toh(fields[1]);
+        ranges.push_back(range);
+    }
+    delete msg;
+}
+
+bool SecureConnection::clampRange(const FileRange &range, uint64_t fileSize, uint64_t &offset, uint64_t &length)
+{
+    // clamped to the file, ranges left empty are not sent
+    if (range.offset < 0)
+    {
+        uint64_t back = (uint64_t)0 - (uint64_t)range.offset;
+        offset = back < fileSize ? fileSize - back : 0;
+    }
+    else
+    {
+        offset = (uint64_t)range.offset < fileSize ? range.offset : fileSize;
+    }
+
+    length = fileSize - offset;
+    if (range.length != 0 && range.length < length)
+        length = range.length;
+    return length > 0;
+}
+
+uint64_t SecureConnection::sendFileRanges(const char *filename, const vector<FileRange> &ranges, unsigned long nonce)
+{
+    // no cache policy: the ranges are read where they are, without sequential read-ahead from 0
+    MappedFile *file;
+    try
+    {
+        file = new MappedFile(filename);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw FileNotOpenException();
+    }
+
+    uint64_t fileSize = file->size();
+    uint64_t sended = 0;
+    try
+    {
+        sendFileHeader(FILE_HEADER_RANGES, fileSize, file->getFingerprint(), 0, nonce);
+        nonce += 1;
+
+        for (size_t i = 0; i < ranges.size(); i++)
+        {
+            uint64_t offset, length;
+            if (!clampRange(ranges[i], fileSize, offset, length))
+                continue;
+
+            sendExtent(offset, length, nonce);
+            nonce += 1;
+            sendFileRange(file, offset, length, false, nonce);
+            sended += length;
+        }
+
+        // end of the ranges
+        sendExtent(fileSize, 0, nonce);
+        nonce += 1;
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw FileNotOpenException();
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+
+    delete file;
+    Metrics::add("range_bytes_sent_total", sended);
+    endTransfer();
+    return sended;
+}
+
+uint64_t SecureConnection::receiveFileRanges(const char *filename, unsigned long nonce)
+{
+    char type;
+    uint64_t fingerprint, start;
+    uint64_t fileSize = recvFileHeader(nonce, type, fingerprint, start);
+    if (type != FILE_HEADER_RANGES)
+    {
+        throw FileHeaderException();
+    }
+    nonce += 1;
+
+    // bytes outside the ranges are left as they are (a hole in a new file)
+    int fd = -1;
+    if (filename != NULL)
+    {
+        fd = open(filename, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            throw FileNotOpenException();
+        }
+        if (ftruncate(fd, fileSize) < 0)
+        {
+            close(fd);
+            throw FileNotOpenException();
+        }
+    }
+
+    uint64_t received = 0;
+    try
+    {
+        for (;;)
+        {
+            uint64_t offset, length;
+            recvExtent(offset, length, nonce);
+            nonce += 1;
+
+            if (length == 0)
+            {
+                if (offset != fileSize)
+                    throw FileHeaderException();
+                break;
+            }
+            if (offset > fileSize || length > fileSize - offset)
+            {
+                throw FileHeaderException();
+            }
+
+            uint64_t end = offset + length;
+            while (offset < end)
+            {
+                char *chunk;
+                int lenght = recvFileChunk(&chunk, end - offset, nonce);
+                nonce += 1;
+                if (lenght <= 0 || (uint64_t)lenght > end - offset)
+                {
+                    delete chunk;
+                    throw FileHeaderException();
+                }
+
+                if (fd < 0)
+                {
+                    cout.write(chunk, lenght);
+                }
+                else
+                {
+                    ssize_t written = 0;
+                    while (written < lenght)
+                    {
+                        ssize_t ret = pwrite(fd, chunk + written, lenght - written, offset + written);
+                        if (ret <= 0)
+                        {
+                            delete chunk;
+                            throw FileNotOpenException();
+                        }
+                        written += ret;
+                    }
+                }
+                delete chunk;
+
+                offset += lenght;
+                received += lenght;
+            }
+        }
+    }
+    catch (...)
+    {
+        if (fd >= 0)
+            close(fd);
+        throw;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    else
+        cout.flush();
+
+    endTransfer();
+    return received;
+}
+
+static void writeAt(int fd, const unsigned char *buffer, size_t length, uint64_t offset)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t ret = pwrite(fd, buffer + written, length - written, offset + written);
+        if (ret <= 0)
+        {
+            throw MappedFileException();
+        }
+        written += ret;
+    }
+}
+
+uint64_t SecureConnection::sendFileDelta(const char *filename, bool stars, unsigned long nonce)
+{
+    MappedFile *file;
+    try
+    {
+        file = new MappedFile(filename);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw FileNotOpenException();
+    }
+
+    uint64_t fileSize = file->size();
+    uint64_t literalBytes = 0;
+    try
+    {
+        // signatures of the server copy: basis size, block size, count, then the blocks
+        nonce += 1;
+        unsigned char *msg;
+        int lenght = recvSecureMsg((void **)&msg, true, nonce);
+        nonce += 1;
+        if (lenght != 2 * sizeof(uint64_t))
+        {
+            delete msg;
+            throw FileHeaderException();
+        }
+        uint64_t basisSize;
+        uint32_t blockSize, count;
+        memcpy(&basisSize, msg, sizeof(uint64_t));
+        memcpy(&blockSize, msg + sizeof(uint64_t), sizeof(uint32_t));
+        memcpy(&count, msg + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+        delete msg;
+        basisSize = be64toh(basisSize);
+        blockSize = ntohl(blockSize);
+        count = ntohl(count);
+        if (count > 0 && (blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK || count != basisSize / blockSize))
+        {
+            throw FileHeaderException();
+        }
+
+        size_t signatureSize = sizeof(uint32_t) + DELTA_STRONG_SIZE;
+        vector<BlockSignature> signatures(count);
+        for (uint32_t received = 0; received < count;)
+        {
+            lenght = recvSecureMsg((void **)&msg, true, nonce);
+            nonce += 1;
+            size_t inMsg = lenght / signatureSize;
+            if (lenght % signatureSize != 0 || inMsg == 0 || inMsg > count - received)
+            {
+                delete msg;
+                throw FileHeaderException();
+            }
+            for (size_t i = 0; i < inMsg; i++)
+            {
+                uint32_t weak;
+                memcpy(&weak, msg + i * signatureSize, sizeof(uint32_t));
+                signatures[received + i].weak = ntohl(weak);
+                memcpy(signatures[received + i].strong, msg + i * signatureSize + sizeof(uint32_t), DELTA_STRONG_SIZE);
+            }
+            delete msg;
+            received += inMsg;
+        }
+
+        vector<DeltaOp> ops;
+        Delta::computeDelta(file, blockSize, signatures, ops);
+
+        uint64_t standardSize = htobe64(fileSize);
+        sendSecureMsg(&standardSize, sizeof(uint64_t), true, nonce);
+        nonce += 1;
+
+        unsigned char op[BUFF_SIZE];
+        uint64_t rebuilt = 0;
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            if (ops[i].copy)
+            {
+                uint64_t fields[2];
+                fields[0] = htobe64(ops[i].offset);
+                fields[1] = htobe64(ops[i].length);
+                op[0] = DELTA_OP_COPY;
+                memcpy(op + 1, fields, sizeof(fields));
+                sendSecureMsg(op, 1 + sizeof(fields), true, nonce);
+                nonce += 1;
+                rebuilt += ops[i].length * blockSize;
+            }
+            else
+            {
+                for (uint64_t sended = 0; sended < ops[i].length;)
+                {
+                    size_t chunkSize = ops[i].length - sended < BUFF_SIZE - 1 ? ops[i].length - sended : BUFF_SIZE - 1;
+                    op[0] = DELTA_OP_LITERAL;
+                    memcpy(op + 1, file->map(ops[i].offset + sended, chunkSize), chunkSize);
+                    sendSecureMsg(op, 1 + chunkSize, true, nonce);
+                    nonce += 1;
+                    sended += chunkSize;
+                }
+                literalBytes += ops[i].length;
+                rebuilt += ops[i].length;
+            }
+
+            if (stars)
+                Printer::printLoadBar(rebuilt, fileSize, false);
+        }
+
+        op[0] = DELTA_OP_END;
+        digestFile(file, op + 1);
+        sendSecureMsg(op, 1 + RESUME_DIGEST_SIZE, true, nonce);
+        nonce += 1;
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw FileNotOpenException();
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+
+    delete file;
+    return literalBytes;
+}
+
+uint64_t SecureConnection::receiveFileDelta(const char *filename, bool stars, unsigned long nonce)
+{
+    // the copy the client can reuse blocks of (none for a new file)
+    MappedFile *basis = NULL;
+    try
+    {
+        basis = new MappedFile(filename);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        basis = NULL;
+    }
+
+    uint64_t literalBytes;
+    try
+    {
+        literalBytes = receiveFileDelta(filename, basis, stars, nonce);
+    }
+    catch (...)
+    {
+        delete basis;
+        throw;
+    }
+
+    delete basis;
+    return literalBytes;
+}
+
+uint64_t SecureConnection::receiveFileDelta(const char *filename, MappedFile *basis, bool stars, unsigned long nonce)
+{
+    uint64_t basisSize = basis != NULL ? basis->size() : 0;
+    uint32_t blockSize = Delta::chooseBlockSize(basisSize);
+    MappedFile *file = NULL;
+    uint64_t literalBytes = 0;
+    bool digestMatches;
+    try
+    {
+        vector<BlockSignature> signatures;
+        if (basis != NULL)
+            Delta::computeSignatures(basis, blockSize, signatures);
+        uint32_t count = signatures.size();
+
+        nonce += 1;
+        unsigned char header[2 * sizeof(uint64_t)];
+        uint64_t standardBasisSize = htobe64(basisSize);
+        uint32_t standardBlockSize = htonl(blockSize);
+        uint32_t standardCount = htonl(count);
+        memcpy(header, &standardBasisSize, sizeof(uint64_t));
+        memcpy(header + sizeof(uint64_t), &standardBlockSize, sizeof(uint32_t));
+        memcpy(header + sizeof(uint64_t) + sizeof(uint32_t), &standardCount, sizeof(uint32_t));
+        sendSecureMsg(header, sizeof(header), true, nonce);
+        nonce += 1;
+
+        size_t signatureSize = sizeof(uint32_t) + DELTA_STRONG_SIZE;
+        size_t perMsg = BUFF_SIZE / signatureSize;
+        unsigned char msg[BUFF_SIZE];
+        for (uint32_t sended = 0; sended < count;)
+        {
+            size_t inMsg = count - sended < perMsg ? count - sended : perMsg;
+            for (size_t i = 0; i < inMsg; i++)
+            {
+                uint32_t weak = htonl(signatures[sended + i].weak);
+                memcpy(msg + i * signatureSize, &weak, sizeof(uint32_t));
+                memcpy(msg + i * signatureSize + sizeof(uint32_t), signatures[sended + i].strong, DELTA_STRONG_SIZE);
+            }
+            sendSecureMsg(msg, inMsg * signatureSize, true, nonce);
+            nonce += 1;
+            sended += inMsg;
+        }
+
+        unsigned char *op;
+        int lenght = recvSecureMsg((void **)&op, true, nonce);
+        nonce += 1;
+        if (lenght != sizeof(uint64_t))
+        {
+            delete op;
+            throw FileHeaderException();
+        }
+        uint64_t fileSize;
+        memcpy(&fileSize, op, sizeof(uint64_t));
+        delete op;
+        fileSize = be64toh(fileSize);
+
+        stringstream mess;
+        mess << "fileSize = " << fileSize << ", " << count << " blocks of " << blockSize << " bytes reusable";
+        Printer::printInfo(mess.str().c_str());
+
+        file = new MappedFile(filename, fileSize, true);
+        int fd = file->getDescriptor();
+
+        // the new file is written in order, each instruction right after the previous one
+        uint64_t position = 0;
+        unsigned char expected[RESUME_DIGEST_SIZE];
+        for (;;)
+        {
+            lenght = recvSecureMsg((void **)&op, true, nonce);
+            nonce += 1;
+
+            char type = lenght > 0 ? op[0] : 0;
+            bool valid = true;
+            if (type == DELTA_OP_COPY && lenght == 1 + 2 * sizeof(uint64_t))
+            {
+                uint64_t fields[2];
+                memcpy(fields, op + 1, sizeof(fields));
+                uint64_t first = be64toh(fields[0]);
+                uint64_t blocks = be64toh(fields[1]);
+                valid = first <= count && blocks <= count - first && blocks * blockSize <= fileSize - position;
+                for (uint64_t copied = 0; valid && copied < blocks * blockSize;)
+                {
+                    size_t chunkSize = blocks * blockSize - copied < WRITER_BUFFER_SIZE ? blocks * blockSize - copied : WRITER_BUFFER_SIZE;
+                    writeAt(fd, basis->map(first * blockSize + copied, chunkSize), chunkSize, position);
+                    position += chunkSize;
+                    copied += chunkSize;
+                }
+            }
+            else if (type == DELTA_OP_LITERAL)
+            {
+                valid = (uint64_t)(lenght - 1) <= fileSize - position;
+                if (valid)
+                {
+                    writeAt(fd, op + 1, lenght - 1, position);
+                    position += lenght - 1;
+                    literalBytes += lenght - 1;
+                }
+            }
+            else if (type == DELTA_OP_END && lenght == 1 + RESUME_DIGEST_SIZE && position == fileSize)
+            {
+                memcpy(expected, op + 1, RESUME_DIGEST_SIZE);
+                delete op;
+                break;
+            }
+            else
+            {
+                valid = false;
+            }
+            delete op;
+
+            if (!valid)
+            {
+                throw FileHeaderException();
+            }
+            if (stars)
+                Printer::printLoadBar(position, fileSize, false);
+        }
+
+        unsigned char digest[RESUME_DIGEST_SIZE];
+        digestFile(file, digest);
+        digestMatches = CRYPTO_memcmp(expected, digest, RESUME_DIGEST_SIZE) == 0;
+
+        mess.str("");
+        mess << literalBytes << " of " << fileSize << " bytes received, the others copied";
+        Printer::printInfo(mess.str().c_str());
+        Metrics::add("delta_literal_bytes_total", literalBytes);
+        Metrics::add("delta_copied_bytes_total", fileSize - literalBytes);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw FileNotOpenException();
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+
+    if (!digestMatches)
+    {
+        delete file;
+        throw DeltaMismatchException();
+    }
+
+    try
+    {
+        // only a complete file takes the destination name
+        if (_durability != NULL)
+            _durability->commit(file);
+        else
+            file->publish();
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw FileNotOpenException();
+    }
+
+    delete file;
+    return literalBytes;
+}
+
+uint64_t SecureConnection::sendFileChunks(const char *filename, bool stars, unsigned long nonce)
+{
+    MappedFile *file;
+    try
+    {
+        file = new MappedFile(filename);
+    }
+    catch (const MappedFileException &mfe)
+    {
+        throw FileNotOpenException();
+    }
+    file->setCachePolicy(_cachePolicy);
+
+    uint64_t fileSize = file->size();
+    uint64_t sended = 0;
+    beginTransfer();
+    try
+    {
+        vector<ChunkRef> chunks;
+        ChunkStore::split(file, chunks);
+        uint32_t count = chunks.size();
+
+        // file size and number of chunks, then the chunks as (hash, length)
+        nonce += 1;
+        unsigned char msg[BUFF_SIZE];
+        uint64_t standardSize = htobe64(fileSize);
+        uint32_t standardCount = htonl(count);
+        memcpy(msg, &standardSize, sizeof(uint64_t));
+        memcpy(msg + sizeof(uint64_t), &standardCount, sizeof(uint32_t));
+        sendSecureMsg(msg, sizeof(uint64_t) + sizeof(uint32_t), true, nonce);
+        nonce += 1;
+
+        size_t refSize = CHUNK_HASH_SIZE + sizeof(uint32_t);
+        size_t perMsg = BUFF_SIZE / refSize;
+        for (uint32_t listed = 0; listed < count;)
+        {
+            size_t inMsg = count - listed < perMsg ? count - listed : perMsg;
+            for (size_t i = 0; i < inMsg; i++)
+            {
+                uint32_t length = htonl(chunks[listed + i].length);
+                memcpy(msg + i * refSize, chunks[listed + i].hash, CHUNK_HASH_SIZE);
+                memcpy(msg + i * refSize + CHUNK_HASH_SIZE, &length, sizeof(uint32_t));
+            }
+            sendSecureMsg(msg, inMsg * refSize, true, nonce);
+            nonce += 1;
+            listed += inMsg;
+        }
+
+        // one bit per chunk, set for those the server wants
+        vector<unsigned char> wanted((count + 7) / 8);
+        for (size_t received = 0; received < wanted.size();)
+        {
+            unsigned char *bitmap;
+            int lenght = recvSecureMsg((void **)&bitmap, true, nonce);
+            nonce += 1;
+            if (lenght <= 0 || (size_t)lenght > wanted.size() - received)
+            {
+                delete bitmap;
+                throw FileHeaderException();
+            }
+            memcpy(wanted.data() + received, bitmap, lenght);
+            delete bitmap;
+            received += lenght;
+        }
+
+        uint64_t offset = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (wanted[i / 8] & (1 << (i % 8)))
+            {
+                sendFileRange(file, offset, chunks[i].length, false, nonce);
+                sended += chunks[i].length;
+            }
+            offset += chunks[i].length;
+
+            if (stars)
+                Printer::printLoadBar(offset, fileSize, false);
+        }
+    }
+    catch (const MappedFileException &mfe)
+    {
+        delete file;
+        throw FileNotOpenException();
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+
+    delete file;
+    endTransfer();
+    return sended;
+}
+
+uint64_t SecureConnection::receiveFileChunks(ChunkStore *store, const string &name, bool stars, unsigned long nonce)
+{
+    beginTransfer();
+    nonce += 1;
+    unsigned char *msg;
+    int lenght = recvSecureMsg((void **)&msg, true, nonce);
+    nonce += 1;
+    if (lenght != sizeof(uint64_t) + sizeof(uint32_t))
+    {
+        delete msg;
+        throw FileHeaderException();
+    }
+    uint64_t fileSize;
+    uint32_t count;
+    memcpy(&fileSize, msg, sizeof(uint64_t));
+    memcpy(&count, msg + sizeof(uint64_t), sizeof(uint32_t));
+    delete msg;
+    fileSize = be64toh(fileSize);
+    count = ntohl(count);
+    // every chunk but the last has at least CHUNK_MIN_SIZE bytes
+    if (count > fileSize / CHUNK_MIN_SIZE + 1 || (fileSize > 0 && count < (fileSize + CHUNK_MAX_SIZE - 1) / CHUNK_MAX_SIZE))
+    {
+        throw FileHeaderException();
+    }
+
+    // grown as the list arrives: the announced size is not trusted with memory
+    size_t refSize = CHUNK_HASH_SIZE + sizeof(uint32_t);
+    vector<ChunkRef> chunks;
+    uint64_t total = 0;
+    for (uint32_t listed = 0; listed < count;)
+    {
+        lenght = recvSecureMsg((void **)&msg, true, nonce);
+        nonce += 1;
+        size_t inMsg = lenght / refSize;
+        if (lenght % refSize != 0 || inMsg == 0 || inMsg > count - listed)
+        {
+            delete msg;
+            throw FileHeaderException();
+        }
+        for (size_t i = 0; i < inMsg; i++)
+        {
+            ChunkRef chunk;
+            memcpy(chunk.hash, msg + i * refSize, CHUNK_HASH_SIZE);
+            memcpy(&chunk.length, msg + i * refSize + CHUNK_HASH_SIZE, sizeof(uint32_t));
+            chunk.length = ntohl(chunk.length);
+            chunks.push_back(chunk);
+            total += chunk.length;
+        }
+        delete msg;
+        listed += inMsg;
+
+        for (size_t i = listed - inMsg; i < listed; i++)
+        {
+            if (chunks[i].length == 0 || chunks[i].length > CHUNK_MAX_SIZE)
+                throw FileHeaderException();
+        }
+    }
+    if (total != fileSize)
+    {
+        throw FileHeaderException();
+    }
+
+    // each chunk missing from the store is asked for once, even if the file repeats it
+    vector<unsigned char> wanted((count + 7) / 8, 0);
+    set<string> asked;
+    uint64_t wantedBytes = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        string hash((char *)chunks[i].hash, CHUNK_HASH_SIZE);
+        if (asked.count(hash) == 0 && !store->has(chunks[i].hash))
+        {
+            wanted[i / 8] |= 1 << (i % 8);
+            asked.insert(hash);
+            wantedBytes += chunks[i].length;
+        }
+    }
+    for (size_t sended = 0; sended < wanted.size();)
+    {
+        size_t chunkSize = wanted.size() - sended < BUFF_SIZE ? wanted.size() - sended : BUFF_SIZE;
+        sendSecureMsg(wanted.data() + sended, chunkSize, true, nonce);
+        nonce += 1;
+        sended += chunkSize;
+    }
+
+    stringstream mess;
+    mess << "fileSize = " << fileSize << ", " << wantedBytes << " bytes not in the store yet";
+    Printer::printInfo(mess.str().c_str());
+
+    vector<unsigned char> data(CHUNK_MAX_SIZE);
+    uint64_t received = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!(wanted[i / 8] & (1 << (i % 8))))
+            continue;
+
+        for (size_t filled = 0; filled < chunks[i].length;)
+        {
+            char *part;
+            lenght = recvFileChunk(&part, chunks[i].length - filled, nonce);
+            if (lenght <= 0 || (size_t)lenght > chunks[i].length - filled)
+            {
+                delete part;
+                throw HashNotValidException();
+            }
+            if (!_kernelTls)
+                nonce += 1;
+            memcpy(data.data() + filled, part, lenght);
+            delete part;
+            filled += lenght;
+        }
+
+        bool stored;
+        try
+        {
+            stored = store->put(chunks[i].hash, data.data(), chunks[i].length);
+        }
+        catch (const ChunkStoreException &cse)
+        {
+            throw FileNotOpenException();
+        }
+        if (!stored)
+        {
+            throw ChunkMismatchException();
+        }
+
+        received += chunks[i].length;
+        if (stars)
+            Printer::printLoadBar(received, wantedBytes, false);
+    }
+
+    // the file appears under its name only once all its chunks are stored
+    try
+    {
+        store->saveManifest(name, fileSize, chunks);
+    }
+    catch (const ChunkStoreException &cse)
+    {
+        throw FileNotOpenException();
+    }
+
+    Metrics::add("chunk_store_new_bytes_total", received);
+    Metrics::add("chunk_store_dedup_bytes_total", fileSize - received);
+    endTransfer();
+    return received;
+}
+
+void SecureConnection::sendStoredRange(ChunkStore *store, const vector<ChunkRef> &chunks, uint64_t offset, uint64_t length, uint64_t fileSize, bool stars, unsigned long &nonce)
+{
+    uint64_t end = offset + length;
+    uint64_t chunkStart = 0;
+    for (size_t i = 0; i < chunks.size() && chunkStart < end; i++)
+    {
+        uint64_t chunkEnd = chunkStart + chunks[i].length;
+        if (chunkEnd > offset)
+        {
+            // the part of the chunk inside the range
+            uint64_t from = offset > chunkStart ? offset - chunkStart : 0;
+            uint64_t to = (end < chunkEnd ? end : chunkEnd) - chunkStart;
+
+            MappedFile *chunk;
+            try
+            {
+                chunk = new MappedFile(store->getChunkPath(chunks[i].hash).c_str());
+            }
+            catch (const MappedFileException &mfe)
+            {
+                // the receiver cannot be told anymore
+                throw NetworkException();
+            }
+            if (chunk->size() != chunks[i].length)
+            {
+                delete chunk;
+                throw NetworkException();
+            }
+
+            try
+            {
+                sendFileRange(chunk, from, to - from, false, nonce);
+            }
+            catch (...)
+            {
+                delete chunk;
+                throw;
+            }
+            delete chunk;
+
+            if (stars)
+                Printer::printLoadBar(chunkStart + to, fileSize, false);
+        }
+        chunkStart = chunkEnd;
+    }
+}
+
+// the manifest of name and its fingerprint, all its chunks checked: once a
+// header is sent the whole body must follow
+static void loadStoredFile(ChunkStore *store, const string &name, uint64_t &fileSize, uint64_t &fingerprint, vector<ChunkRef> &chunks)
+{
+    // taken before the manifest: a version stored in between is never sent under an older fingerprint
+    fingerprint = store->getFingerprint(name);
+    if (fingerprint == 0 || !store->loadManifest(name, fileSize, chunks))
+    {
+        throw FileNotOpenException();
+    }
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        if (!store->has(chunks[i].hash))
+        {
+            Printer::printError("A chunk of the file is missing from the store");
+            throw FileNotOpenException();
+        }
+    }
+}
+
+uint64_t SecureConnection::sendStoredFile(ChunkStore *store, const string &name, bool stars, unsigned long nonce, const ResumePoint *resume)
+{
+    uint64_t fileSize, fingerprint;
+    vector<ChunkRef> chunks;
+    loadStoredFile(store, name, fileSize, fingerprint, chunks);
+
+    // as sendFile
+    uint64_t start = 0;
+    if (resume != NULL && resume->fileSize == fileSize && resume->fingerprint == fingerprint && resume->verified <= fileSize)
+    {
+        start = resume->verified;
+    }
+
+    sendFileHeader(FILE_HEADER_FOUND, fileSize, fingerprint, start, nonce);
+    nonce += 1;
+
+    string mess = "fileSize = " + to_string(fileSize) + " in " + to_string(chunks.size()) + " chunks";
+    Printer::printInfo(mess.c_str());
+    if (start > 0)
+    {
+        mess = "Resuming from byte " + to_string(start);
+        Printer::printInfo(mess.c_str());
+        Metrics::add("resumed_bytes_skipped_total", start);
+    }
+
+    sendStoredRange(store, chunks, start, fileSize - start, fileSize, stars, nonce);
+
+    if (start > 0)
+    {
+        unsigned char digest[RESUME_DIGEST_SIZE];
+        if (!store->digestChunks(chunks, digest))
+            throw NetworkException();
+        sendSecureMsg(digest, RESUME_DIGEST_SIZE, true, nonce);
+        nonce += 1;
+    }
+
+    endTransfer();
+    return fileSize;
+}
+
+uint64_t SecureConnection::sendStoredFileRanges(ChunkStore *store, const string &name, const vector<FileRange> &ranges, unsigned long nonce)
+{
+    uint64_t fileSize, fingerprint;
+    vector<ChunkRef> chunks;
+    loadStoredFile(store, name, fileSize, fingerprint, chunks);
+
+    sendFileHeader(FILE_HEADER_RANGES, fileSize, fingerprint, 0, nonce);
+    nonce += 1;
+
+    uint64_t sended = 0;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        uint64_t offset, length;
+        if (!clampRange(ranges[i], fileSize, offset, length))
+            continue;
+
+        sendExtent(offset, length, nonce);
+        nonce += 1;
+        sendStoredRange(store, chunks, offset, length, fileSize, false, nonce);
+        sended += length;
+    }
+
+    // end of the ranges
+    sendExtent(fileSize, 0, nonce);
+    nonce += 1;
+
+    Metrics::add("range_bytes_sent_total", sended);
+    endTransfer();
+    return sended;
+}
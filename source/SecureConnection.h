@@ -1,11 +1,88 @@
 #include "IClientServerTCP.h"
 #include "SecureMessageCreator.h"
 #include "CertificationValidator.h"
+#include "MappedFile.h"
+#include "AsyncFileWriter.h"
+#include "Durability.h"
+#include "ResumeJournal.h"
+#include "Delta.h"
+#include "ChunkStore.h"
+#include "RecordCompressor.h"
+#include "CommandMessage.h"
 #include <exception>
 #include <fstream>
+#include <functional>
+#include <stdint.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
 #define BUFF_SIZE 4096
-#define MAX_FILE_SIZE 4294967296
+#define KTLS_SENDFILE_CHUNK 1048576 //bytes handed to each sendfile(), for the load bar
+
+// header sent before a file (or a big message): type byte, then as 64-bit big endian
+// the size, the source fingerprint (0: not resumable) and the offset the body starts at
+#define FILE_HEADER_FOUND 'F'
+#define FILE_HEADER_SPARSE 'S' //the body is a list of (offset, length) data extents, each followed by its bytes
+#define FILE_HEADER_NOT_FOUND 'N'
+#define FILE_HEADER_RANGES 'R' //as FILE_HEADER_SPARSE, the extents being the ranges asked for, in their order
+#define FILE_HEADER_NOT_MODIFIED 'M' //conditional retrieve: the client already holds these bytes, no body
+#define FILE_HEADER_SIZE 25
+// a body starting past 0 is followed by the SHA-256 of the whole file
+#define RESUME_DIGEST_SIZE 32
+
+#define MAX_RANGES 64 //ranges one ranged retrieve can ask for
+
+// conditional transfers: the client sends the size and SHA-256 of its copy,
+// the server answers whether the transfer is needed at all
+#define CONTENT_HASH_SIZE 32
+#define CONTENT_SAME 'M'      //both sides hold the same bytes, nothing follows
+#define CONTENT_DIFFERENT 'D' //the transfer goes on as an unconditional one
+
+// part of a file asked for by a ranged retrieve
+struct FileRange
+{
+    int64_t offset;  // < 0: counted back from the end of the file
+    uint64_t length; // 0: up to the end of the file
+};
+
+// delta upload: after the block signatures of the server copy, the client
+// sends the new size and then these instructions, one per message
+#define DELTA_OP_COPY 'C'    //first block and number of blocks of the server copy
+#define DELTA_OP_LITERAL 'L' //bytes of the new file
+#define DELTA_OP_END 'E'     //SHA-256 of the new file, checked before publishing
+
+// the capability offer and answer of the handshake: their own nonces tell
+// one from the other, so neither can be sent back as the other (the command
+// records use the nonces from 1 << COMMAND_NONCE_SHIFT on, the multiplexer
+// control frames the ones between, see Multiplexer.h)
+#define CAPABILITY_OFFER_NONCE 1
+#define CAPABILITY_ANSWER_NONCE 2
+
+// a command goes in one message, with its sequence number and argument: a
+// CommandMessage with CAP_BINARY_COMMANDS, otherwise "<command> <sequence
+// number>", a NUL, the argument, a NUL. The records of the command use the
+// nonces from its sequence number shifted left by COMMAND_NONCE_SHIFT on
+#define COMMAND_NONCE_SHIFT 32 //records one command can use (4 KB each: 16 TB)
+#define COMMAND_WINDOW 64      //sequence numbers below the highest one received still accepted, once (at most 64)
+
+// sequence numbers of the commands of a session, shared by its streams
+struct CommandSequence
+{
+    std::mutex mutex;
+    uint64_t next;    // sender: the next one to use
+    uint64_t highest; // receiver: highest one received, 0: none yet
+    uint64_t window;  // receiver: bit i set if highest - i was received
+};
+
+// session features agreed at the end of the handshake (bitmask)
+#define CAP_KERNEL_TLS 0x1
+#define CAP_INTEGRITY_ONLY 0x2 //records signed but not encrypted, excludes CAP_KERNEL_TLS
+#define CAP_CHUNK_STORE 0x4 //the server keeps uploads in a chunk store, only the chunks it lacks are sent
+#define CAP_COMPRESSION 0x8 //file bodies deflated before protection (see RecordCompressor), excludes CAP_KERNEL_TLS
+#define CAP_MULTIPLEX 0x10 //each command on a stream of its own, several at once (see Multiplexer), excludes CAP_KERNEL_TLS
+#define CAP_BINARY_COMMANDS 0x20 //commands as CommandMessage instead of text
 
 class SecureConnectionException : public std::exception
 {
@@ -58,12 +135,100 @@ class InvalidDigitalSignException : public SecureConnectionException
     }
 };
 
-class FileSizeException : public SecureConnectionException
+class FileHeaderException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Malformed file header";
+    }
+};
+
+class ResumedFileMismatchException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Resumed file does not match the source, the partial file was discarded";
+    }
+};
+
+class DeltaMismatchException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Rebuilt file does not match the one sent, it was discarded";
+    }
+};
+
+class CookieRequiredException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Server under load, connect again with its cookie";
+    }
+};
+
+class HandshakeMessageException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Unexpected handshake message";
+    }
+};
+
+class ServerBusyException : public SecureConnectionException
+{
+    public:
+    unsigned int retryAfterMs;
+
+    ServerBusyException(unsigned int retryAfter)
+    {
+        retryAfterMs = retryAfter;
+    }
+
+    const char *what() const throw()
+    {
+        return "Server busy, retry later";
+    }
+};
+
+class FileNotModifiedException : public SecureConnectionException
 {
     public:
     const char *what() const throw()
     {
-        return "File exceed dimension of 4GB";
+        return "The file is the same on both sides, nothing transferred";
+    }
+};
+
+class ChunkMismatchException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Chunk received does not match its hash";
+    }
+};
+
+class CommandNotValidException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Command malformed, already received or too old";
+    }
+};
+
+class KernelTlsException : public SecureConnectionException
+{
+    public:
+    const char *what() const throw()
+    {
+        return "Not possible install kernel TLS keys";
     }
 };
 
@@ -73,13 +238,67 @@ private:
     IClientServerTCP *_csTCP;
     SecureMessageCreator *_sMsgCreator;
     CertificationValidator* _certVal;
+    bool _ownCertVal;
+    unsigned char *_recordBuffer; // one file record, reused for the whole transfer
+
+    uint32_t _allowedCapabilities;
+    uint32_t _capabilities;
+    std::string _cookie; // last one the server sent, for the next hello
+    bool _kernelTls;
+    std::string _peerName; // subject of the certificate received in the handshake
+    const std::set<std::string> *_integrityOnlyPeers; // NULL: any authenticated peer
+
+    CachePolicy _cachePolicy;
+    Durability *_durability; // NULL: received files are just published
+
+    int _compressionLevel;
+    RecordCompressor *_compressor; // NULL unless CAP_COMPRESSION is active
+    unsigned char *_compressBuffer; // one body record before protection
+
+    // runs the CPU-bound steps of the handshake (DH, RSA, certificate checks)
+    std::function<void(std::function<void()>)> _cryptoRunner;
+    void runCrypto(std::function<void()> task);
+
+    CommandSequence *_commands;
+    bool _ownCommands; // false for a stream, the session has them
+    uint64_t nextCommandSequence();
+    void acceptCommandSequence(uint64_t sequence);
+
+    uint32_t offerCapabilities();
+    uint32_t acceptCapabilities(uint32_t offered);
+    void activateCapabilities(bool isServer);
+
+    // one record of a file body, compressed if the session does so
+    void sendBodyRecord(const unsigned char *data, size_t length, unsigned long nonce);
+    int recvBodyRecord(unsigned char *dest, size_t capacity, unsigned long nonce);
+    // the compression streams start over (see RecordCompressor), at the end
+    // the sender reports what the transfer compressed
+    void beginTransfer();
+    void endTransfer();
+    int recvFileChunk(char **chunk, size_t remaining, unsigned long nonce);
+    void sendFileHeader(char type, uint64_t size, uint64_t fingerprint, uint64_t start, unsigned long nonce);
+    uint64_t recvFileHeader(unsigned long nonce, char &type, uint64_t &fingerprint, uint64_t &start);
+    void digestFile(MappedFile *file, unsigned char *digest);
+    void keepPartial(MappedFile *file, AsyncFileWriter *diskWriter, const char *filename, uint64_t fingerprint, uint64_t start);
+    void sendExtent(uint64_t offset, uint64_t length, unsigned long nonce);
+    void recvExtent(uint64_t &offset, uint64_t &length, unsigned long nonce);
+    void sendFileRange(MappedFile *file, uint64_t offset, uint64_t length, bool stars, unsigned long &nonce);
+    // the bytes [offset, offset + length) of contents, a body of fileSize bytes in memory
+    void sendMemoryRange(const char *contents, uint64_t offset, uint64_t length, uint64_t fileSize, bool stars, unsigned long &nonce);
+    // the bytes [offset, offset + length) of a stored file, read from the chunks holding them
+    void sendStoredRange(ChunkStore *store, const std::vector<ChunkRef> &chunks, uint64_t offset, uint64_t length, uint64_t fileSize, bool stars, unsigned long &nonce);
+    // range clamped to a file of fileSize bytes; false if nothing is left of it
+    static bool clampRange(const FileRange &range, uint64_t fileSize, uint64_t &offset, uint64_t &length);
+    void receiveFileRange(AsyncFileWriter *diskWriter, uint64_t offset, uint64_t length, uint64_t fileSize, bool stars, unsigned long &nonce);
 
     int concatenate(unsigned char* src1, uint32_t len1, unsigned char* src2, uint32_t len2, unsigned char* &dest);
-    int readNamesFromFile(const char* filename, std::string* &names);
+    bool split(unsigned char* src, int srcLen, unsigned char* &dest1, uint32_t &len1, unsigned char* &dest2, uint32_t &len2);
 
     void computeSharedKeys(DH *dh_session, BIGNUM *bn);
 public:
     SecureConnection(IClientServerTCP *csTCP);
+    SecureConnection(IClientServerTCP *csTCP, CertificationValidator *certVal);
+    ~SecureConnection();
 
     int sendCertificate(X509* cert);
     int rcvCertificate(X509* &cert);
@@ -89,17 +308,95 @@ public:
     void sendSecureMsg(void *buffer, size_t bufferSize, bool useNonce, unsigned long nonce);
     int recvSecureMsg(void **plainText, bool useNonce, unsigned long nonce);
 
+    // commands of the session (see CommandSequence): nothing to wait for before
+    // the command starts; both return the first nonce of the command
+    unsigned long sendCommand(const std::string &command, const std::string &argument);
+    unsigned long recvCommand(std::string &command, std::string &argument);
+
     void sendAutenticationAndFreshness(unsigned char* expectedMsg, int msgLen, EVP_PKEY* privKey, X509* cert);
     bool recvAutenticationAndVerify(unsigned char* msg,int msgLen);
 
+    // a cookie in the hello was already verified by whoever accepted the connection
     void establishConnectionServer();
+    // CookieRequiredException: the server closed the connection after sending a
+    // cookie, the next call (on a new connection) presents it
     void establishConnectionClient();
+    // the cookie in a client hello; false if the hello carries none
+    static bool helloCookie(const unsigned char* hello, int helloLen, const unsigned char* &cookie);
     
     void destroyKeys();
+    // connection of one command of a multiplexed session: same keys and
+    // capabilities, its own record state, so streams can run in parallel
+    SecureConnection *openStream(IClientServerTCP *stream);
+    // the record keys of the session in a creator of its own, for the
+    // control frames of a Multiplexer; the caller deletes it
+    SecureMessageCreator *copyRecordKeys();
+
+    // features this side is willing to negotiate, all by default
+    void setAllowedCapabilities(uint32_t capabilities);
+    uint32_t getCapabilities();
+    // peers CAP_INTEGRITY_ONLY is accepted from (server side)
+    void setIntegrityOnlyPeers(const std::set<std::string> *peers);
+
+    // page cache hints used by sendFile and receiveFile
+    void setCachePolicy(const CachePolicy &policy);
+    // shared by the sessions of a server, so their commits can be grouped
+    void setDurability(Durability *durability);
+    // level CAP_COMPRESSION starts from, tuned afterwards to the link
+    void setCompressionLevel(int level);
+    // where the CPU-bound handshake steps run (default: the calling thread),
+    // so the threads waiting on the network are not the ones doing the math
+    void setCryptoRunner(std::function<void(std::function<void()>)> runner);
+
+    // resume: where the receiver stopped (NULL: from the start); ignored if the file changed since
+    uint64_t sendFile(const char *filename, bool stars, unsigned long nonce, const ResumePoint *resume);
+    // same, from a file already open (the caller keeps and deletes it)
+    uint64_t sendFile(MappedFile *file, bool stars, unsigned long nonce, const ResumePoint *resume);
+    // same, from a copy in memory of a file whose getFingerprint() was fingerprint when read
+    uint64_t sendFile(const char *contents, uint64_t fileSize, uint64_t fingerprint, bool stars, unsigned long nonce, const ResumePoint *resume);
+    // an interrupted transfer leaves a partial file and its journal (see ResumeJournal)
+    uint64_t receiveFile(const char *filename, bool stars, unsigned long nonce);
+    // same, the caller having locked (ownJournal) or failed to lock the journal
+    // of filename; without it the transfer cannot resume and keeps nothing
+    uint64_t receiveFile(const char *filename, bool stars, unsigned long nonce, ResumeJournal &journal, bool ownJournal);
+    void sendResumePoint(const ResumePoint &point, unsigned long nonce);
+    void recvResumePoint(ResumePoint &point, unsigned long nonce);
+
+    // ranged retrieve: only the bytes of the ranges are sent, read where they are in the file
+    void sendRanges(const std::vector<FileRange> &ranges, unsigned long nonce);
+    void recvRanges(std::vector<FileRange> &ranges, unsigned long nonce);
+    uint64_t sendFileRanges(const char *filename, const std::vector<FileRange> &ranges, unsigned long nonce);
+    // each range is written at its offset of filename (sized as the remote file),
+    // or one after the other to stdout if filename is NULL
+    uint64_t receiveFileRanges(const char *filename, unsigned long nonce);
+
+    // delta upload: only what the server copy of filename lacks is sent, returns the literal bytes
+    uint64_t sendFileDelta(const char *filename, bool stars, unsigned long nonce);
+    // rebuilds filename from its current copy and the client instructions, publishes it atomically
+    uint64_t receiveFileDelta(const char *filename, bool stars, unsigned long nonce);
+    // same, from basis instead of the current copy (NULL: none, the caller keeps and deletes it)
+    uint64_t receiveFileDelta(const char *filename, MappedFile *basis, bool stars, unsigned long nonce);
+
+    // chunked upload: the client lists the chunks of filename, the server asks
+    // for those it lacks; returns the bytes of chunk data sent
+    uint64_t sendFileChunks(const char *filename, bool stars, unsigned long nonce);
+    // stores the chunks received and the manifest of name, returns the bytes new to the store
+    uint64_t receiveFileChunks(ChunkStore *store, const std::string &name, bool stars, unsigned long nonce);
+    // sent as sendFile does, resumable too, the chunks read one after the other
+    uint64_t sendStoredFile(ChunkStore *store, const std::string &name, bool stars, unsigned long nonce, const ResumePoint *resume);
+    // as sendFileRanges, for a file of the chunk store
+    uint64_t sendStoredFileRanges(ChunkStore *store, const std::string &name, const std::vector<FileRange> &ranges, unsigned long nonce);
 
-    int sendFile(std::ifstream &file, bool stars, unsigned long nonce);
-    int receiveFile(const char *filename, bool stars, unsigned long nonce);
-    int reciveAndPrintBigMessage(unsigned long nonce);
+    uint64_t sendBigMessage(const char *msg, uint64_t msgSize, unsigned long nonce);
+    uint64_t reciveAndPrintBigMessage(unsigned long nonce);
+    // answer to a file request when the file is not there
+    void sendFileNotFound(unsigned long nonce);
+    // answer to a conditional retrieve when the client copy is the same
+    void sendFileNotModified(unsigned long nonce);
+    void sendContentHash(uint64_t size, const unsigned char *digest, unsigned long nonce);
+    void recvContentHash(uint64_t &size, unsigned char *digest, unsigned long nonce);
+    void sendContentAnswer(bool same, unsigned long nonce);
+    bool recvContentAnswer(unsigned long nonce);
 
     
 };
\ No newline at end of file
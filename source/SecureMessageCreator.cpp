@@ -7,6 +7,7 @@
 #include <iostream>
 #include <unistd.h>
 #include <string.h>
+#include "KernelTLS.h"
 using namespace std;
 
 DH* SecureMessageCreator::get_dh2048(void)
@@ -64,8 +65,18 @@ SecureMessageCreator::SecureMessageCreator()
   _encriptKeySize = 16;
   _encrypt_key = NULL;
 
+  _kernelTlsMaterial = NULL;
+
   //size of the hash
   _hashSize = EVP_MD_size(_hashAlgorithm);
+
+  _recordContext = EVP_CIPHER_CTX_new();
+  _integrityOnly = false;
+}
+
+SecureMessageCreator::~SecureMessageCreator()
+{
+  EVP_CIPHER_CTX_free(_recordContext);
 }
 
 unsigned long SecureMessageCreator::getNonce(){
@@ -87,6 +98,34 @@ void SecureMessageCreator::destroyKeysIfSetted(){
     delete _encrypt_key;
     _encrypt_key = NULL;
   }
+  if(_kernelTlsMaterial != NULL){
+    explicit_bzero(_kernelTlsMaterial, 2*KTLS_MATERIAL_SIZE);
+    delete _kernelTlsMaterial;
+    _kernelTlsMaterial = NULL;
+  }
+  _integrityOnly = false;
+}
+
+void SecureMessageCreator::copyKeys(SecureMessageCreator *other){
+  destroyKeysIfSetted();
+
+  _hmac_key = new unsigned char[_hmacKeySize];
+  memcpy(_hmac_key, other->_hmac_key, _hmacKeySize);
+  _encrypt_key = new unsigned char[_encriptKeySize];
+  memcpy(_encrypt_key, other->_encrypt_key, _encriptKeySize);
+  _integrityOnly = other->_integrityOnly;
+}
+
+void SecureMessageCreator::setIntegrityOnly(bool integrityOnly)
+{
+  _integrityOnly = integrityOnly;
+}
+
+unsigned char* SecureMessageCreator::getKernelTlsMaterial(bool clientToServer){
+  if(_kernelTlsMaterial == NULL)
+    return NULL;
+
+  return clientToServer ? _kernelTlsMaterial : _kernelTlsMaterial + KTLS_MATERIAL_SIZE;
 }
 
 bool SecureMessageCreator::derivateKeys(unsigned char* inizializationKey, size_t ikSize){
@@ -117,6 +156,26 @@ bool SecureMessageCreator::derivateKeys(unsigned char* inizializationKey, size_t
   }
   _encrypt_key = new unsigned char[_encriptKeySize];
   memcpy(_encrypt_key, tmpSha256, _encriptKeySize);
+
+  // independent keys for the kernel TLS record layer, one per direction:
+  // SHA256(label || shared secret)
+  const char* labels[2] = {"kernel tls client", "kernel tls server"};
+  _kernelTlsMaterial = new unsigned char[2*KTLS_MATERIAL_SIZE];
+  for(int i = 0; i < 2; i++){
+    unsigned char* labelled = new unsigned char[strlen(labels[i]) + ikSize];
+    memcpy(labelled, labels[i], strlen(labels[i]));
+    memcpy(labelled + strlen(labels[i]), inizializationKey, ikSize);
+
+    bool hashed = simpleHash256(labelled, strlen(labels[i]) + ikSize, tmpSha256);
+    explicit_bzero(labelled, strlen(labels[i]) + ikSize);
+    delete labelled;
+    if(!hashed){
+      delete tmpSha256;
+      return false;
+    }
+    memcpy(_kernelTlsMaterial + i*KTLS_MATERIAL_SIZE, tmpSha256, KTLS_MATERIAL_SIZE);
+  }
+  explicit_bzero(tmpSha256, SHA256_DIGEST_LENGTH);
   //cout<<"[DEBUG] session key:"<<endl;
   //BIO_dump_fp(stdout,(char*)_encrypt_key,_encriptKeySize);
 
@@ -125,14 +184,14 @@ bool SecureMessageCreator::derivateKeys(unsigned char* inizializationKey, size_t
 }
 
 bool SecureMessageCreator::simpleHash256(unsigned char* input,size_t inputLenght, unsigned char* &output){
-  SHA256_CTX context;
-    if(!SHA256_Init(&context))
+  SHA256_CTX shaContext;
+    if(!SHA256_Init(&shaContext))
         return false;
 
-    if(!SHA256_Update(&context, (unsigned char*)input, inputLenght))
+    if(!SHA256_Update(&shaContext, (unsigned char*)input, inputLenght))
         return false;
 
-    if(!SHA256_Final(output, &context))
+    if(!SHA256_Final(output, &shaContext))
         return false;
 
     return true;
@@ -140,50 +199,45 @@ bool SecureMessageCreator::simpleHash256(unsigned char* input,size_t inputLenght
 
 unsigned char *SecureMessageCreator::hash(unsigned char *inBuf, int inLen, bool useNonce, unsigned long nonce)
 {
-  unsigned char *outBuf;
-  unsigned char *toHashBuf;
-  int hashBufSize;
-  
-  if(useNonce){
-    hashBufSize = inLen + sizeof(unsigned long);
-    toHashBuf = new unsigned char[hashBufSize];
-
-    memcpy(toHashBuf, &nonce, sizeof(unsigned long));
-    memcpy(toHashBuf + sizeof(unsigned long), inBuf, inLen);
-  }else{
-    hashBufSize = inLen;
-    toHashBuf = inBuf;  
-  }
+  unsigned char *outBuf = new unsigned char[_hashSize];
 
-  outBuf = new unsigned char[_hashSize];
+  hashInto(inBuf, inLen, useNonce, nonce, outBuf);
+
+  return outBuf;
+}
 
+void SecureMessageCreator::hashInto(const unsigned char *inBuf, int inLen, bool useNonce, unsigned long nonce, unsigned char *outBuf)
+{
   //Creazione del messaggio contesto digest
-  HMAC_CTX *mdctx;
-  mdctx = HMAC_CTX_new();
+  HMAC_CTX *hmacContext;
+  hmacContext = HMAC_CTX_new();
+
+  //Init,Update,Finalise digest: HMAC(nonce || inBuf), fed in two parts instead of copying
+  HMAC_Init_ex(hmacContext, _hmac_key, _hmacKeySize, _hashAlgorithm, NULL);
 
-  //Init,Update,Finalise digest
-  HMAC_Init_ex(mdctx, _hmac_key, _hmacKeySize, _hashAlgorithm, NULL);
+  if (useNonce && !HMAC_Update(hmacContext, (unsigned char *)&nonce, sizeof(unsigned long)))
+  {
+    cout << "[SUPER ERRORE HMAC]" << endl;
+  }
 
-  if (!HMAC_Update(mdctx, (unsigned char *)toHashBuf, hashBufSize))
+  if (!HMAC_Update(hmacContext, inBuf, inLen))
   {
     //errore
     cout << "[SUPER ERRORE HMAC]" << endl;
   }
 
-  HMAC_Final(mdctx, outBuf, (unsigned int *)&_hashSize);
+  unsigned int outLen;
+  HMAC_Final(hmacContext, outBuf, &outLen);
 
   //Delete context
-  HMAC_CTX_free(mdctx);
-
-  if(useNonce)
-    delete toHashBuf;
-
-  return outBuf;
+  HMAC_CTX_free(hmacContext);
 }
 
-
 void SecureMessageCreator::initEncryptContext(unsigned char* iv)
 {
+  if (_integrityOnly)
+    return;
+
   /*Creazione del contesto*/
   context = EVP_CIPHER_CTX_new();
 
@@ -208,6 +262,9 @@ int SecureMessageCreator::finalAndFreeEncryptContext(unsigned char* chiperText,
 
 void SecureMessageCreator::initDecryptContext(unsigned char* iv)
 {
+  if (_integrityOnly)
+    return;
+
   /*Creazione del contesto*/
   context = EVP_CIPHER_CTX_new();
 
@@ -338,6 +395,12 @@ int SecureMessageCreator::EncryptAndSignMessageFinal(unsigned char *plainText, i
   memcpy(messageToEncrypt + _hashSize, plainText, plainTextLen);
 
   int messageToEncryptLen = plainTextLen + _hashSize;
+  if (_integrityOnly)
+  {
+    delete hashSign;
+    *secureText = messageToEncrypt;
+    return messageToEncryptLen;
+  }
   *secureText = new unsigned char[messageToEncryptLen + 16]; //consider the padding
 
   int secureTextLen = updateEncrypt(messageToEncrypt, messageToEncryptLen, *secureText);
@@ -351,6 +414,18 @@ int SecureMessageCreator::EncryptAndSignMessageFinal(unsigned char *plainText, i
 
 bool SecureMessageCreator::DecryptAndCheckSignFinal(unsigned char *secureText, int secureTextLen, unsigned char **plainText, int &plainTextLen, bool useNonce, unsigned long nonce)
 {
+  if (_integrityOnly)
+  {
+    if (secureTextLen < _hashSize || !check_hash(secureText + _hashSize, secureTextLen - _hashSize, secureText, useNonce, nonce))
+    {
+      return false;
+    }
+    plainTextLen = secureTextLen - _hashSize;
+    *plainText = new unsigned char [plainTextLen];
+    memcpy(*plainText, secureText + _hashSize, plainTextLen);
+    return true;
+  }
+
   unsigned char *decryptedText = new unsigned char[secureTextLen];
   int decryptLen = updateDecrypt(secureText, secureTextLen, decryptedText);
   finalAndFreeDecryptContext(decryptedText, decryptLen);
@@ -372,6 +447,146 @@ bool SecureMessageCreator::DecryptAndCheckSignFinal(unsigned char *secureText, i
   return true;
 }
 
+// a fresh context has an all-zero IV: the reused one is reset to the same value
+static const unsigned char recordIv[EVP_MAX_IV_LENGTH] = {0};
+
+int SecureMessageCreator::getRecordOverhead()
+{
+  // hash + at most one block of padding
+  return _hashSize + EVP_CIPHER_block_size(_encryptAlgorithm);
+}
+
+int SecureMessageCreator::EncryptAndSignMessageInto(const unsigned char *plainText, int plainTextLen, unsigned char *secureText, bool useNonce, unsigned long nonce)
+{
+  if (_integrityOnly)
+  {
+    hashInto(plainText, plainTextLen, useNonce, nonce, secureText);
+    memcpy(secureText + _hashSize, plainText, plainTextLen);
+    return _hashSize + plainTextLen;
+  }
+
+  unsigned char hashSign[EVP_MAX_MD_SIZE];
+  hashInto(plainText, plainTextLen, useNonce, nonce, hashSign);
+
+  if (EVP_EncryptInit_ex(_recordContext, _encryptAlgorithm, NULL, _encrypt_key, recordIv) != 1)
+  {
+    throw EncryptInitException();
+  }
+
+  // E(hash || plainText) without building hash || plainText
+  int len;
+  int secureTextLen = 0;
+  EVP_EncryptUpdate(_recordContext, secureText, &len, hashSign, _hashSize);
+  secureTextLen += len;
+  EVP_EncryptUpdate(_recordContext, secureText + secureTextLen, &len, plainText, plainTextLen);
+  secureTextLen += len;
+  EVP_EncryptFinal_ex(_recordContext, secureText + secureTextLen, &len);
+  secureTextLen += len;
+
+  return secureTextLen;
+}
+
+bool SecureMessageCreator::DecryptAndCheckSignInto(const unsigned char *secureText, int secureTextLen, unsigned char *dest, size_t destCapacity, int &plainTextLen, bool useNonce, unsigned long nonce)
+{
+  if (_integrityOnly)
+  {
+    if (secureTextLen < _hashSize || (size_t)(secureTextLen - _hashSize) > destCapacity)
+    {
+      return false;
+    }
+    plainTextLen = secureTextLen - _hashSize;
+    unsigned char calculatedHash[EVP_MAX_MD_SIZE];
+    hashInto(secureText + _hashSize, plainTextLen, useNonce, nonce, calculatedHash);
+    if (CRYPTO_memcmp(calculatedHash, secureText, _hashSize) != 0)
+    {
+      return false;
+    }
+    memcpy(dest, secureText + _hashSize, plainTextLen);
+    return true;
+  }
+
+  int blockSize = EVP_CIPHER_block_size(_encryptAlgorithm);
+  int blocks = secureTextLen / blockSize;
+  int hashBlocks = _hashSize / blockSize;
+
+  if (secureTextLen % blockSize != 0 || blocks < hashBlocks + 1)
+  {
+    return false;
+  }
+
+  if (EVP_DecryptInit_ex(_recordContext, _encryptAlgorithm, NULL, _encrypt_key, recordIv) != 1)
+  {
+    throw EncryptInitException();
+  }
+
+  // EVP holds back the last decrypted block (it may be padding) and writes
+  // one block past what it reports: the hash, the bulk and the tail are
+  // decrypted separately so that only message bytes ever land in dest.
+  unsigned char head[EVP_MAX_MD_SIZE + 2 * EVP_MAX_BLOCK_LENGTH];
+  unsigned char tail[3 * EVP_MAX_BLOCK_LENGTH];
+  int len;
+  int headBlocks = hashBlocks + 1;
+  int bulkBlocks = blocks - headBlocks - 1;
+  if (bulkBlocks < 0)
+  {
+    bulkBlocks = 0;
+    headBlocks = blocks - 1;
+  }
+
+  // 1. hash (the first message block stays held)
+  EVP_DecryptUpdate(_recordContext, head, &len, secureText, headBlocks * blockSize);
+  int headLen = len;
+
+  // 2. bulk: message bytes only, it never writes past the message end
+  plainTextLen = 0;
+  if (bulkBlocks > 0)
+  {
+    if ((size_t)(bulkBlocks + 1) * blockSize > destCapacity)
+    {
+      return false;
+    }
+    EVP_DecryptUpdate(_recordContext, dest, &len, secureText + headBlocks * blockSize, bulkBlocks * blockSize);
+    plainTextLen = len;
+  }
+
+  // 3. tail: last block and padding
+  EVP_DecryptUpdate(_recordContext, tail, &len, secureText + (blocks - 1) * blockSize, blockSize);
+  int tailLen = len;
+  int finalLen;
+  if (EVP_DecryptFinal_ex(_recordContext, tail + tailLen, &finalLen) != 1)
+  {
+    return false;
+  }
+  tailLen += finalLen;
+
+  // short records: part of the hash may have come out with the tail
+  int hashMissing = _hashSize - headLen;
+  if (hashMissing > 0)
+  {
+    if (hashMissing > tailLen)
+    {
+      return false;
+    }
+    memcpy(head + headLen, tail, hashMissing);
+  }
+  else
+  {
+    hashMissing = 0;
+  }
+
+  if ((size_t)(plainTextLen + tailLen - hashMissing) > destCapacity)
+  {
+    return false;
+  }
+  memcpy(dest + plainTextLen, tail + hashMissing, tailLen - hashMissing);
+  plainTextLen += tailLen - hashMissing;
+
+  unsigned char calculatedHash[EVP_MAX_MD_SIZE];
+  hashInto(dest, plainTextLen, useNonce, nonce, calculatedHash);
+
+  return CRYPTO_memcmp(head, calculatedHash, _hashSize) == 0;
+}
+
 EVP_PKEY* SecureMessageCreator::ExtractPublicKeyFromFile(const char* filename)
 {
   EVP_PKEY* pubKey = NULL;
@@ -27,18 +27,33 @@ class SecureMessageCreator {
 
     int _hashSize; // Algoritm+h used Sha-256
 
+    // kernel TLS keys (key || salt || iv) for each direction
+    unsigned char* _kernelTlsMaterial;
+
     EVP_CIPHER_CTX *context;
     HMAC_CTX *mdctx;
+    // reused by the *Into functions, one record after the other
+    EVP_CIPHER_CTX *_recordContext;
+
+    // records are hash || plainText, not encrypted (trusted networks only)
+    bool _integrityOnly;
 
     unsigned char* hash(unsigned char *inBuf, int inLen, bool useNonce, unsigned long nonce);
+    void hashInto(const unsigned char *inBuf, int inLen, bool useNonce, unsigned long nonce, unsigned char *outBuf);
     
     bool check_hash(unsigned char *inBuf, int bufLen, unsigned char *hash, bool useNonce, unsigned long nonce);
     bool simpleHash256(unsigned char* input,size_t inputLenght, unsigned char* &output);
 
   public:
     SecureMessageCreator();
+    ~SecureMessageCreator();
     bool derivateKeys(unsigned char* inizializationKey, size_t ikSize);
     void destroyKeysIfSetted();
+    // the record keys of other (not the kernel TLS ones), for a stream of the same session
+    void copyKeys(SecureMessageCreator *other);
+    unsigned char* getKernelTlsMaterial(bool clientToServer);
+    // until the keys are destroyed
+    void setIntegrityOnly(bool integrityOnly);
 
     unsigned long getNonce();
 
@@ -56,6 +71,14 @@ class SecureMessageCreator {
 
     int EncryptAndSignMessageFinal(unsigned char* plainText, int plainTextLen, unsigned char** secureText, bool useNonce, unsigned long nonce);
     bool DecryptAndCheckSignFinal(unsigned char* secureText, int secureTextLen, unsigned char** plainText, int &plainTextLen, bool useNonce, unsigned long nonce);
+
+    // same records as the Final functions, without intermediate copies:
+    // the plain text is read from / decrypted into caller memory (e.g. a file mapping).
+    // secureText must have room for plainTextLen + getRecordOverhead() bytes
+    int getRecordOverhead();
+    int EncryptAndSignMessageInto(const unsigned char* plainText, int plainTextLen, unsigned char* secureText, bool useNonce, unsigned long nonce);
+    // false if the hash is not valid or the plain text would not fit in destCapacity
+    bool DecryptAndCheckSignInto(const unsigned char* secureText, int secureTextLen, unsigned char* dest, size_t destCapacity, int &plainTextLen, bool useNonce, unsigned long nonce);
     
     EVP_PKEY* ExtractPublicKeyFromFile(const char* filename);
     EVP_PKEY* ExtractPrivateKey(const char* filename);
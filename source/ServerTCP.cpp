@@ -7,6 +7,8 @@
 #include <sys/types.h> //socket (costantie valori)
 #include <sys/socket.h>	//socket (funzioni)
 #include <arpa/inet.h>	//standard per l'ordine dei byte
+#include <netinet/tcp.h>
+#include <poll.h>
 
 void ServerTCP::localAddrStructInit(void)
 {
@@ -27,7 +29,12 @@ void ServerTCP::listenerSocketInit()
         exit(-1);
     }
 
-    ret = listen(_listenerSocket, 1);
+    // a connection is handed over with its first message, the accept loop
+    // can look at it without waiting
+    int deferSeconds = DEFER_ACCEPT_TIME;
+    setsockopt(_listenerSocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(deferSeconds));
+
+    ret = listen(_listenerSocket, _backlog);
     if (ret < 0)
     {
         Printer::printError("Not possible switching in listening mode.");
@@ -40,55 +47,78 @@ void ServerTCP::listenerSocketClose()
     close(_listenerSocket);
 }
 
-void ServerTCP::clientDisconnected()
-{
-    close(_comunicationSocket);
-    _comunicationSocket = -1;
-}
-
-ServerTCP::ServerTCP(unsigned short portNumber)
+ServerTCP::ServerTCP(unsigned short portNumber, int backlog)
 {
     _portNumber = portNumber;
-    _comunicationSocket = -1;
+    _backlog = backlog;
     localAddrStructInit();
     listenerSocketInit();
 }
 
-int ServerTCP::acceptNewConnecction()
+void ServerTCP::closeLingering()
 {
-    //listenerSocketInit();
-    socklen_t len = sizeof(_clientAddrStruct);
-    memset(&_clientAddrStruct, 0, len);
-    _comunicationSocket = accept(_listenerSocket, (struct sockaddr *)&_clientAddrStruct, &len);
-    if (_comunicationSocket < 0)
+    time_t now = time(NULL);
+    while (!_lingering.empty() && now - _lingering.front().second >= LINGER_TIME)
     {
-        Printer::printError("Not possible accept new connection.");
+        close(_lingering.front().first);
+        _lingering.pop_front();
     }
-    
-    return _comunicationSocket;
 }
 
-int ServerTCP::recvMsg(void **buffer)
+void ServerTCP::rejectConnection(int socket, unsigned int retryAfterMs)
 {
-    if (_comunicationSocket < 0)
-    {
-        Printer::printWaring("recvMsg called without a client connected.");
-    }
-    int numberOfBytes = recvTCP(_comunicationSocket, buffer);
+    unsigned char busyMsg[1 + sizeof(uint32_t)];
+    uint32_t standardRetry = htonl(retryAfterMs);
+
+    busyMsg[0] = HANDSHAKE_BUSY;
+    memcpy(busyMsg + 1, &standardRetry, sizeof(uint32_t));
 
-    return numberOfBytes;
+    dismissConnection(socket, busyMsg, sizeof(busyMsg));
+}
+
+void ServerTCP::sendCookie(int socket, const std::string &cookie)
+{
+    std::string cookieMsg = std::string(1, HANDSHAKE_COOKIE) + cookie;
+    dismissConnection(socket, (void*)cookieMsg.data(), cookieMsg.size());
 }
 
-void ServerTCP::sendMsg(void *buffer, size_t bufferSize)
+void ServerTCP::dismissConnection(int socket, void *message, size_t messageSize)
 {
-    if (_comunicationSocket < 0)
+    // a few bytes on a new connection: the socket buffer takes them without blocking
+    try
     {
-        Printer::printWaring("SendMsg called without a client connected");
+        sendTCP(socket, message, messageSize);
     }
-    sendTCP(_comunicationSocket, buffer, bufferSize);
+    catch (const SocketLibException &sle)
+    {
+        close(socket);
+        return;
+    }
+
+    shutdown(socket, SHUT_WR);
+    _lingering.push_back(std::make_pair(socket, time(NULL)));
 }
 
-void ServerTCP::forceClientDisconnection()
+int ServerTCP::acceptNewConnecction()
 {
-    close(_comunicationSocket);
+    closeLingering();
+
+    // wake up now and then to close lingering sockets even when nobody connects
+    struct pollfd listener;
+    listener.fd = _listenerSocket;
+    listener.events = POLLIN;
+    if (poll(&listener, 1, LINGER_TIME * 1000) <= 0)
+    {
+        return -1;
+    }
+
+    socklen_t len = sizeof(_clientAddrStruct);
+    memset(&_clientAddrStruct, 0, len);
+    int comunicationSocket = accept(_listenerSocket, (struct sockaddr *)&_clientAddrStruct, &len);
+    if (comunicationSocket < 0)
+    {
+        Printer::printError("Not possible accept new connection.");
+    }
+    
+    return comunicationSocket;
 }
@@ -1,26 +1,39 @@
 #include "socket_lib.h"
-#include "IClientServerTCP.h"
 #include <netinet/in.h>	//socket (strutture)
+#include <deque>
+#include <time.h>
 
-class ServerTCP : public IClientServerTCP{
+#include <string>
+
+#define LINGER_TIME 2 //seconds a rejected socket is kept half-closed before close()
+#define DEFER_ACCEPT_TIME 5 //seconds accept() waits for the first client message
+
+class ServerTCP{
 private:
 	unsigned short _portNumber;	
+	int _backlog;
 
 	struct sockaddr_in _localAddrStruct;
 	struct sockaddr_in _clientAddrStruct;
 		
-	int _listenerSocket, _comunicationSocket;
+	int _listenerSocket;
+
+	// rejected sockets waiting to be closed: closing them at once could reset
+	// the connection before the client has read the busy message
+	std::deque<std::pair<int, time_t> > _lingering;
 
 	void localAddrStructInit();
 	void listenerSocketInit();
 	void listenerSocketClose();
-	void clientDisconnected();
+	void closeLingering();
+	// sends message and drops the connection
+	void dismissConnection(int socket, void *message, size_t messageSize);
 public: 
-	ServerTCP(unsigned short portNumber);
-//ritorna -1 se arriva una nuova connessione e l'accetta
-//altrimenti ritorna il numero del socket da gestire
+	ServerTCP(unsigned short portNumber, int backlog);
+//ritorna il socket della nuova connessione accettata, -1 in caso di errore
 	int acceptNewConnecction();
-	int recvMsg(void** buffer);
-	void sendMsg(void *buffer, size_t bufferSize);
-	void forceClientDisconnection();
-};
\ No newline at end of file
+	// tells the client to retry after retryAfterMs milliseconds and drops the connection
+	void rejectConnection(int socket, unsigned int retryAfterMs);
+	// tells the client to connect again with cookie and drops the connection
+	void sendCookie(int socket, const std::string &cookie);
+};
@@ -0,0 +1,66 @@
+#include "SessionTCP.h"
+#include <sys/types.h> //socket (costantie valori)
+#include <sys/socket.h>	//socket (funzioni)
+#include <sys/time.h>
+#include <arpa/inet.h>	//standard per l'ordine dei byte
+#include <unistd.h>
+
+SessionTCP::SessionTCP(int comunicationSocket)
+{
+    _comunicationSocket = comunicationSocket;
+    setNoDelay(_comunicationSocket);
+}
+
+int SessionTCP::getSocket()
+{
+    return _comunicationSocket;
+}
+
+std::string SessionTCP::getPeerName()
+{
+    struct sockaddr_in peerAddr;
+    socklen_t len = sizeof(peerAddr);
+    if (getpeername(_comunicationSocket, (struct sockaddr *)&peerAddr, &len) < 0)
+    {
+        return "";
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peerAddr.sin_addr, ip, sizeof(ip));
+
+    return std::string(ip) + ":" + std::to_string(ntohs(peerAddr.sin_port));
+}
+
+void SessionTCP::setRecvTimeout(int seconds)
+{
+    //0 disables the timeout
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(_comunicationSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+void SessionTCP::closeConnection()
+{
+    if (_comunicationSocket >= 0)
+    {
+        close(_comunicationSocket);
+        _comunicationSocket = -1;
+    }
+}
+
+void SessionTCP::shutdownConnection()
+{
+    shutdown(_comunicationSocket, SHUT_RDWR);
+}
+
+void SessionTCP::sendMsg(void *buffer, size_t bufferSize)
+{
+    sendTCP(_comunicationSocket, buffer, bufferSize);
+}
+
+int SessionTCP::recvMsg(void **buffer)
+{
+    int numberOfBytes = recvTCP(_comunicationSocket, buffer);
+    return numberOfBytes;
+}
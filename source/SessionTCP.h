@@ -0,0 +1,20 @@
+#include "socket_lib.h"
+#include "IClientServerTCP.h"
+#include <string>
+
+// channel towards a single client accepted by ServerTCP
+class SessionTCP : public IClientServerTCP{
+private:
+    int _comunicationSocket;
+
+public:
+    SessionTCP(int comunicationSocket);
+    int getSocket();
+    std::string getPeerName();
+    void setRecvTimeout(int seconds);
+    void closeConnection();
+    // ends the connection for the threads using it, the socket stays open
+    void shutdownConnection();
+    void sendMsg(void *buffer, size_t bufferSize);
+    int recvMsg(void** buffer);
+};
@@ -0,0 +1,70 @@
+#include "Settings.h"
+#include "Printer.h"
+#include <fstream>
+#include <stdlib.h>
+
+using namespace std;
+
+static string trim(const string &str)
+{
+    size_t begin = str.find_first_not_of(" \t\r");
+    if (begin == string::npos)
+        return "";
+
+    size_t end = str.find_last_not_of(" \t\r");
+    return str.substr(begin, end - begin + 1);
+}
+
+Settings::Settings(const char* filename)
+{
+    ifstream is(filename);
+    if (!is.is_open())
+    {
+        string mess = string("settings file ") + filename + " not found, using defaults";
+        Printer::printInfo(mess.c_str());
+        return;
+    }
+
+    string line;
+    while (getline(is, line))
+    {
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+            line = line.substr(0, comment);
+
+        size_t equal = line.find('=');
+        if (equal == string::npos)
+            continue;
+
+        string key = trim(line.substr(0, equal));
+        if (!key.empty())
+            _values[key] = trim(line.substr(equal + 1));
+    }
+}
+
+long Settings::getLong(const string &key, long defaultValue)
+{
+    map<string, string>::iterator it = _values.find(key);
+    if (it == _values.end())
+        return defaultValue;
+
+    char* end;
+    long value = strtol(it->second.c_str(), &end, 10);
+    if (end == it->second.c_str() || *end != '\0')
+    {
+        string mess = "settings: value of '" + key + "' is not a number, using default";
+        Printer::printWaring(mess.c_str());
+        return defaultValue;
+    }
+
+    return value;
+}
+
+string Settings::getString(const string &key, const string &defaultValue)
+{
+    map<string, string>::iterator it = _values.find(key);
+    if (it == _values.end())
+        return defaultValue;
+
+    return it->second;
+}
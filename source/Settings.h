@@ -0,0 +1,20 @@
+#ifndef SETTINGS
+#define SETTINGS
+
+#include <map>
+#include <string>
+
+// key = value pairs read from a configuration file, '#' starts a comment.
+// A missing file or key leaves the caller default in place.
+class Settings{
+private:
+    std::map<std::string, std::string> _values;
+
+public:
+    Settings(const char* filename);
+
+    long getLong(const std::string &key, long defaultValue);
+    std::string getString(const std::string &key, const std::string &defaultValue);
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "WorkerPool.h"
+#include <future>
+#include <memory>
+
+using namespace std;
+
+WorkerPool::WorkerPool(size_t numberOfWorkers, size_t maxQueued)
+{
+    _maxQueued = maxQueued;
+    _running = 0;
+    _stopping = false;
+
+    if (numberOfWorkers == 0)
+        numberOfWorkers = 1;
+
+    for (size_t i = 0; i < numberOfWorkers; i++)
+    {
+        _workers.push_back(thread(&WorkerPool::workerLoop, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _taskAvailable.notify_all();
+
+    for (size_t i = 0; i < _workers.size(); i++)
+    {
+        _workers[i].join();
+    }
+}
+
+void WorkerPool::workerLoop()
+{
+    for (;;)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(_mutex);
+            _taskAvailable.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+            if (_stopping && _tasks.empty())
+                return;
+
+            task = _tasks.front();
+            _tasks.pop_front();
+            _running += 1;
+        }
+
+        task();
+
+        lock_guard<mutex> lock(_mutex);
+        _running -= 1;
+    }
+}
+
+bool WorkerPool::trySubmit(function<void()> task)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (_stopping || _tasks.size() >= _maxQueued)
+            return false;
+
+        _tasks.push_back(task);
+    }
+    _taskAvailable.notify_one();
+
+    return true;
+}
+
+void WorkerPool::run(function<void()> task)
+{
+    shared_ptr<packaged_task<void()>> packaged = make_shared<packaged_task<void()>>(task);
+    future<void> done = packaged->get_future();
+    bool queued = false;
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (!_stopping)
+        {
+            _tasks.push_back([packaged] { (*packaged)(); });
+            queued = true;
+        }
+    }
+    if (queued)
+        _taskAvailable.notify_one();
+    else
+        (*packaged)();
+
+    done.get();
+}
+
+size_t WorkerPool::pending()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _tasks.size() + _running;
+}
@@ -0,0 +1,39 @@
+#ifndef WORKER_POOL
+#define WORKER_POOL
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed set of threads consuming a bounded queue of tasks
+class WorkerPool
+{
+private:
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _taskAvailable;
+
+    size_t _maxQueued;
+    size_t _running;
+    bool _stopping;
+
+    void workerLoop();
+
+public:
+    WorkerPool(size_t numberOfWorkers, size_t maxQueued);
+    ~WorkerPool();
+
+    // returns false, without queuing, when the queue is full
+    bool trySubmit(std::function<void()> task);
+    // runs task on a worker and waits for it, rethrowing what it threw; not
+    // limited by the queue size, the callers bound themselves
+    void run(std::function<void()> task);
+    // tasks queued or running
+    size_t pending();
+};
+
+#endif
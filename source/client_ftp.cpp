@@ -2,81 +2,160 @@
 #include "ClientTCP.h"
 #include "Sanitizator.h"
 #include "Printer.h"
+#include "HashCache.h"
+#include "Multiplexer.h"
 #include <limits.h>
 #include <string.h>
 #include <iostream>
 #include <sstream>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <openssl/rand.h>
+
+#define MAX_CONNECTION_ATTEMPTS 8
+#define MAX_BACKOFF 30000 //milliseconds
+#define HASH_CACHE_FILE ".hash_cache" //digests of the local files, kept between runs for ui and ri
+
 using namespace std;
 
 SecureConnection *_secureConnection;
 ClientTCP *_client;
+HashCache *_hashCache;
+Multiplexer *_mux; // NULL: commands run one after the other on _secureConnection
 
-unsigned long sendUploadCommand(string file)
-{
-    unsigned long nonceServer;
-    unsigned long nonceClient = _secureConnection->generateNonce();
-    unsigned long nonce;
-    unsigned char* nonceBuf;
-    stringstream ss;
-    ss << "u "<<nonceClient;
-    string msg = ss.str();
-    _secureConnection->sendSecureMsg((void *)msg.c_str(), msg.length() + 1, false, 0);
+// transfers running in the background, quit waits for them
+mutex _transfersMutex;
+condition_variable _transferEnded;
+int _transfers;
 
-    _secureConnection->recvSecureMsg((void **) &nonceBuf, true, nonceClient);
-    memcpy(&nonceServer, nonceBuf, sizeof(unsigned long));
-    delete nonceBuf;
+unsigned long sendUploadCommand(SecureConnection *connection, string file, ResumePoint &resume)
+{
+    // resumable upload: the server answers with what it already has of the file
+    unsigned long nonce = connection->sendCommand("ur", file);
 
-    nonce = nonceServer + nonceClient;
+    nonce += 1;
+    connection->recvResumePoint(resume, nonce);
 
-    _secureConnection->sendSecureMsg((void *)file.c_str(), file.length() + 1, true, nonce);
-    
     return nonce;
 }
 
-unsigned long sendRetriveListCommand()
+unsigned long sendConditionalCommand(SecureConnection *connection, string command, string file, uint64_t size, const unsigned char *digest)
+{
+    unsigned long nonce = connection->sendCommand(command, file);
+
+    // what the local copy is, the server compares it with its own
+    nonce += 1;
+    connection->sendContentHash(size, digest, nonce);
+
+    return nonce + 1;
+}
+
+unsigned long sendChunkUploadCommand(SecureConnection *connection, string file)
+{
+    return connection->sendCommand("uc", file);
+}
+
+void chunkUploadCommand(SecureConnection *connection, string filename, bool stars)
 {
     unsigned long nonce;
-    unsigned long nonceServer;
-    unsigned long nonceClient = _secureConnection->generateNonce();
-    unsigned char* nonceBuf;
-    stringstream ss;
-    ss << "rl "<<nonceClient;
-    string msg = ss.str();
-    _secureConnection->sendSecureMsg((void *)msg.c_str(), msg.length() + 1, false, 0);
+    try
+    {
+        nonce = sendChunkUploadCommand(connection, filename);
+    }
+    catch (const NetworkException &e)
+    {
+        Printer::printError("A network error has occoured sending the command");
+        return;
+    }
+
+    try
+    {
+        Printer::printNormal("\n");
+        uint64_t sended = connection->sendFileChunks(filename.c_str(), stars, nonce);
+        stringstream mess;
+        mess << sended << " bytes sent, the other chunks were already on the server";
+        Printer::printInfo(mess.str().c_str());
+    }
+    catch (const NetworkException &ne)
+    {
+        Printer::printError("A network error has occoured sending the file");
+    }
+    catch (const FileHeaderException &fhe)
+    {
+        Printer::printError(fhe.what());
+    }
+}
+
+unsigned long sendDeltaUploadCommand(SecureConnection *connection, string file)
+{
+    return connection->sendCommand("ud", file);
+}
 
-    _secureConnection->recvSecureMsg((void **) &nonceBuf, true, nonceClient);
-    memcpy(&nonceServer, nonceBuf, sizeof(unsigned long));
-    delete nonceBuf;
-    nonce = nonceServer + nonceClient;
+unsigned long sendRetriveListCommand(SecureConnection *connection)
+{
+    return connection->sendCommand("rl", "");
+}
 
-    _secureConnection->sendSecureMsg((void*) &nonce, sizeof(unsigned long), true, nonce);
+// resume != NULL: what is left of an interrupted download is asked for
+unsigned long sendRetriveFileCommand(SecureConnection *connection, string file, const ResumePoint *resume)
+{
+    unsigned long nonce = connection->sendCommand(resume != NULL ? "rr" : "rf", file);
+
+    if (resume != NULL)
+    {
+        nonce += 1;
+        connection->sendResumePoint(*resume, nonce);
+    }
 
     return nonce;
 }
 
-unsigned long sendRetriveFileCommand(string file)
+unsigned long sendRetriveRangesCommand(SecureConnection *connection, string file, const vector<FileRange> &ranges)
 {
-    unsigned long nonce;
-    unsigned long nonceServer;
-    unsigned long nonceClient = _secureConnection->generateNonce();
-    unsigned char* nonceBuf;
-
-    stringstream ss;
-    ss << "rf "<<nonceClient;
-    string msg = ss.str();
-    _secureConnection->sendSecureMsg((void *)msg.c_str(), msg.length() + 1, false, 0);
-
-    _secureConnection->recvSecureMsg((void **) &nonceBuf, true, nonceClient);
-    memcpy(&nonceServer, nonceBuf, sizeof(unsigned long));
-    delete nonceBuf;
-    
-    nonce = nonceServer + nonceClient;
-    _secureConnection->sendSecureMsg((void *)file.c_str(), file.length() + 1, true, nonce);
+    unsigned long nonce = connection->sendCommand("rg", file);
+
+    nonce += 1;
+    connection->sendRanges(ranges, nonce);
 
     return nonce;
 }
 
-void uploadCommand(string filename) //changed argument with filename
+// <offset>:<length>, a negative offset counts back from the end, no length means up to the end
+bool parseRange(const string &token, FileRange &range)
+{
+    size_t colon = token.find(':');
+    if (colon == string::npos || colon == 0)
+        return false;
+
+    string offset = token.substr(0, colon);
+    string length = token.substr(colon + 1);
+    char *end;
+
+    errno = 0;
+    range.offset = strtoll(offset.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0')
+        return false;
+
+    range.length = 0;
+    if (!length.empty())
+    {
+        if (length[0] == '-')
+            return false;
+        range.length = strtoull(length.c_str(), &end, 10);
+        if (errno != 0 || *end != '\0' || range.length == 0)
+            return false;
+    }
+    return true;
+}
+
+void uploadCommand(SecureConnection *connection, string filename, bool stars) //changed argument with filename
 {
     ifstream readFile;
 
@@ -98,11 +177,20 @@ void uploadCommand(string filename) //changed argument with filename
         return;
     }
 
+    // a server keeping a chunk store is sent only the chunks it lacks
+    if (connection->getCapabilities() & CAP_CHUNK_STORE)
+    {
+        readFile.close();
+        chunkUploadCommand(connection, filename, stars);
+        return;
+    }
+
     unsigned long nonce;
+    ResumePoint resume;
 
     try
     {
-        nonce = sendUploadCommand(filename);
+        nonce = sendUploadCommand(connection, filename, resume);
     }
     catch (const NetworkException &e)
     {
@@ -114,26 +202,70 @@ void uploadCommand(string filename) //changed argument with filename
     try
     {
         Printer::printNormal("\n");
-        _secureConnection->sendFile(readFile, true, nonce);
+        connection->sendFile(filename.c_str(), stars, nonce, &resume);
     }
     catch (const NetworkException &ne)
     {
         Printer::printError("A network error has occoured sending the file");
     }
-    catch(const FileSizeException &fse){
-        Printer::printError(fse.what());
-    }
 
     readFile.close();
 }
 
-void retriveListCommand()
+void deltaUploadCommand(SecureConnection *connection, string filename, bool stars)
+{
+    try
+    {
+        Sanitizator::checkFilename(filename.c_str());
+    }
+    catch(const exception& e)
+    {
+        Printer::printError(e.what());
+        return;
+    }
+
+    if (access(filename.c_str(), R_OK) != 0)
+    {
+        Printer::printError("File doesn't exists");
+        return;
+    }
+
+    unsigned long nonce;
+    try
+    {
+        nonce = sendDeltaUploadCommand(connection, filename);
+    }
+    catch (const NetworkException &e)
+    {
+        Printer::printError("A network error has occoured sending the command");
+        return;
+    }
+
+    try
+    {
+        Printer::printNormal("\n");
+        uint64_t literalBytes = connection->sendFileDelta(filename.c_str(), stars, nonce);
+        stringstream mess;
+        mess << literalBytes << " bytes sent, the rest rebuilt from the copy on the server";
+        Printer::printInfo(mess.str().c_str());
+    }
+    catch (const NetworkException &ne)
+    {
+        Printer::printError("A network error has occoured sending the file");
+    }
+    catch (const FileHeaderException &fhe)
+    {
+        Printer::printError(fhe.what());
+    }
+}
+
+void retriveListCommand(SecureConnection *connection)
 {
     unsigned long nonce;
 
     try
     {
-        nonce = sendRetriveListCommand();
+        nonce = sendRetriveListCommand(connection);
     }
     catch (const NetworkException &e)
     {
@@ -144,18 +276,15 @@ void retriveListCommand()
     try
     {
         Printer::printNormal("\n");
-        _secureConnection->reciveAndPrintBigMessage(nonce);
+        connection->reciveAndPrintBigMessage(nonce);
     }
-    catch (const FileSizeException &fse){
-		Printer::printError(fse.what());
-	}
     catch (const NetworkException &ne)
     {
         Printer::printError("A network error has occoured downloading the message");
     }
 }
 
-void retriveFileCommand(string filename)
+void retriveFileCommand(SecureConnection *connection, string filename, bool stars)
 {
     unsigned long nonce;
 
@@ -169,9 +298,76 @@ void retriveFileCommand(string filename)
         return;
     }
 
+    // a download interrupted earlier goes on from where it stopped
+    ResumeJournal journal(filename.c_str());
+    ResumePoint resume;
+    bool resuming = journal.load(resume);
+
+    try
+    {
+        nonce = sendRetriveFileCommand(connection, filename, resuming ? &resume : NULL);
+    }
+    catch (const NetworkException &e)
+    {
+        Printer::printError("A network error has occoured sending the command");
+        return;
+    }
+
+    // written in place: the name appears only once the whole file has arrived
+    try
+    {
+        Printer::printNormal("\n");
+        connection->receiveFile(filename.c_str(), stars, nonce);
+    }
+    catch (const FileNotOpenException &fnoe)
+    {
+        // the server is already sending: the session can not go on
+        Printer::printError("Not possible store the file");
+        throw;
+    }
+    catch (const NetworkException &ne)
+    {
+        Printer::printError("A network error has occoured downloading the file");
+        return;
+    }
+    catch (const FileDoesNotExistsException &fdnee)
+    {
+        Printer::printError(fdnee.what());
+        return;
+    }
+    catch (const ResumedFileMismatchException &rfme)
+    {
+        Printer::printError(rfme.what());
+        return;
+    }
+}
+
+void conditionalUploadCommand(SecureConnection *connection, string filename, bool stars)
+{
+    try
+    {
+        Sanitizator::checkFilename(filename.c_str());
+    }
+    catch(const exception& e)
+    {
+        Printer::printError(e.what());
+        return;
+    }
+
+    uint64_t size;
+    unsigned char digest[CONTENT_HASH_SIZE];
+    if (!_hashCache->digest(filename, size, digest))
+    {
+        Printer::printError("File doesn't exists");
+        return;
+    }
+
+    unsigned long nonce;
+    bool same;
     try
     {
-        nonce = sendRetriveFileCommand(filename);
+        nonce = sendConditionalCommand(connection, "ui", filename, size, digest);
+        same = connection->recvContentAnswer(nonce);
     }
     catch (const NetworkException &e)
     {
@@ -179,60 +375,309 @@ void retriveFileCommand(string filename)
         return;
     }
 
-    system("/bin/mkdir -p tmp");
-    string tmpFile = "tmp/tmp.txt";
-    string cmd;
+    if (same)
+    {
+        Printer::printInfo("Not modified, the server already has this file");
+        return;
+    }
 
+    // from here as u would do
     try
     {
         Printer::printNormal("\n");
-        _secureConnection->receiveFile(tmpFile.c_str(), true, nonce);
+        if (connection->getCapabilities() & CAP_CHUNK_STORE)
+        {
+            connection->sendFileChunks(filename.c_str(), stars, nonce);
+        }
+        else
+        {
+            ResumePoint resume;
+            nonce += 1;
+            connection->recvResumePoint(resume, nonce);
+            connection->sendFile(filename.c_str(), stars, nonce, &resume);
+        }
+    }
+    catch (const NetworkException &ne)
+    {
+        Printer::printError("A network error has occoured sending the file");
+    }
+    catch (const FileHeaderException &fhe)
+    {
+        Printer::printError(fhe.what());
+    }
+}
+
+void conditionalRetriveCommand(SecureConnection *connection, string filename, bool stars)
+{
+    try
+    {
+        Sanitizator::checkFilename(filename.c_str());
+    }
+    catch(const exception& e)
+    {
+        Printer::printError(e.what());
+        return;
     }
-    catch (const FileSizeException &fse){
-		Printer::printError(fse.what());
-        system("/bin/rm -r tmp");
+
+    // nothing to compare with: a plain retrieve
+    uint64_t size;
+    unsigned char digest[CONTENT_HASH_SIZE];
+    if (!_hashCache->digest(filename, size, digest))
+    {
+        retriveFileCommand(connection, filename, stars);
         return;
-	}
-    catch (const DisconnectionException &de)
+    }
+
+    unsigned long nonce;
+    try
     {
-        system("/bin/rm -r tmp");
-        throw de;
+        nonce = sendConditionalCommand(connection, "ri", filename, size, digest);
+    }
+    catch (const NetworkException &e)
+    {
+        Printer::printError("A network error has occoured sending the command");
+        return;
+    }
+
+    try
+    {
+        Printer::printNormal("\n");
+        connection->receiveFile(filename.c_str(), stars, nonce);
+    }
+    catch (const FileNotModifiedException &fnme)
+    {
+        Printer::printInfo(fnme.what());
+    }
+    catch (const FileNotOpenException &fnoe)
+    {
+        // the server is already sending: the session can not go on
+        Printer::printError("Not possible store the file");
+        throw;
     }
     catch (const NetworkException &ne)
     {
         Printer::printError("A network error has occoured downloading the file");
-        system("/bin/rm -r tmp");
+    }
+    catch (const FileDoesNotExistsException &fdnee)
+    {
+        Printer::printError(fdnee.what());
+    }
+}
+
+void retriveRangesCommand(SecureConnection *connection, string filename, string arguments)
+{
+    try
+    {
+        Sanitizator::checkFilename(filename.c_str());
+    }
+    catch(const exception& e)
+    {
+        Printer::printError(e.what());
         return;
     }
-    catch (const HashNotValidException &hnve)
+
+    vector<FileRange> ranges;
+    bool toStdout = false;
+    stringstream tokens(arguments);
+    string token;
+    while (tokens >> token)
+    {
+        FileRange range;
+        if (token == "-")
+        {
+            toStdout = true;
+        }
+        else if (parseRange(token, range))
+        {
+            ranges.push_back(range);
+        }
+        else
+        {
+            Printer::printError(string("Not valid range: " + token).c_str());
+            return;
+        }
+    }
+    if (ranges.empty() || ranges.size() > MAX_RANGES)
     {
-        system("/bin/rm -r tmp");
-        throw hnve;
+        Printer::printError("Between 1 and 64 ranges are needed");
+        return;
+    }
+
+    unsigned long nonce;
+    try
+    {
+        nonce = sendRetriveRangesCommand(connection, filename, ranges);
+    }
+    catch (const NetworkException &e)
+    {
+        Printer::printError("A network error has occoured sending the command");
+        return;
+    }
+
+    try
+    {
+        Printer::printNormal("\n");
+        uint64_t received = connection->receiveFileRanges(toStdout ? NULL : filename.c_str(), nonce);
+
+        stringstream mess;
+        mess << received << " bytes received";
+        Printer::printInfo(mess.str().c_str());
+    }
+    catch (const FileNotOpenException &fnoe)
+    {
+        // the server is already sending: the session can not go on
+        Printer::printError("Not possible store the ranges");
+        throw;
+    }
+    catch (const NetworkException &ne)
+    {
+        Printer::printError("A network error has occoured downloading the ranges");
+        return;
     }
     catch (const FileDoesNotExistsException &fdnee)
     {
         Printer::printError(fdnee.what());
-        system("/bin/rm -r tmp");
         return;
     }
-
-    cmd = "/bin/mv " + tmpFile + " " + filename;
-    system(cmd.c_str());
-    system("/bin/rm -r tmp");
 }
 
 void helpCommand()
 {
-    Printer::printTag("   u |       upload" , "<filename>: upload <filename> to the server" , CYAN);
+    Printer::printTag("   u |       upload" , "<filename>: upload <filename> to the server (an interrupted upload resumes)" , CYAN);
+    Printer::printTag("  ui |upload-changed" , "<filename>: upload <filename> unless the server already has the same bytes" , CYAN);
+    Printer::printTag("  ud |upload-delta" , "<filename>: upload <filename> sending only what differs from the copy already on the server" , CYAN);
     Printer::printTag("  rl | retrive-list" , ": retrive the list of files available from the server." , CYAN);
-    Printer::printTag("  rf | retrive-file" , "<filename>: per ricevere un file dal server digitare" , CYAN);
+    Printer::printTag("  rf | retrive-file" , "<filename>: per ricevere un file dal server digitare (riprende un download interrotto)" , CYAN);
+    Printer::printTag("  ri |retrive-changed" , "<filename>: retrive <filename> unless the local copy already has the same bytes" , CYAN);
+    Printer::printTag("  rg |retrive-range" , "<filename> <offset>:<length>... [-]: only the given ranges of <filename> (negative offset: from the end, no length: to the end), written at their offsets of the local file or to stdout with -" , CYAN);
     Printer::printTag("quit |     exit | q" , ": for closing the program" , CYAN);
     Printer::printNormal("\n");
     
 }
 
+bool connectToServer()
+{
+    // a busy server tells how long to wait: honour it, doubling the wait on
+    // every refusal and adding jitter so rejected clients do not come back together
+    unsigned int backoff = 0;
+
+    for (int attempt = 1; attempt <= MAX_CONNECTION_ATTEMPTS; attempt++)
+    {
+        if (!_client->serverTCPconnection())
+        {
+            Printer::printError("connect(): Failed connect to the server.");
+            return false;
+        }
+
+        try
+        {
+            Printer::printInfo((char*)"Establishing secure connection with the server");
+            _secureConnection->establishConnectionClient();
+            return true;
+        }
+        catch (const CookieRequiredException &cre)
+        {
+            // at once: the cookie is only good for a few seconds
+            _client->closeConnection();
+            Printer::printInfo((char*)"Server under load, connecting again with its cookie");
+        }
+        catch (const ServerBusyException &sbe)
+        {
+            _client->closeConnection();
+
+            backoff = (backoff * 2 > sbe.retryAfterMs) ? backoff * 2 : sbe.retryAfterMs;
+            if (backoff > MAX_BACKOFF)
+                backoff = MAX_BACKOFF;
+
+            unsigned int jitter;
+            RAND_bytes((unsigned char*)&jitter, sizeof(jitter));
+            unsigned int wait = backoff + jitter % (backoff / 2 + 1);
+
+            stringstream mess;
+            mess << "Server busy, retrying in " << wait << " ms (attempt " << attempt << "/" << MAX_CONNECTION_ATTEMPTS << ")";
+            Printer::printWaring(mess.str().c_str());
+            usleep(wait * 1000);
+        }
+        catch (const std::exception &e)
+        {
+            Printer::printErrorWithReason("Secure connection with server failed:",e.what());
+            return false;
+        }
+    }
+
+    Printer::printError("Server still busy, giving up");
+    return false;
+}
+
+// with CAP_MULTIPLEX each command runs on a stream of its own: a transfer
+// goes on in the background (no load bar) while the prompt takes the next command
+void runCommand(string name, function<void(SecureConnection *, bool)> command, bool transfer)
+{
+    if (_mux == NULL)
+    {
+        command(_secureConnection, true);
+        return;
+    }
+
+    MuxStream *stream = _mux->openStream();
+    SecureConnection *connection = _secureConnection->openStream(stream);
+    if (!transfer)
+    {
+        try
+        {
+            command(connection, true);
+        }
+        catch (...)
+        {
+            delete connection;
+            _mux->closeStream(stream);
+            throw;
+        }
+        delete connection;
+        _mux->closeStream(stream);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(_transfersMutex);
+        _transfers++;
+    }
+    Printer::printInfo(string("'" + name + "' goes on in the background").c_str());
+
+    thread([name, command, connection, stream]
+    {
+        try
+        {
+            command(connection, false);
+            Printer::printInfo(string("'" + name + "' ended").c_str());
+        }
+        catch (const exception &e)
+        {
+            Printer::printErrorWithReason(string("'" + name + "' failed").c_str(), e.what());
+        }
+        delete connection;
+        _mux->closeStream(stream);
+
+        lock_guard<mutex> lock(_transfersMutex);
+        _transfers--;
+        _transferEnded.notify_all();
+    }).detach();
+}
+
 void quitCommand()
 {
+    if (_mux != NULL)
+    {
+        unique_lock<mutex> lock(_transfersMutex);
+        if (_transfers > 0)
+            Printer::printInfo("Waiting for the transfers still running");
+        _transferEnded.wait(lock, [] { return _transfers == 0; });
+        lock.unlock();
+
+        delete _mux;
+        _mux = NULL;
+    }
+
     _client->closeConnection();
     Printer::printNormal("Closing program.. \n\n");
 }
@@ -244,13 +689,13 @@ int main(int num_args, char *args[])
     // 0 comando
     // 1 parametro indirizzo ip;
     // 2 parametro numero di porta;
-    // 3 nome file da trasferire;
+    // 3 opzionale: integrity-only, record firmati ma non cifrati;
 
     /*LETTURA PARAMETRI*/
-    if (num_args != 3)
+    if ((num_args != 3 && num_args != 4) || (num_args == 4 && string(args[3]) != "integrity-only"))
     {
         Printer::printError("Number of parameters are not valid.");
-        Printer::printNormal(string("Usage: " + string(args[0]) + " <ipServer> <SERVER_PORT_#>").c_str());
+        Printer::printNormal(string("Usage: " + string(args[0]) + " <ipServer> <SERVER_PORT_#> [integrity-only]").c_str());
         Printer::printNormal("Closing program...\n\n");
         return -1;
     }
@@ -268,30 +713,34 @@ int main(int num_args, char *args[])
     }
     // end parameter read
 
+    signal(SIGPIPE, SIG_IGN);
+
+    _hashCache = new HashCache(HASH_CACHE_ENTRIES);
+    _hashCache->load(HASH_CACHE_FILE);
+
     _client = new ClientTCP(ipServer.c_str(), portNumber);
+    _secureConnection = new SecureConnection(_client);
+    _secureConnection->setAllowedCapabilities(CAP_KERNEL_TLS | CAP_CHUNK_STORE | CAP_COMPRESSION | CAP_MULTIPLEX | CAP_BINARY_COMMANDS);
+    if (num_args == 4)
+    {
+        // trusted networks only: the server decides whether to accept it
+        _secureConnection->setAllowedCapabilities(CAP_KERNEL_TLS | CAP_CHUNK_STORE | CAP_COMPRESSION | CAP_MULTIPLEX | CAP_BINARY_COMMANDS | CAP_INTEGRITY_ONLY);
+    }
 
-    if (!_client->serverTCPconnection())
+    if (!connectToServer())
     {
-        Printer::printError("connect(): Failed connect to the server.");
         return -1;
     }
+
+    _mux = NULL;
+    _transfers = 0;
+    if (_secureConnection->getCapabilities() & CAP_MULTIPLEX)
+        _mux = new Multiplexer(_client, false, _secureConnection->copyRecordKeys());
     
     stringstream mess;
     mess << "Successfull connected to the server " << ipServer  << " (PORT: " << portNumber << ")";
     Printer::printMsg(mess.str().c_str())  ;
 
-    _secureConnection = new SecureConnection(_client);
-
-    try
-    {
-        Printer::printInfo((char*)"Establishing secure connection with the server");
-        _secureConnection->establishConnectionClient();
-    }
-    catch (const std::exception &e)
-    {
-        Printer::printErrorWithReason("Secure connection with server failed:",e.what());
-        return -1;
-    }
     Printer::printMsg("Secure connection established\n");
 
     string command;
@@ -312,16 +761,39 @@ int main(int num_args, char *args[])
             if (command == "u" || command == "upload")
             {
                 cin >> argument;
-                uploadCommand(argument);
+                runCommand(command + " " + argument, [argument](SecureConnection *connection, bool stars) { uploadCommand(connection, argument, stars); }, true);
+            }
+            if (command == "ui" || command == "upload-changed")
+            {
+                cin >> argument;
+                runCommand(command + " " + argument, [argument](SecureConnection *connection, bool stars) { conditionalUploadCommand(connection, argument, stars); }, true);
+            }
+            if (command == "ud" || command == "upload-delta")
+            {
+                cin >> argument;
+                runCommand(command + " " + argument, [argument](SecureConnection *connection, bool stars) { deltaUploadCommand(connection, argument, stars); }, true);
             }
             if (command == "rl" || command == "retrive-list")
             {
-                retriveListCommand();
+                runCommand(command, [](SecureConnection *connection, bool stars) { retriveListCommand(connection); }, false);
             }
             if (command == "rf" || command == "retrive-file")
             {
                 cin >> argument;
-                retriveFileCommand(argument);
+                runCommand(command + " " + argument, [argument](SecureConnection *connection, bool stars) { retriveFileCommand(connection, argument, stars); }, true);
+            }
+            if (command == "ri" || command == "retrive-changed")
+            {
+                cin >> argument;
+                runCommand(command + " " + argument, [argument](SecureConnection *connection, bool stars) { conditionalRetriveCommand(connection, argument, stars); }, true);
+            }
+            if (command == "rg" || command == "retrive-range")
+            {
+                cin >> argument;
+                string ranges;
+                getline(cin, ranges);
+                runCommand(command + " " + argument, [argument, ranges](SecureConnection *connection, bool stars) { retriveRangesCommand(connection, argument, ranges); }, true);
+                continue;
             }
             if (command == "h" || command == "help")
             {
@@ -351,5 +823,6 @@ int main(int num_args, char *args[])
         Printer::printNormal("Closing program...\n\n");
     }
 
+    _hashCache->save(HASH_CACHE_FILE);
     return 0;
 }
\ No newline at end of file
@@ -1,28 +1,130 @@
 #include "SecureConnection.h"
 #include "Sanitizator.h"
 #include "ServerTCP.h"
+#include "SessionTCP.h"
+#include "WorkerPool.h"
+#include "CookieValidator.h"
+#include "ConcurrencyLimiter.h"
+#include "FileCache.h"
+#include "HashCache.h"
+#include "Settings.h"
+#include "Metrics.h"
+#include "Multiplexer.h"
 #include "Printer.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <map>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define SETTINGS_FILE "settings.conf"
+#define UPLOAD_DIR "uploadedFiles"
+
+// defaults, each one can be overridden in SETTINGS_FILE
+#define LISTEN_BACKLOG 128
+#define MAX_SESSIONS 256
+#define MAX_HANDSHAKES 64
+#define MAX_TRANSFERS 32
+#define BUSY_RETRY_AFTER 500 //milliseconds suggested to a rejected client
+#define HANDSHAKE_TIMEOUT 10 //seconds a client has to complete each handshake step
+#define COOKIE_LOAD_THRESHOLD 32 //handshakes in progress above which clients must reconnect with a cookie
+#define METRICS_FILE "metrics.txt"
+#define METRICS_INTERVAL 5 //seconds between two metrics exports
+#define KERNEL_TLS_ENABLED 0 //offer kernel TLS record protection (and sendfile) to clients
+#define INTEGRITY_ONLY_ENABLED 0 //let clients ask for signed but unencrypted records
+#define INTEGRITY_ONLY_NAMES "" //certificate subjects allowed to, one per line (empty: every allowed client)
+#define FILE_CACHE_SIZE 268435456 //bytes of file contents kept in memory for rf (0: no cache)
+#define FILE_CACHE_MAX_FILE 8388608 //bigger files are always read from disk
+#define DURABILITY_MODE "none" //none, file or group (see Durability.h)
+#define GROUP_COMMIT_WINDOW 5 //milliseconds a group commit of several uploads waits for more to join
+#define RESUME_TTL 86400 //seconds an interrupted upload can still be resumed (0: forever)
+#define RESUME_SWEEP_INTERVAL 3600 //seconds between two removals of the expired ones
+#define CHUNK_STORE_ENABLED 0 //keep uploads as deduplicated chunks (see ChunkStore.h) instead of full copies
+#define COMPRESSION_ENABLED 0 //let clients have file bodies compressed (see RecordCompressor.h)
+#define MULTIPLEX_ENABLED 0 //let clients run several commands at once (see Multiplexer.h)
 
 using namespace std;
 
-SecureConnection *_secureConnection;
+struct ClientSession
+{
+	SessionTCP *tcp;
+	SecureConnection *secureConnection;
+	MuxStream *stream; // NULL: not a multiplexed session, or its session connection
+	bool connected;
+};
+
 ServerTCP *_server;
-int _activeSocket;
+CertificationValidator *_certVal;
+// RSA/DH work of the handshakes runs here, the waits on the network stay in
+// each handshake's own thread
+WorkerPool *_handshakePool;
+CookieValidator *_cookieVal;
 
-void disconnectClient()
+ConcurrencyLimiter *_sessionSlots;
+ConcurrencyLimiter *_handshakeSlots;
+ConcurrencyLimiter *_transferSlots;
+
+long _busyRetryAfter;
+long _handshakeTimeout;
+long _cookieLoadThreshold;
+uint32_t _sessionCapabilities;
+int _compressionLevel;
+set<string> *_integrityOnlyPeers;
+CachePolicy _cachePolicy;
+FileCache *_fileCache;
+Durability *_durability;
+ChunkStore *_chunkStore; // NULL: every upload is a full copy in UPLOAD_DIR
+HashCache *_hashCache;
+
+void disconnectClient(ClientSession &session)
 {
-	_server->forceClientDisconnection();
-	_secureConnection->destroyKeys();
-	_activeSocket = -1;
+	// only the command fails, the other streams go on
+	if (session.stream != NULL)
+	{
+		session.secureConnection->destroyKeys();
+		session.connected = false;
+		Printer::printInfo((char*)"Stream closed");
+		return;
+	}
+
+	session.tcp->closeConnection();
+	session.secureConnection->destroyKeys();
+	session.connected = false;
 	Printer::printInfo((char*)"Client Disconnected");
 }
 
-void uploadCommand(string fileName, unsigned long nonce)
+void storeUpload(const string &pathFileName, const string &fileName)
 {
+	if (_chunkStore == NULL)
+		return;
+
+	// a failure leaves the upload as a full copy, still served as it is
+	try
+	{
+		uint64_t newBytes = _chunkStore->ingest(pathFileName, fileName);
+		Metrics::add("chunk_store_new_bytes_total", newBytes);
+
+		stringstream mess;
+		mess << newBytes << " bytes of the file were not in the chunk store yet";
+		Printer::printInfo(mess.str().c_str());
+	}
+	catch (const ChunkStoreException &cse)
+	{
+		Printer::printErrorWithReason("Not possible move the file in the chunk store", cse.what());
+	}
+}
+
+void uploadCommand(ClientSession &session, string fileName, unsigned long nonce, bool resumable)
+{
+	bool validName = true;
 	try
 	{
 		Sanitizator::checkFilename(fileName.c_str());
@@ -30,74 +132,237 @@ void uploadCommand(string fileName, unsigned long nonce)
 	catch (const exception &e)
 	{
 		Printer::printError(e.what());
-		return;
+		validName = false;
 	}
 
-	string cmd;
-	system("/bin/mkdir -p uploadedFiles");
-	string tmpFile = "tmp.txt";
+	// received straight into UPLOAD_DIR, the name appears only once the file is complete
+	string pathFileName = string(UPLOAD_DIR) + "/" + fileName;
+
+	// an upload of the same name already running owns the journal: this one
+	// starts from scratch and keeps nothing if it fails
+	ResumeJournal journal(pathFileName.c_str());
+	bool ownJournal = validName && journal.lock();
 
 	try
 	{
-		_secureConnection->receiveFile(tmpFile.c_str(), true, nonce);
+		try
+		{
+			if (resumable)
+			{
+				// what is left of an interrupted upload of this file, if anything
+				ResumePoint resume = {0, 0, 0};
+				if (!ownJournal || !journal.load(resume))
+					resume = {0, 0, 0};
+
+				nonce += 1;
+				session.secureConnection->sendResumePoint(resume, nonce);
+			}
+			if (validName)
+				session.secureConnection->receiveFile(pathFileName.c_str(), true, nonce, journal, ownJournal);
+		}
+		catch (...)
+		{
+			if (ownJournal)
+				journal.unlock();
+			throw;
+		}
+		if (ownJournal)
+			journal.unlock();
+		if (!validName)
+			return;
 	}
 	catch (const NetworkException &ne)
 	{
 		Printer::printError((char*)"A network error has occured downloading the file");
-		cmd = "/bin/rm " + tmpFile;
-		system(cmd.c_str());
-		disconnectClient();
+		disconnectClient(session);
 		return;
 	}
 	catch (const HashNotValidException &hnve)
 	{
 		Printer::printErrorWithReason((char*)"Failed to download a part of the file", (char*)"Hash not valid");
-		cmd = "/bin/rm " + tmpFile;
-		system(cmd.c_str());
-		disconnectClient();
+		disconnectClient(session);
+		return;
+	}
+	catch (const FileNotOpenException &fnoe)
+	{
+		// the client has already sent the whole file, the session is out of step
+		Printer::printErrorWithReason((char*)"Not possible store the file", fnoe.what());
+		disconnectClient(session);
+		return;
+	}
+	catch (const ResumedFileMismatchException &rfme)
+	{
+		Printer::printError(rfme.what());
 		return;
 	}
 
-	cmd = "/bin/mv " + tmpFile + " uploadedFiles/" + fileName;
-	system(cmd.c_str());
+	// a new version is published, the cached one must not be served anymore
+	_fileCache->invalidate(pathFileName);
+	storeUpload(pathFileName, fileName);
 }
 
-void retriveListCommand(unsigned long nonce)
+void chunkUploadCommand(ClientSession &session, string fileName, unsigned long nonce)
 {
-	Printer::printInfo((char*) "Creating List");
-	system("/bin/ls -sh1 uploadedFiles/ > fileList.txt");
+	try
+	{
+		Sanitizator::checkFilename(fileName.c_str());
+	}
+	catch (const exception &e)
+	{
+		// the client sends its chunk list anyway, the session cannot go on
+		Printer::printError(e.what());
+		disconnectClient(session);
+		return;
+	}
 
-	ifstream readFile;
+	string pathFileName = string(UPLOAD_DIR) + "/" + fileName;
 
-	readFile.open("fileList.txt", ios::in | ios::binary);
-	if (!readFile.is_open())
+	try
 	{
-		Printer::printError((char*)"Could not open the file");
-		readFile.close();
+		session.secureConnection->receiveFileChunks(_chunkStore, fileName, true, nonce);
+	}
+	catch (const NetworkException &ne)
+	{
+		Printer::printError((char*)"A network error has occured downloading the file");
+		disconnectClient(session);
+		return;
+	}
+	catch (const HashNotValidException &hnve)
+	{
+		Printer::printErrorWithReason((char*)"Failed to download a part of the file", (char*)"Hash not valid");
+		disconnectClient(session);
+		return;
+	}
+	catch (const FileHeaderException &fhe)
+	{
+		Printer::printErrorWithReason((char*)"Not valid chunk list", fhe.what());
+		disconnectClient(session);
+		return;
+	}
+	catch (const ChunkMismatchException &cme)
+	{
+		Printer::printError(cme.what());
+		disconnectClient(session);
+		return;
+	}
+	catch (const FileNotOpenException &fnoe)
+	{
+		Printer::printErrorWithReason((char*)"Not possible store the file", fnoe.what());
+		disconnectClient(session);
 		return;
 	}
 
+	// a full copy left from before would hide the new version
+	unlink(pathFileName.c_str());
+	_fileCache->invalidate(pathFileName);
+}
+
+void deltaUploadCommand(ClientSession &session, string fileName, unsigned long nonce)
+{
 	try
 	{
-		_secureConnection->sendFile(readFile, false, nonce);
+		Sanitizator::checkFilename(fileName.c_str());
+	}
+	catch (const exception &e)
+	{
+		// the client waits for the signatures, the session cannot go on
+		Printer::printError(e.what());
+		disconnectClient(session);
+		return;
+	}
+
+	string pathFileName = string(UPLOAD_DIR) + "/" + fileName;
+
+	// a stored file is rebuilt from its chunks to be the basis, the full copy is used as it is
+	MappedFile *basis = NULL;
+	if (_chunkStore != NULL && access(pathFileName.c_str(), F_OK) != 0)
+		basis = _chunkStore->assemble(fileName, pathFileName);
+
+	try
+	{
+		try
+		{
+			if (basis != NULL)
+				session.secureConnection->receiveFileDelta(pathFileName.c_str(), basis, true, nonce);
+			else
+				session.secureConnection->receiveFileDelta(pathFileName.c_str(), true, nonce);
+		}
+		catch (...)
+		{
+			delete basis;
+			throw;
+		}
+		delete basis;
 	}
 	catch (const NetworkException &ne)
 	{
-		Printer::printError((char*)"A network error has occured sending the file list");
-		disconnectClient();
+		Printer::printError((char*)"A network error has occured downloading the file");
+		disconnectClient(session);
+		return;
 	}
-	catch (const SecureConnectionException &sce)
+	catch (const HashNotValidException &hnve)
 	{
-		Printer::printError(sce.what());
-		disconnectClient();
+		Printer::printErrorWithReason((char*)"Failed to download a part of the file", (char*)"Hash not valid");
+		disconnectClient(session);
+		return;
+	}
+	catch (const FileHeaderException &fhe)
+	{
+		Printer::printErrorWithReason((char*)"Not possible rebuild the file", fhe.what());
+		disconnectClient(session);
+		return;
+	}
+	catch (const FileNotOpenException &fnoe)
+	{
+		Printer::printErrorWithReason((char*)"Not possible store the file", fnoe.what());
+		disconnectClient(session);
+		return;
+	}
+	catch (const DeltaMismatchException &dme)
+	{
+		Printer::printError(dme.what());
+		return;
 	}
 
-	system("/bin/rm fileList.txt");
+	_fileCache->invalidate(pathFileName);
+	storeUpload(pathFileName, fileName);
+}
 
-	Printer::printInfo((char*)"FileList sended");
+bool sameContent(const string &fileName, uint64_t size, const unsigned char *digest)
+{
+	string pathFileName = string(UPLOAD_DIR) + "/" + fileName;
+	uint64_t storedSize;
+	unsigned char stored[HASH_CACHE_DIGEST_SIZE];
+
+	// files of another size differ without hashing anything
+	struct stat fileStat;
+	if (stat(pathFileName.c_str(), &fileStat) == 0)
+	{
+		if ((uint64_t)fileStat.st_size != size || !_hashCache->digest(pathFileName, storedSize, stored))
+			return false;
+	}
+	else if (_chunkStore != NULL)
+	{
+		vector<ChunkRef> chunks;
+		if (!_chunkStore->loadManifest(fileName, storedSize, chunks) || storedSize != size)
+			return false;
+
+		auto compute = [&fileName](uint64_t &fileSize, unsigned char *fileDigest)
+		{
+			return _chunkStore->digestFile(fileName, fileSize, fileDigest);
+		};
+		if (!_hashCache->digest(_chunkStore->getManifestPath(fileName), storedSize, stored, compute))
+			return false;
+	}
+	else
+	{
+		return false;
+	}
+
+	return storedSize == size && CRYPTO_memcmp(stored, digest, HASH_CACHE_DIGEST_SIZE) == 0;
 }
 
-void retriveFileCommand(string fileName, unsigned long nonce)
+void conditionalUploadCommand(ClientSession &session, string fileName, unsigned long nonce, uint64_t size, const unsigned char *digest)
 {
 	try
 	{
@@ -106,124 +371,568 @@ void retriveFileCommand(string fileName, unsigned long nonce)
 	catch (const exception &e)
 	{
 		Printer::printError(e.what());
+		disconnectClient(session);
+		return;
+	}
+
+	bool same = sameContent(fileName, size, digest);
+	session.secureConnection->sendContentAnswer(same, nonce);
+	if (same)
+	{
+		Printer::printInfo("Same file already stored, nothing to receive");
+		Metrics::increment("conditional_not_modified_total");
 		return;
 	}
 
-	string pathFileName = "uploadedFiles/" + fileName;
+	// as the client, which knows CAP_CHUNK_STORE too
+	if (_chunkStore != NULL)
+		chunkUploadCommand(session, fileName, nonce);
+	else
+		uploadCommand(session, fileName, nonce, true);
+}
 
-	ifstream readFile;
-	readFile.open(pathFileName.c_str(), ios::in | ios::binary);
-	if (!readFile.is_open())
+string formatSize(off_t size)
+{
+	// as ls -h does
+	const char *units = "BKMGTP";
+	double value = size;
+	int unit = 0;
+	while (value >= 1024 && unit < 5)
 	{
-		Printer::printWaring("not possible open the file or the file demanded doesn't exist");
+		value /= 1024;
+		unit++;
+	}
 
-		// saying to client that file does not exists
-		string strFileSize = to_string((long)-1);
-		_secureConnection->sendSecureMsg((void *)strFileSize.c_str(), strFileSize.length() + 1, true, nonce);
+	char formatted[16];
+	if (unit == 0)
+		snprintf(formatted, sizeof(formatted), "%ld", (long)size);
+	else if (value < 10)
+		snprintf(formatted, sizeof(formatted), "%.1f%c", value, units[unit]);
+	else
+		snprintf(formatted, sizeof(formatted), "%.0f%c", value, units[unit]);
+	return formatted;
+}
 
+string listUploadedFiles()
+{
+	vector<string> names;
+	DIR *dir = opendir(UPLOAD_DIR);
+	if (dir != NULL)
+	{
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL)
+		{
+			// hidden entries include the uploads still in progress
+			if (entry->d_name[0] != '.')
+				names.push_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+
+	vector<pair<string, uint64_t>> stored;
+	if (_chunkStore != NULL)
+		_chunkStore->listFiles(stored);
+	map<string, uint64_t> sizes;
+	for (size_t i = 0; i < stored.size(); i++)
+	{
+		sizes[stored[i].first] = stored[i].second;
+		names.push_back(stored[i].first);
+	}
+
+	sort(names.begin(), names.end());
+	names.erase(unique(names.begin(), names.end()), names.end());
+
+	stringstream list;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		// a full copy is the one served, as in retriveFileCommand
+		struct stat fileStat;
+		string path = string(UPLOAD_DIR) + "/" + names[i];
+		if (stat(path.c_str(), &fileStat) == 0 && S_ISREG(fileStat.st_mode))
+			list << formatSize(fileStat.st_size) << " " << names[i] << "\n";
+		else if (sizes.count(names[i]) > 0)
+			list << formatSize(sizes[names[i]]) << " " << names[i] << "\n";
+	}
+	return list.str();
+}
+
+void retriveListCommand(ClientSession &session, unsigned long nonce)
+{
+	Printer::printInfo((char*) "Creating List");
+	string list = listUploadedFiles();
+
+	try
+	{
+		session.secureConnection->sendBigMessage(list.c_str(), list.size(), nonce);
+	}
+	catch (const NetworkException &ne)
+	{
+		Printer::printError((char*)"A network error has occured sending the file list");
+		disconnectClient(session);
+		return;
+	}
+	catch (const SecureConnectionException &sce)
+	{
+		Printer::printError(sce.what());
+		disconnectClient(session);
 		return;
 	}
 
+	Printer::printInfo((char*)"FileList sended");
+}
+
+void retriveFileCommand(ClientSession &session, string fileName, unsigned long nonce, const ResumePoint *resume)
+{
 	try
 	{
-		_secureConnection->sendFile(readFile, true, nonce);
+		Sanitizator::checkFilename(fileName.c_str());
+	}
+	catch (const exception &e)
+	{
+		Printer::printError(e.what());
+		return;
+	}
+
+	string pathFileName = string(UPLOAD_DIR) + "/" + fileName;
+
+	try
+	{
+		// hot files are served from memory, the others from disk through the
+		// file the cache opened for its miss
+		MappedFile *file;
+		uint64_t fingerprint;
+		shared_ptr<const string> cached = _fileCache->get(pathFileName, file, fingerprint);
+		if (cached)
+			session.secureConnection->sendFile(cached->data(), cached->size(), fingerprint, true, nonce, resume);
+		else if (file != NULL)
+		{
+			try
+			{
+				session.secureConnection->sendFile(file, true, nonce, resume);
+			}
+			catch (...)
+			{
+				delete file;
+				throw;
+			}
+			delete file;
+		}
+		else if (_chunkStore != NULL && access(pathFileName.c_str(), F_OK) != 0)
+			session.secureConnection->sendStoredFile(_chunkStore, fileName, true, nonce, resume);
+		else
+			session.secureConnection->sendFile(pathFileName.c_str(), true, nonce, resume);
+	}
+	catch (const FileNotOpenException &fnoe)
+	{
+		Printer::printWaring("not possible open the file or the file demanded doesn't exist");
+
+		// saying to client that file does not exists
+		session.secureConnection->sendFileNotFound(nonce);
 	}
 	catch (const NetworkException &ne)
 	{
 		Printer::printError("A network error has occured sendig the file");
-		disconnectClient();
+		disconnectClient(session);
 	}
 	catch (const ErrorOnOtherPartException &eope)
 	{
 		Printer::printErrorWithReason("Failed to upload a part of the file", "Hash not valid");
-		disconnectClient();
+		disconnectClient(session);
 	}
-
-	readFile.close();
 }
 
-stringstream receiveCommad()
+void conditionalRetriveCommand(ClientSession &session, string fileName, unsigned long nonce, uint64_t size, const unsigned char *digest)
 {
-	stringstream res;
-	char *command;
-	int bytesRecived;
+	bool validName = true;
+	try
+	{
+		Sanitizator::checkFilename(fileName.c_str());
+	}
+	catch (const exception &e)
+	{
+		validName = false;
+	}
 
-	bytesRecived = _secureConnection->recvSecureMsg((void **)&command, false, 0);
+	if (validName && sameContent(fileName, size, digest))
+	{
+		Printer::printInfo("The client has the same file, nothing to send");
+		Metrics::increment("conditional_not_modified_total");
+		session.secureConnection->sendFileNotModified(nonce);
+		return;
+	}
+	retriveFileCommand(session, fileName, nonce, NULL);
+}
 
-	res << command;
+void retriveRangesCommand(ClientSession &session, string fileName, unsigned long nonce, const vector<FileRange> &ranges)
+{
+	try
+	{
+		Sanitizator::checkFilename(fileName.c_str());
+	}
+	catch (const exception &e)
+	{
+		Printer::printError(e.what());
+		return;
+	}
 
-	delete command;
+	string pathFileName = string(UPLOAD_DIR) + "/" + fileName;
 
-	return res;
+	try
+	{
+		Metrics::increment("range_requests_total");
+		if (_chunkStore != NULL && access(pathFileName.c_str(), F_OK) != 0)
+			session.secureConnection->sendStoredFileRanges(_chunkStore, fileName, ranges, nonce);
+		else
+			session.secureConnection->sendFileRanges(pathFileName.c_str(), ranges, nonce);
+	}
+	catch (const FileNotOpenException &fnoe)
+	{
+		Printer::printWaring("not possible open the file or the file demanded doesn't exist");
+		session.secureConnection->sendFileNotFound(nonce);
+	}
+	catch (const NetworkException &ne)
+	{
+		Printer::printError("A network error has occured sendig the ranges");
+		disconnectClient(session);
+	}
 }
 
-void manageConnection()
+void manageConnection(ClientSession &session)
 {
-	stringstream commandStream;
 	string command;
 	string filename;
+	unsigned long nonce;
 
 	Printer::printInfo("Ready to receive a command");
 	try
 	{
-		commandStream = receiveCommad();
+		// the file name comes with the command
+		nonce = session.secureConnection->recvCommand(command, filename);
 	}
 	catch (const NetworkException &ne)
 	{
 		Printer::printError("A network error has occured reeceiving the command");
-		disconnectClient();
+		disconnectClient(session);
 		return;
 	}
 	catch (const SecureConnectionException &se)
 	{
 		Printer::printError(se.what());
-		disconnectClient();
+		disconnectClient(session);
 		return;
 	}
 	
-	commandStream >> command;
 	stringstream mess;
 	mess<<"\n[COMMAND] '"<<command<<"'";
 	Printer::printMsg(mess.str().c_str());
 
-	unsigned long nonceServer = _secureConnection->generateNonce();
-	unsigned long nonceClient;
-	unsigned long nonce;
-	commandStream>>nonceClient;
+	// ur and rr: the transfer may go on from where an earlier one stopped
+	if (command == "u" || command == "ur")
+	{
+		_transferSlots->acquire();
+		try
+		{
+			uploadCommand(session, filename, nonce, command == "ur");
+		}
+		catch (...)
+		{
+			_transferSlots->release();
+			throw;
+		}
+		_transferSlots->release();
+	}
+	// uc: only offered with CAP_CHUNK_STORE
+	if (command == "uc" && _chunkStore != NULL)
+	{
+		_transferSlots->acquire();
+		try
+		{
+			chunkUploadCommand(session, filename, nonce);
+		}
+		catch (...)
+		{
+			_transferSlots->release();
+			throw;
+		}
+		_transferSlots->release();
+	}
+	// ui and ri: nothing moves if both sides hold the same bytes
+	if (command == "ui" || command == "ri")
+	{
+		uint64_t size;
+		unsigned char digest[CONTENT_HASH_SIZE];
+		nonce += 1;
+		session.secureConnection->recvContentHash(size, digest, nonce);
+		nonce += 1;
 
-	if (command == "u")
+		_transferSlots->acquire();
+		try
+		{
+			if (command == "ui")
+				conditionalUploadCommand(session, filename, nonce, size, digest);
+			else
+				conditionalRetriveCommand(session, filename, nonce, size, digest);
+		}
+		catch (...)
+		{
+			_transferSlots->release();
+			throw;
+		}
+		_transferSlots->release();
+	}
+	// ud: only the blocks that differ from the stored copy travel
+	if (command == "ud")
 	{
-		_secureConnection->sendSecureMsg((void*) &nonceServer, sizeof(unsigned long), true, nonceClient);
-		nonce = nonceClient + nonceServer;
+		_transferSlots->acquire();
+		try
+		{
+			deltaUploadCommand(session, filename, nonce);
+		}
+		catch (...)
+		{
+			_transferSlots->release();
+			throw;
+		}
+		_transferSlots->release();
+	}
+	if (command == "rl")
+	{
+		retriveListCommand(session, nonce);
+	}
+	if (command == "rg")
+	{
+		vector<FileRange> ranges;
+		nonce += 1;
+		session.secureConnection->recvRanges(ranges, nonce);
 
-		char* filenameBuf;
-		_secureConnection->recvSecureMsg((void**) &filenameBuf, true, nonce);
-		filename = string(filenameBuf);
+		_transferSlots->acquire();
+		try
+		{
+			retriveRangesCommand(session, filename, nonce, ranges);
+		}
+		catch (...)
+		{
+			_transferSlots->release();
+			throw;
+		}
+		_transferSlots->release();
+	}
+	if (command == "rf" || command == "rr")
+	{
+		ResumePoint resume;
+		if (command == "rr")
+		{
+			nonce += 1;
+			session.secureConnection->recvResumePoint(resume, nonce);
+		}
+		
+		_transferSlots->acquire();
+		try
+		{
+			retriveFileCommand(session, filename, nonce, command == "rr" ? &resume : NULL);
+		}
+		catch (...)
+		{
+			_transferSlots->release();
+			throw;
+		}
+		_transferSlots->release();
+	}
+}
 
-		delete filenameBuf;
+void serveStream(ClientSession session, Multiplexer *mux)
+{
+	try
+	{
+		manageConnection(session);
+	}
+	catch (const DisconnectionException &de)
+	{
+		Printer::printWaring("Client Disconnected");
+	}
+	catch (const NetworkException &ne)
+	{
+		Printer::printWaring("The client gave up the command");
+	}
+	catch (const exception &e)
+	{
+		// the keys are the session ones: the other streams must not go on either
+		Printer::printError("A unexpected error has occured");
+		Printer::printError(e.what());
+		session.tcp->shutdownConnection();
+	}
+
+	delete session.secureConnection;
+	mux->closeStream(session.stream);
+}
+
+void serveStreams(ClientSession &session)
+{
+	Multiplexer mux(session.tcp, true, session.secureConnection->copyRecordKeys());
 
-		uploadCommand(filename, nonce);
+	MuxStream *stream;
+	while ((stream = mux.acceptStream()) != NULL)
+	{
+		Metrics::increment("streams_opened_total");
+
+		ClientSession streamSession = session;
+		streamSession.stream = stream;
+		streamSession.secureConnection = session.secureConnection->openStream(stream);
+		thread(serveStream, streamSession, &mux).detach();
 	}
-	if (command == "rl")
+
+	// waits for the commands still running to end
+	Printer::printWaring("Client Disconnected");
+}
+
+void serveClient(ClientSession session)
+{
+	Printer::printInfo("New client connected");
+
+	if (session.secureConnection->getCapabilities() & CAP_MULTIPLEX)
 	{
-		_secureConnection->sendSecureMsg((void*) &nonceServer, sizeof(unsigned long),  true, nonceClient);
-		nonce = nonceClient + nonceServer;
-		unsigned char* grb;
-		_secureConnection->recvSecureMsg((void**) &grb, true, nonce);
-		delete grb;
-		retriveListCommand(nonce);
-	}
-	if (command == "rf")
-	{
-		_secureConnection->sendSecureMsg((void*) &nonceServer, sizeof(unsigned long),  true, nonceClient);
-		nonce = nonceClient + nonceServer;
-		char* filenameBuf;
-		_secureConnection->recvSecureMsg((void**) &filenameBuf, true, nonce);
-		filename = string(filenameBuf);
-		delete filenameBuf;
-		
-		retriveFileCommand(filename, nonce);
+		serveStreams(session);
+		session.tcp->closeConnection();
+		session.secureConnection->destroyKeys();
+		session.connected = false;
 	}
+
+	while (session.connected)
+	{
+		try
+		{
+			manageConnection(session);
+		}
+		catch (const DisconnectionException &de)
+		{
+			session.tcp->closeConnection();
+			session.secureConnection->destroyKeys();
+			session.connected = false;
+			Printer::printWaring("Client Disconnected");
+		}
+		catch (const exception &e)
+		{
+			Printer::printError("A unexpected error has occured");
+			Printer::printError(e.what());
+
+			disconnectClient(session);
+		}
+	}
+
+	delete session.secureConnection;
+	delete session.tcp;
+	_sessionSlots->release();
+}
+
+void handshakeClient(SessionTCP *tcp)
+{
+	ClientSession session;
+	session.tcp = tcp;
+	session.secureConnection = new SecureConnection(tcp, _certVal);
+	session.secureConnection->setAllowedCapabilities(_sessionCapabilities);
+	session.secureConnection->setIntegrityOnlyPeers(_integrityOnlyPeers);
+	session.secureConnection->setCachePolicy(_cachePolicy);
+	session.secureConnection->setDurability(_durability);
+	session.secureConnection->setCompressionLevel(_compressionLevel);
+	session.secureConnection->setCryptoRunner([](function<void()> task) { _handshakePool->run(task); });
+	session.stream = NULL;
+	session.connected = false;
+
+	// a client stalling in the middle of the handshake must not hold its slot forever
+	tcp->setRecvTimeout(_handshakeTimeout);
+	try
+	{
+		Printer::printInfo("Enstablishing secure connection with the client.");
+		session.secureConnection->establishConnectionServer();
+		session.connected = true;
+	}
+	catch(const CertificateNotValidException &cnve){
+		Printer::printErrorWithReason("Failed to establish a secure connection", cnve.what());
+	}
+	catch (const exception &e)
+	{
+		Printer::printErrorWithReason("Failed to establish a secure connection", e.what());
+	}
+	_handshakeSlots->release();
+
+	if (!session.connected)
+	{
+		Metrics::increment("handshake_failures_total");
+		tcp->closeConnection();
+		delete session.secureConnection;
+		delete tcp;
+		_sessionSlots->release();
+		return;
+	}
+	tcp->setRecvTimeout(0);
+	Printer::printMsg("Secure connection established");
+
+	serveClient(session);
+}
+
+void expireResumeJournals(long maxAge)
+{
+	for (;;)
+	{
+		int expired = ResumeJournal::expire(UPLOAD_DIR, maxAge);
+		if (expired > 0)
+		{
+			Metrics::add("resume_journals_expired_total", expired);
+			stringstream mess;
+			mess << expired << " interrupted uploads too old to be resumed removed";
+			Printer::printInfo(mess.str().c_str());
+		}
+		sleep(RESUME_SWEEP_INTERVAL);
+	}
+}
+
+void exportMetrics(string filename, long interval)
+{
+	for (;;)
+	{
+		sleep(interval);
+		Metrics::set("handshakes_queued", _handshakePool->pending());
+		Metrics::dump(filename.c_str());
+	}
+}
+
+set<string> *loadIntegrityOnlyPeers(string filename)
+{
+	// same format as names.txt: one certificate subject per line
+	ifstream is(filename.c_str());
+	if (!is.is_open())
+	{
+		return NULL;
+	}
+
+	set<string> *peers = new set<string>();
+	string name;
+	while (getline(is, name))
+	{
+		if (!name.empty())
+			peers->insert(name);
+	}
+	is.close();
+
+	return peers;
+}
+
+// the first message of the connection is a hello with a cookie this server
+// sent to the same address; it stays in the socket for the handshake
+bool cookiePresented(int socket)
+{
+	unsigned char hello[BUFF_SIZE];
+	int helloLen = peekTCP(socket, hello, sizeof(hello));
+
+	const unsigned char *cookie;
+	return helloLen > 0 && SecureConnection::helloCookie(hello, helloLen, cookie) &&
+		   _cookieVal->verifyCookie(peerAddress(socket), cookie, COOKIE_SIZE);
+}
+
+void rejectClient(int socket, const char* reason)
+{
+	Metrics::increment(string("connections_rejected_") + reason + "_total");
+	_server->rejectConnection(socket, _busyRetryAfter);
 }
 
 int main(int num_args, char *args[])
@@ -253,64 +962,134 @@ int main(int num_args, char *args[])
 	}
 	// end check param
 
-	_server = new ServerTCP(portNumber);
+	// a client vanishing during sendfile() must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	if (mkdir(UPLOAD_DIR, 0755) < 0 && errno != EEXIST)
+	{
+		Printer::printErrorWithReason("Not possible create the upload directory", strerror(errno));
+		return -1;
+	}
+
+	Settings settings(SETTINGS_FILE);
+	_busyRetryAfter = settings.getLong("busy_retry_after_ms", BUSY_RETRY_AFTER);
+	_handshakeTimeout = settings.getLong("handshake_timeout", HANDSHAKE_TIMEOUT);
+	_cookieLoadThreshold = settings.getLong("cookie_load_threshold", COOKIE_LOAD_THRESHOLD);
+	long maxHandshakes = settings.getLong("max_handshakes", MAX_HANDSHAKES);
+	// nothing to trade off: any client that knows it gets it
+	_sessionCapabilities = CAP_BINARY_COMMANDS;
+	if (settings.getLong("kernel_tls", KERNEL_TLS_ENABLED))
+		_sessionCapabilities |= CAP_KERNEL_TLS;
+	_integrityOnlyPeers = NULL;
+	if (settings.getLong("integrity_only", INTEGRITY_ONLY_ENABLED))
+	{
+		_sessionCapabilities |= CAP_INTEGRITY_ONLY;
+
+		string namesFile = settings.getString("integrity_only_names", INTEGRITY_ONLY_NAMES);
+		if (!namesFile.empty())
+		{
+			_integrityOnlyPeers = loadIntegrityOnlyPeers(namesFile);
+			if (_integrityOnlyPeers == NULL)
+			{
+				Printer::printError("Not possible load the integrity only names");
+				return -1;
+			}
+		}
+	}
+	if (settings.getLong("compression", COMPRESSION_ENABLED))
+		_sessionCapabilities |= CAP_COMPRESSION;
+	_compressionLevel = settings.getLong("compression_level", COMPRESSION_LEVEL);
+	if (settings.getLong("multiplex", MULTIPLEX_ENABLED))
+		_sessionCapabilities |= CAP_MULTIPLEX;
+	_cachePolicy.readAheadWindow = settings.getLong("readahead_window", READ_AHEAD_WINDOW);
+	_cachePolicy.dropBehindThreshold = settings.getLong("drop_behind_threshold", DROP_BEHIND_THRESHOLD);
+	_cachePolicy.prefetchChunks = settings.getLong("prefetch_chunks", PREFETCH_CHUNKS);
+	int durabilityMode = Durability::parseMode(settings.getString("durability", DURABILITY_MODE));
+	_durability = new Durability(durabilityMode, settings.getLong("group_commit_window_ms", GROUP_COMMIT_WINDOW));
+	_chunkStore = NULL;
+	if (settings.getLong("chunk_store", CHUNK_STORE_ENABLED))
+	{
+		try
+		{
+			_chunkStore = new ChunkStore(UPLOAD_DIR, durabilityMode != DURABILITY_NONE);
+		}
+		catch (const ChunkStoreException &cse)
+		{
+			Printer::printErrorWithReason("Not possible open the chunk store", cse.what());
+			return -1;
+		}
+		_sessionCapabilities |= CAP_CHUNK_STORE;
+
+		// chunks of replaced files, before any upload can start
+		stringstream freed;
+		freed << _chunkStore->collectGarbage() << " bytes of unreferenced chunks removed from the store";
+		Printer::printInfo(freed.str().c_str());
+	}
+	_hashCache = new HashCache(settings.getLong("hash_cache_entries", HASH_CACHE_ENTRIES));
+	_fileCache = new FileCache(settings.getLong("file_cache_size", FILE_CACHE_SIZE), settings.getLong("file_cache_max_file", FILE_CACHE_MAX_FILE));
+
+	_sessionSlots = new ConcurrencyLimiter("sessions", settings.getLong("max_sessions", MAX_SESSIONS));
+	_handshakeSlots = new ConcurrencyLimiter("handshakes", maxHandshakes);
+	_transferSlots = new ConcurrencyLimiter("transfers", settings.getLong("max_transfers", MAX_TRANSFERS));
+
+	_server = new ServerTCP(portNumber, settings.getLong("listen_backlog", LISTEN_BACKLOG));
 
 	stringstream mess;
 	mess << "Succesfull listening on port " << portNumber;
 	Printer::printMsg(mess.str().c_str());
 
-	_secureConnection = new SecureConnection(_server);
+	try
+	{
+		_certVal = new CertificationValidator("certificateSettings/names.txt", "certificateSettings/CA_CybersecurityUniPi.pem");
+	}
+	catch (const exception &e)
+	{
+		Printer::printErrorWithReason("Not possible load the allowed names", e.what());
+		return -1;
+	}
+
+	_cookieVal = new CookieValidator();
+	_handshakePool = new WorkerPool(thread::hardware_concurrency(), maxHandshakes);
 
-	_activeSocket = -1;
+	thread(exportMetrics, settings.getString("metrics_file", METRICS_FILE), settings.getLong("metrics_interval", METRICS_INTERVAL)).detach();
+	long resumeTtl = settings.getLong("resume_ttl", RESUME_TTL);
+	if (resumeTtl > 0)
+		thread(expireResumeJournals, resumeTtl).detach();
+
+	Printer::printInfo("Waiting for connections");
 	for (;;)
 	{
-		Printer::printInfo("Waiting for a connection");
-		_activeSocket = _server->acceptNewConnecction();
-
-		try
+		int socket = _server->acceptNewConnecction();
+		if (socket < 0)
 		{
-			Printer::printInfo("Enstablishing secure connection with the client.");
-			_secureConnection->establishConnectionServer();
-		}
-		catch(const CertificateNotValidException &cnve){
-			Printer::printErrorWithReason("Failed to establish a secure connection", cnve.what());
-			_server->forceClientDisconnection();
 			continue;
 		}
-		catch (const exception &e)
+		Metrics::increment("connections_accepted_total");
+
+		// under load nothing is allocated nor any DH work done for a client
+		// until it comes back with a cookie, proving it is really there
+		if (_handshakeSlots->active() > _cookieLoadThreshold && !cookiePresented(socket))
 		{
-			Printer::printErrorWithReason("Failed to establish a secure connection", e.what());
+			Metrics::increment("cookies_sent_total");
+			_server->sendCookie(socket, _cookieVal->createCookie(peerAddress(socket)));
 			continue;
 		}
-		Printer::printMsg("Secure connection established");
 
-		if (_activeSocket >= 0)
+		// excess clients are told to come back later instead of hanging
+		if (!_sessionSlots->tryAcquire())
 		{
-			Printer::printInfo("New client connected");
+			rejectClient(socket, "sessions");
+			continue;
 		}
-
-		while (_activeSocket >= 0)
+		if (!_handshakeSlots->tryAcquire())
 		{
-			try
-			{
-				manageConnection();
-			}catch (const FileSizeException &fse){
-				Printer::printError(fse.what());
-			}
-			catch (const DisconnectionException &de)
-			{
-				_activeSocket = -1;
-				_secureConnection->destroyKeys();
-				Printer::printWaring("Client Disconnected");
-			}
-			catch (const exception &e)
-			{
-				Printer::printError("A unexpected error has occured");
-				Printer::printError(e.what());
-
-				disconnectClient();
-			}
+			_sessionSlots->release();
+			rejectClient(socket, "handshakes");
+			continue;
 		}
+
+		// the thread waits on the client, only the crypto goes to the pool
+		thread(handshakeClient, new SessionTCP(socket)).detach();
 	}
 	return 0;
 }
@@ -1,27 +1,106 @@
 #include "socket_lib.h"
 #include <arpa/inet.h>	//standard per l'ordine dei byte
 #include <stdlib.h> 
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 //#include <iostream>
 
 
 
+void setNoDelay(int socket){
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
 void sendTCP(int sendSocket, void *buffer, size_t bufferSize){
     uint16_t standardSize;
-    int numberOfBytes;
+    ssize_t numberOfBytes;
     
     standardSize = htons(bufferSize);
     
-    //invio numero di dati
-    numberOfBytes = send(sendSocket,(void*)&standardSize, sizeof(uint16_t),0);
+    //size and data in one segment: two sends of a short message wait for the peer ACK
+    struct iovec parts[2];
+    parts[0].iov_base = &standardSize;
+    parts[0].iov_len = sizeof(uint16_t);
+    parts[1].iov_base = buffer;
+    parts[1].iov_len = bufferSize;
+
+    struct msghdr msg = {};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    numberOfBytes = sendmsg(sendSocket, &msg, MSG_NOSIGNAL);
     if(numberOfBytes == -1){
         throw DisconnectionException();
     }
-    
-    //invio dati
-    numberOfBytes = send(sendSocket, (void*)buffer, bufferSize, 0);
-    if(numberOfBytes == -1){
-        throw DisconnectionException();
+
+    //what the socket buffer could not take at once
+    size_t sended = numberOfBytes;
+    if(sended < sizeof(uint16_t)){
+        sendRawTCP(sendSocket, (char*)&standardSize + sended, sizeof(uint16_t) - sended);
+        sended = sizeof(uint16_t);
+    }
+    if(sended < sizeof(uint16_t) + bufferSize){
+        sendRawTCP(sendSocket, (char*)buffer + sended - sizeof(uint16_t), sizeof(uint16_t) + bufferSize - sended);
+    }
+}
+
+//every part of msg, taking as many system calls as the socket buffer needs
+static void sendParts(int sendSocket, struct msghdr *msg){
+    while(msg->msg_iovlen > 0){
+        ssize_t numberOfBytes = sendmsg(sendSocket, msg, MSG_NOSIGNAL);
+        if(numberOfBytes <= 0){
+            throw DisconnectionException();
+        }
+
+        //skips what was taken, the rest goes with the next call
+        size_t sended = numberOfBytes;
+        while(msg->msg_iovlen > 0 && sended >= msg->msg_iov[0].iov_len){
+            sended -= msg->msg_iov[0].iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        if(msg->msg_iovlen > 0){
+            msg->msg_iov[0].iov_base = (char*)msg->msg_iov[0].iov_base + sended;
+            msg->msg_iov[0].iov_len -= sended;
+        }
+    }
+}
+
+void sendTCPBatch(int sendSocket, void **buffers, size_t *sizes, int count){
+    uint16_t standardSizes[TCP_BATCH_MAX];
+    struct iovec parts[2 * TCP_BATCH_MAX];
+    for(int i = 0; i < count; i++){
+        standardSizes[i] = htons(sizes[i]);
+        parts[2 * i].iov_base = &standardSizes[i];
+        parts[2 * i].iov_len = sizeof(uint16_t);
+        parts[2 * i + 1].iov_base = buffers[i];
+        parts[2 * i + 1].iov_len = sizes[i];
     }
+
+    struct msghdr msg = {};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2 * count;
+    sendParts(sendSocket, &msg);
+}
+
+void sendTCPWithHeader(int sendSocket, void *header, size_t headerSize, void *buffer, size_t bufferSize){
+    uint16_t standardSize = htons(headerSize + bufferSize);
+    struct iovec parts[3];
+    parts[0].iov_base = &standardSize;
+    parts[0].iov_len = sizeof(uint16_t);
+    parts[1].iov_base = header;
+    parts[1].iov_len = headerSize;
+    parts[2].iov_base = buffer;
+    parts[2].iov_len = bufferSize;
+
+    struct msghdr msg = {};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 3;
+    sendParts(sendSocket, &msg);
 }
 
 int recvTCP(int listenSocket, void** buffer){
@@ -59,5 +138,66 @@ int recvTCP(int listenSocket, void** buffer){
         throw NetworkException();
     }
 
+    return numberOfBytes;
+}
+
+void sendRawTCP(int sendSocket, const void *buffer, size_t bufferSize){
+    size_t sended = 0;
+    while(sended < bufferSize){
+        ssize_t numberOfBytes = send(sendSocket, (const char*)buffer + sended, bufferSize - sended, MSG_NOSIGNAL);
+        if(numberOfBytes <= 0){
+            throw DisconnectionException();
+        }
+        sended += numberOfBytes;
+    }
+}
+
+void recvRawTCP(int listenSocket, void *buffer, size_t bufferSize){
+    int numberOfBytes = recv(listenSocket, buffer, bufferSize, MSG_WAITALL);
+    if(numberOfBytes == 0){
+        throw DisconnectionException();
+    }
+    if(numberOfBytes < 0 || (size_t)numberOfBytes != bufferSize){
+        throw NetworkException();
+    }
+}
+
+int peekTCP(int listenSocket, void *buffer, size_t bufferSize){
+    ssize_t numberOfBytes = recv(listenSocket, buffer, bufferSize, MSG_PEEK | MSG_DONTWAIT);
+    if(numberOfBytes < (ssize_t)sizeof(uint16_t)){
+        return -1;
+    }
+
+    uint16_t standardSize;
+    memcpy(&standardSize, buffer, sizeof(uint16_t));
+    size_t messageSize = ntohs(standardSize);
+    if((size_t)numberOfBytes < sizeof(uint16_t) + messageSize){
+        return -1;
+    }
+    memmove(buffer, (char*)buffer + sizeof(uint16_t), messageSize);
+    return messageSize;
+}
+
+std::string peerAddress(int socket){
+    struct sockaddr_in peerAddr;
+    socklen_t len = sizeof(peerAddr);
+    if(getpeername(socket, (struct sockaddr *)&peerAddr, &len) < 0){
+        return "";
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peerAddr.sin_addr, ip, sizeof(ip));
+    return std::string(ip);
+}
+
+size_t sendFileTCP(int sendSocket, int fileDescriptor, off_t *offset, size_t count){
+    ssize_t numberOfBytes = sendfile(sendSocket, fileDescriptor, offset, count);
+    if(numberOfBytes < 0){
+        throw DisconnectionException();
+    }
+    if(numberOfBytes == 0){
+        //file shorter than announced
+        throw NetworkException();
+    }
     return numberOfBytes;
 }
\ No newline at end of file
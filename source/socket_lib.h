@@ -1,5 +1,18 @@
+#ifndef SOCKET_LIB
+#define SOCKET_LIB
+
 #include <exception>
+#include <string>
+#include <sys/types.h>
 #define DIM_IP 16
+#define TCP_BATCH_MAX 64 //messages sendTCPBatch takes at once
+
+// first byte of the client hello: its DH public value, after a cookie with HANDSHAKE_COOKIE
+#define HANDSHAKE_HELLO 'H'
+// first byte of the server answer to the hello
+#define HANDSHAKE_KEY 'K'
+#define HANDSHAKE_COOKIE 'C'
+#define HANDSHAKE_BUSY 'B'
 
 class SocketLibException : public std::exception
 {
@@ -22,5 +35,23 @@ class NetworkException : public SocketLibException
    }
 };
 
+// small messages leave at once (commands wait for their answer)
+void setNoDelay(int socket);
 void sendTCP(int sendSocket, void *buffer, size_t bufferSize);
-int recvTCP(int listenSocket, void **buffer);
\ No newline at end of file
+int recvTCP(int listenSocket, void **buffer);
+// count (up to TCP_BATCH_MAX) messages framed as sendTCP does, in as few system calls as the socket buffer allows
+void sendTCPBatch(int sendSocket, void **buffers, size_t *sizes, int count);
+// one message framed as sendTCP does, made of header then buffer, without copying them together
+void sendTCPWithHeader(int sendSocket, void *header, size_t headerSize, void *buffer, size_t bufferSize);
+// unframed data: exactly bufferSize bytes
+void sendRawTCP(int sendSocket, const void *buffer, size_t bufferSize);
+void recvRawTCP(int listenSocket, void *buffer, size_t bufferSize);
+// the message framed as sendTCP does if the whole of it is already received, left
+// in the socket; -1 if it is not (or is longer than bufferSize), without waiting
+int peekTCP(int listenSocket, void *buffer, size_t bufferSize);
+// address of the other end, without the port
+std::string peerAddress(int socket);
+// sends count bytes of fileDescriptor from *offset with sendfile(), advancing *offset
+size_t sendFileTCP(int sendSocket, int fileDescriptor, off_t *offset, size_t count);
+
+#endif
\ No newline at end of file